@@ -0,0 +1,465 @@
+/* Benchmark suite for dsh; prints one JSON object on stdout.
+ *
+ * Drives the shell two ways: over a pty, the way a user at a terminal
+ * does, timing from writing a command line to the next prompt; and in
+ * batch mode, timing whole "dsh script" and "dsh -c" runs. Covers:
+ *   prompt   prompt-to-prompt latency of a builtin and an exec'd no-op
+ *   stages   launch cost per job and per stage of 1..16 stage pipelines
+ *   pipe     bulk MB/s through a three-stage pipeline
+ *   parse    lines/s and MB/s of readcmdline() over a large script
+ *   loop     rounds/s of a for loop body, against the same commands as lines
+ *   jobs     bg launch, jobs and kill latency with thousands of live jobs
+ *   fds      descriptors dsh holds before and after many redirected jobs
+ *
+ * Usage: dsh_bench [-l label] [-q] [dsh]
+ * -l tags the output (e.g. a git revision) and -q shrinks every run for a
+ * quick check. The shell under test logs to /dev/null.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+static char *dsh = "./dsh";
+static int scale = 1; /* divisor applied to every iteration count */
+
+static double now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void die(const char *what) {
+	perror(what);
+	exit(1);
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* "mean": .., "p50": .., "p99": .. of n samples, which get sorted */
+static void print_stats(const char *name, double *us, int n, const char *sep) {
+	double sum = 0;
+	int i;
+	for(i = 0; i < n; i++)
+		sum += us[i];
+	qsort(us, n, sizeof(double), compare_double);
+	printf("\"%s\": {\"n\": %d, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f}%s",
+		name, n, sum / n, us[n / 2], us[n * 99 / 100], sep);
+}
+
+/* A dsh on the slave side of a pty. dsh does not run as the session
+ * leader (it could not set up its process group), so an intermediate
+ * child holds the session and waits for it. */
+typedef struct {
+	pid_t pid;
+	int fd;
+	char buf[65536];
+	size_t len;
+} pty_shell_t;
+
+/* Read until the output ends in a prompt ("$ "); false on EOF/timeout */
+static bool pty_wait_prompt(pty_shell_t *sh, int timeout_ms) {
+	struct pollfd pfd = { sh->fd, POLLIN, 0 };
+	sh->len = 0;
+	while(1) {
+		if(poll(&pfd, 1, timeout_ms) <= 0)
+			return false;
+		ssize_t n = read(sh->fd, sh->buf + sh->len, sizeof(sh->buf) - 1 - sh->len);
+		if(n <= 0)
+			return false;
+		sh->len += n;
+		if(sh->len >= 2 && memcmp(sh->buf + sh->len - 2, "$ ", 2) == 0)
+			return true;
+		if(sh->len > sizeof(sh->buf) / 2) { /* keep only the tail */
+			memmove(sh->buf, sh->buf + sh->len - 2, 2);
+			sh->len = 2;
+		}
+	}
+}
+
+/* Make sure every line sent so far has run: a job notification redraws
+ * the prompt, so one can be mistaken for the end of a later command */
+static void pty_sync(pty_shell_t *sh) {
+	static const char marker[] = "\ndsh_bench_sync";
+	struct pollfd pfd = { sh->fd, POLLIN, 0 };
+	size_t keep = sizeof(marker) - 1;
+
+	if(write(sh->fd, "echo dsh_bench_sync\n", 20) < 0)
+		die("write");
+	sh->len = 0;
+	while(!memmem(sh->buf, sh->len, marker, keep)) {
+		if(poll(&pfd, 1, 60000) <= 0)
+			break;
+		if(sh->len > sizeof(sh->buf) / 2) {
+			memmove(sh->buf, sh->buf + sh->len - keep, keep);
+			sh->len = keep;
+		}
+		ssize_t n = read(sh->fd, sh->buf + sh->len, sizeof(sh->buf) - sh->len);
+		if(n <= 0)
+			break;
+		sh->len += n;
+	}
+	if(sh->len < 2 || memcmp(sh->buf + sh->len - 2, "$ ", 2) != 0)
+		pty_wait_prompt(sh, 1000);
+}
+
+/* Throw away output that arrived unasked, e.g. job notifications */
+static void pty_drain(pty_shell_t *sh) {
+	struct pollfd pfd = { sh->fd, POLLIN, 0 };
+	while(poll(&pfd, 1, 0) > 0 && read(sh->fd, sh->buf, sizeof(sh->buf)) > 0)
+		;
+}
+
+static void pty_start(pty_shell_t *sh) {
+	switch((sh->pid = forkpty(&sh->fd, NULL, NULL, NULL))) {
+	case -1:
+		die("forkpty");
+	case 0: {
+		pid_t child = fork();
+		if(child == 0) {
+			execl(dsh, dsh, (char *)NULL);
+			_exit(127);
+		}
+		int status;
+		waitpid(child, &status, 0);
+		_exit(0);
+	}
+	}
+	if(!pty_wait_prompt(sh, 5000)) {
+		fprintf(stderr, "dsh_bench: no prompt from %s\n", dsh);
+		exit(1);
+	}
+}
+
+static void pty_stop(pty_shell_t *sh) {
+	int status;
+	close(sh->fd);
+	kill(sh->pid, SIGKILL);
+	waitpid(sh->pid, &status, 0);
+}
+
+/* Microseconds from sending line to the next prompt */
+static double pty_command(pty_shell_t *sh, const char *line) {
+	pty_drain(sh);
+	double start = now_us();
+	if(write(sh->fd, line, strlen(line)) < 0)
+		die("write");
+	if(!pty_wait_prompt(sh, 10000)) {
+		fprintf(stderr, "dsh_bench: no prompt after %s", line);
+		exit(1);
+	}
+	return now_us() - start;
+}
+
+/* Run dsh with args in batch mode, output to /dev/null; wall time in us */
+static double batch_run(char *const args[]) {
+	int status;
+	double start = now_us();
+	pid_t pid = fork();
+	if(pid < 0)
+		die("fork");
+	if(pid == 0) {
+		int null = open("/dev/null", O_RDWR);
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		execv(dsh, args);
+		_exit(127);
+	}
+	waitpid(pid, &status, 0);
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "dsh_bench: %s failed\n", dsh);
+		exit(1);
+	}
+	return now_us() - start;
+}
+
+/* Write a script of n copies of line to a temporary file */
+static char *make_script(const char *line, int n, size_t *bytes) {
+	static char path[64];
+	strcpy(path, "/tmp/dsh_bench.XXXXXX");
+	int fd = mkstemp(path);
+	if(fd < 0)
+		die("mkstemp");
+	FILE *f = fdopen(fd, "w");
+	int i;
+	for(i = 0; i < n; i++)
+		fputs(line, f);
+	if(bytes)
+		*bytes = ftell(f);
+	fclose(f);
+	return path;
+}
+
+static void bench_prompt() {
+	pty_shell_t sh;
+	int n = 2000 / scale, m = 500 / scale, i;
+	double *us = malloc(n * sizeof(double));
+
+	pty_start(&sh);
+	for(i = 0; i < n; i++)
+		us[i] = pty_command(&sh, "true\n");
+	printf("\"prompt\": {");
+	print_stats("builtin", us, n, ", ");
+	for(i = 0; i < m; i++)
+		us[i] = pty_command(&sh, "/bin/true\n");
+	print_stats("exec", us, m, "}");
+	pty_stop(&sh);
+	free(us);
+}
+
+static void bench_stages() {
+	static const int stages[] = { 1, 2, 4, 8, 16 };
+	int jobs = 200 / scale, k, i;
+	char line[512];
+
+	printf("\"stages\": [");
+	for(k = 0; k < 5; k++) {
+		line[0] = '\0';
+		for(i = 0; i < stages[k]; i++)
+			strcat(line, i ? " | /bin/true" : "/bin/true");
+		strcat(line, "\n");
+		char *script = make_script(line, jobs, NULL);
+		char *args[] = { dsh, script, NULL };
+		double us = batch_run(args) / jobs;
+		unlink(script);
+		printf("%s{\"stages\": %d, \"us_per_job\": %.1f, \"us_per_stage\": %.1f}",
+			k ? ", " : "", stages[k], us, us / stages[k]);
+	}
+	printf("]");
+}
+
+static void bench_pipe() {
+	long mb = 512 / scale;
+	char path[] = "/tmp/dsh_bench.XXXXXX", cmd[256];
+	int fd = mkstemp(path);
+	if(fd < 0 || ftruncate(fd, mb << 20) < 0)
+		die(path);
+	close(fd);
+
+	/* the planner turns the first cat into a redirection: two pipes */
+	snprintf(cmd, sizeof(cmd), "/bin/cat %s | /bin/cat | /bin/cat > /dev/null", path);
+	char *args[] = { dsh, "-c", cmd, NULL };
+	double us = batch_run(args);
+	unlink(path);
+	printf("\"pipe\": {\"mb\": %ld, \"stages\": 3, \"mb_per_s\": %.1f}", mb, mb / (us / 1e6));
+}
+
+static void bench_parse() {
+	int lines = 200000 / scale;
+	size_t bytes;
+	char *script = make_script("true alpha 'beta gamma' \"delta\" epsilon\\ zeta; true eta # theta\n",
+		lines, &bytes);
+	char *args[] = { dsh, script, NULL };
+	double us = batch_run(args);
+	unlink(script);
+	printf("\"parse\": {\"lines\": %d, \"lines_per_s\": %.0f, \"mb_per_s\": %.1f}",
+		lines, lines / (us / 1e6), bytes / (us / 1e6) / (1 << 20));
+}
+
+/* A loop body is parsed once; the same builtin given as script lines is
+ * parsed every time */
+static void bench_loop() {
+	int outer = 200 / scale, inner = 100, i, n;
+	char *script, *cmd = malloc(64 + 4 * (outer + inner)), *p = cmd;
+
+	p += sprintf(p, "for a in");
+	for(i = 0; i < outer; i++)
+		p += sprintf(p, " %d", i);
+	p += sprintf(p, "; do for b in");
+	for(i = 0; i < inner; i++)
+		p += sprintf(p, " %d", i);
+	sprintf(p, "; do true $a $b; done; done");
+	n = outer * inner;
+	char *args[] = { dsh, "-c", cmd, NULL };
+	double loop_us = batch_run(args);
+	script = make_script("true 123 45\n", n, NULL);
+	char *sargs[] = { dsh, script, NULL };
+	double lines_us = batch_run(sargs);
+	unlink(script);
+	free(cmd);
+	printf("\"loop\": {\"rounds\": %d, \"rounds_per_s\": %.0f, \"lines_per_s\": %.0f}",
+		n, n / (loop_us / 1e6), n / (lines_us / 1e6));
+}
+
+static void bench_jobs() {
+	pty_shell_t sh;
+	int n = 2000 / scale, window = n / 10, q = 20, i;
+	double *us = malloc(n * sizeof(double));
+	char line[64];
+
+	pty_start(&sh);
+	printf("\"jobs\": {\"live\": %d, ", n);
+	for(i = 0; i < n; i++)
+		us[i] = pty_command(&sh, "/bin/sleep 600 &\n");
+	pty_sync(&sh);
+	/* launch cost with an empty table against a full one */
+	print_stats("bg_first", us, window, ", ");
+	print_stats("bg_last", us + n - window, window, ", ");
+	for(i = 0; i < q; i++)
+		us[i] = pty_command(&sh, "jobs > /dev/null\n");
+	print_stats("jobs", us, q, ", ");
+	snprintf(line, sizeof(line), "kill -s CONT %%%d\n", n);
+	for(i = 0; i < q; i++) /* lookups by id at the far end of the table */
+		us[i] = pty_command(&sh, line);
+	print_stats("lookup", us, q, ", ");
+	for(i = 0; i < n; i++) {
+		snprintf(line, sizeof(line), "kill %%%d\n", i + 1);
+		us[i] = pty_command(&sh, line);
+	}
+	print_stats("kill", us, n, ", ");
+	pty_sync(&sh);
+	double start = now_us();
+	pty_command(&sh, "wait\n");
+	pty_sync(&sh);
+	printf("\"wait_all_us\": %.1f}", now_us() - start);
+	pty_stop(&sh);
+	free(us);
+}
+
+/* Descriptors open in process pid */
+static int count_fds(pid_t pid) {
+	char path[64];
+	struct dirent *e;
+	int n = 0;
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+	DIR *dir = opendir(path);
+	if(!dir)
+		die(path);
+	while((e = readdir(dir)))
+		n += e->d_name[0] != '.';
+	closedir(dir);
+	return n;
+}
+
+/* Wait until a dsh reading commands from cmd has run everything sent */
+static void batch_sync(FILE *cmd, int out) {
+	static const char marker[] = "dsh_bench_sync\n";
+	char buf[4096];
+	size_t len = 0, keep = sizeof(marker) - 1;
+
+	fputs("echo dsh_bench_sync\n", cmd);
+	fflush(cmd);
+	while(!memmem(buf, len, marker, keep)) {
+		if(len > sizeof(buf) / 2) {
+			memmove(buf, buf + len - keep, keep);
+			len = keep;
+		}
+		ssize_t n = read(out, buf + len, sizeof(buf) - len);
+		if(n <= 0) {
+			fprintf(stderr, "dsh_bench: %s quit\n", dsh);
+			exit(1);
+		}
+		len += n;
+	}
+}
+
+static void bench_fds() {
+	static const char *lines[] = {
+		"echo a > %s/f 2>&1\n",
+		"echo b >> %s/f\n",
+		"true < %s/f 3< %s/f\n",
+		"echo c 2> %s/g 1>&2\n",
+	};
+	int n = 100000 / scale, in[2], out[2], i;
+	char dir[] = "/tmp/dsh_bench.XXXXXX", path[128];
+	pid_t pid;
+
+	if(!mkdtemp(dir) || pipe(in) < 0 || pipe(out) < 0)
+		die("setup");
+	if((pid = fork()) < 0)
+		die("fork");
+	if(pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execl(dsh, dsh, (char *)NULL);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	FILE *cmd = fdopen(in[1], "w");
+
+	batch_sync(cmd, out[0]);
+	int before = count_fds(pid);
+	double start = now_us();
+	for(i = 0; i < n; i++) {
+		/* every hundredth job runs programs, through both kinds of stage */
+		if(i % 100 == 99)
+			fprintf(cmd, "/bin/true < %s/f 2>> %s/g | /bin/cat 3> %s/g > /dev/null\n", dir, dir, dir);
+		else
+			fprintf(cmd, lines[i % 4], dir, dir);
+	}
+	batch_sync(cmd, out[0]);
+	double us = now_us() - start;
+	int after = count_fds(pid);
+
+	fclose(cmd);
+	close(out[0]);
+	waitpid(pid, NULL, 0);
+	snprintf(path, sizeof(path), "%s/f", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/g", dir);
+	unlink(path);
+	rmdir(dir);
+	printf("\"fds\": {\"jobs\": %d, \"us_per_job\": %.1f, \"fds_before\": %d, \"fds_after\": %d}",
+		n, us / n, before, after);
+	if(after > before)
+		fprintf(stderr, "dsh_bench: dsh leaked %d descriptors\n", after - before);
+}
+
+int main(int argc, char *argv[]) {
+	char *label = "";
+	int opt;
+
+	while((opt = getopt(argc, argv, "l:q")) != -1) {
+		if(opt == 'l')
+			label = optarg;
+		else if(opt == 'q')
+			scale = 10;
+		else {
+			fprintf(stderr, "usage: dsh_bench [-l label] [-q] [dsh]\n");
+			return 2;
+		}
+	}
+	if(optind < argc)
+		dsh = argv[optind];
+	setenv("DSH_LOG", "/dev/null", 1);
+	signal(SIGPIPE, SIG_IGN);
+
+	time_t t = time(NULL);
+	char when[32];
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+	printf("{\"label\": \"%s\", \"time\": \"%s\", \"cpus\": %ld,\n ", label, when,
+		sysconf(_SC_NPROCESSORS_ONLN));
+	bench_prompt();
+	printf(",\n ");
+	bench_stages();
+	printf(",\n ");
+	bench_pipe();
+	printf(",\n ");
+	bench_parse();
+	printf(",\n ");
+	bench_loop();
+	printf(",\n ");
+	bench_jobs();
+	printf(",\n ");
+	bench_fds();
+	printf("\n}\n");
+	return 0;
+}
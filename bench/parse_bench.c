@@ -0,0 +1,280 @@
+/* Parse throughput benchmark.
+ *
+ * Times parse_cmdline() from dsh.c against a reference copy of the parser
+ * it replaced (fixed 120-byte line, one calloc per word, a scratch copy per
+ * command) on the same command lines. Both sides free what they build so
+ * that only parsing is measured. dsh is timed with each command line
+ * scanner the CPU supports, after checking on random input that every
+ * scanner agrees with the scalar one. Usage: parse_bench [iterations]
+ */
+#define main dsh_main
+#include "../dsh.c"
+#undef main
+
+#include <time.h>
+
+/* ---- reference: the fixed-buffer parser ---- */
+
+#define LEGACY_LEN_CMDLINE 120
+#define LEGACY_LEN_FILENAME 80
+#define LEGACY_ARGS 20
+
+typedef struct legacy_process {
+	struct legacy_process *next;
+	int argc;
+	char **argv;
+} legacy_process_t;
+
+typedef struct legacy_job {
+	struct legacy_job *next;
+	char *commandinfo, *ifile, *ofile;
+	legacy_process_t *first_process;
+	bool bg;
+} legacy_job_t;
+
+static legacy_job_t *legacy_jobs;
+
+static void legacy_free() {
+	legacy_job_t *j, *jnext;
+	legacy_process_t *p, *pnext;
+	int i;
+	for(j = legacy_jobs; j; j = jnext) {
+		jnext = j->next;
+		for(p = j->first_process; p; p = pnext) {
+			pnext = p->next;
+			for(i = 0; i < p->argc; i++)
+				free(p->argv[i]);
+			free(p->argv);
+			free(p);
+		}
+		free(j->commandinfo);
+		free(j->ifile);
+		free(j->ofile);
+		free(j);
+	}
+	legacy_jobs = NULL;
+}
+
+static legacy_process_t *legacy_process(legacy_job_t *j, char *cmd) {
+	legacy_process_t *p = calloc(1, sizeof(*p)), **pp;
+	int pos = 0, argc = 0, k;
+	p->argv = calloc(LEGACY_ARGS, sizeof(char *));
+	for(pp = &j->first_process; *pp; pp = &(*pp)->next)
+		;
+	*pp = p;
+	while(isspace(cmd[pos])) ++pos;
+	while(cmd[pos] != '\0' && argc < LEGACY_ARGS - 1) {
+		p->argv[argc] = calloc(LEGACY_LEN_CMDLINE, sizeof(char));
+		k = 0;
+		while(cmd[pos] != '\0' && !isspace(cmd[pos]))
+			p->argv[argc][k++] = cmd[pos++];
+		++argc;
+		while(isspace(cmd[pos])) ++pos;
+	}
+	p->argc = argc;
+	return p;
+}
+
+static char *legacy_file(char *cmdline, int *pos) {
+	char *f = calloc(LEGACY_LEN_FILENAME, sizeof(char));
+	int k = 0;
+	++*pos;
+	while(isspace(cmdline[*pos])) ++*pos;
+	while(cmdline[*pos] != '\0' && !isspace(cmdline[*pos]) && k < LEGACY_LEN_FILENAME - 1)
+		f[k++] = cmdline[(*pos)++];
+	while(cmdline[*pos] != '\n' && isspace(cmdline[*pos])) ++*pos;
+	return f;
+}
+
+static void legacy_parse(char *text) {
+	char cmdline[LEGACY_LEN_CMDLINE] = "";
+	int pos = 0, seq_pos = 0;
+	strncpy(cmdline, text, LEGACY_LEN_CMDLINE - 1);
+	legacy_job_t **jp = &legacy_jobs;
+
+	while(1) {
+		int cmd_pos = 0;
+		bool sequence = false, end = false;
+		while(isspace(cmdline[pos])) ++pos;
+		if(cmdline[pos] == '\n' || cmdline[pos] == '\0')
+			return;
+		char *cmd = calloc(LEGACY_LEN_CMDLINE, sizeof(char));
+		legacy_job_t *j = calloc(1, sizeof(*j));
+		j->commandinfo = malloc(LEGACY_LEN_CMDLINE);
+		*jp = j;
+		jp = &j->next;
+		while(cmdline[pos] != '\n' && cmdline[pos] != '\0') {
+			switch(cmdline[pos]) {
+			case '<': j->ifile = legacy_file(cmdline, &pos); break;
+			case '>': j->ofile = legacy_file(cmdline, &pos); break;
+			case '|':
+				cmd[cmd_pos] = '\0';
+				legacy_process(j, cmd);
+				++pos;
+				cmd_pos = 0;
+				break;
+			case '&': j->bg = true; end = true; break;
+			case ';':
+				sequence = true;
+				strncpy(j->commandinfo, cmdline + seq_pos, pos - seq_pos);
+				seq_pos = pos + 1;
+				break;
+			case '#': end = true; break;
+			default:
+				if(cmd_pos < LEGACY_LEN_CMDLINE - 1)
+					cmd[cmd_pos++] = cmdline[pos];
+				++pos;
+			}
+			if(end || sequence)
+				break;
+		}
+		cmd[cmd_pos] = '\0';
+		legacy_process(j, cmd);
+		free(cmd);
+		if(!sequence) {
+			strncpy(j->commandinfo, cmdline + seq_pos, pos - seq_pos);
+			return;
+		}
+		++pos;
+	}
+}
+
+/* ---- scanner equivalence ---- */
+
+/* Render the parsed job list as text, to compare two parses */
+static size_t dump_jobs(char *buf, size_t size) {
+	job_t *j;
+	process_t *p;
+	size_t n = 0;
+	int i;
+	redir_t *r;
+	for(j = first_job; j && n < size; j = j->next) {
+		n += snprintf(buf + n, size - n, "[%d]", j->bg);
+		for(p = j->first_process; p && n < size; p = p->next) {
+			for(i = 0; i < p->argc && n < size; i++)
+				n += snprintf(buf + n, size - n, "<%s>", p->argv[i]);
+			for(r = p->redirs; r && n < size; r = r->next)
+				n += snprintf(buf + n, size - n, "{%d %d %d %s}", r->kind, r->fd,
+					r->from, r->kind == REDIR_DUP ? "-" : r->file);
+		}
+	}
+	return n < size ? n : size;
+}
+
+/* Random lines full of metacharacters, quotes and whitespace; every
+ * scanner must find the same offsets as the scalar one from every start,
+ * and whole lines must parse the same. Exits on the first difference,
+ * reporting it on err (stderr itself is /dev/null here). */
+static void check_scanners(long rounds, int err) {
+	static const char alphabet[] = "abcdefgh012 \t\v;&#'\"\\<>|*?[\001\200\377";
+	char line[300], copy[300], want[8192], got[8192];
+	scanner_t *scalar = &scanners[NSCANNERS - 1];
+	long r;
+	int i, k;
+
+	srand(1);
+	for(r = 0; r < rounds; r++) {
+		size_t len = rand() % sizeof(line), pos;
+		for(pos = 0; pos < len; pos++)
+			line[pos] = rand() % 4 ? 'a' + rand() % 8 : alphabet[rand() % (sizeof(alphabet) - 1)];
+		if(rand() % 8 == 0 && len > 0)
+			line[rand() % len] = '\0';
+
+		for(k = 0; k < NSCANNERS - 1; k++) {
+			if(!scanner_supported(&scanners[k]))
+				continue;
+			for(pos = 0; pos <= len; pos++)
+				if(scanners[k].job(line + pos, len - pos) != scalar->job(line + pos, len - pos)
+				   || scanners[k].word(line + pos, len - pos) != scalar->word(line + pos, len - pos)) {
+					dprintf(err, "%s scanner differs at offset %zu of round %ld\n",
+						scanners[k].name, pos, r);
+					exit(1);
+				}
+		}
+
+		size_t wlen = 0, glen;
+		for(i = NSCANNERS - 1; i >= 0; i--) {
+			if(!scanner_supported(&scanners[i]))
+				continue;
+			scanner = &scanners[i];
+			memcpy(copy, line, len);
+			parse_cmdline(copy, len);
+			glen = dump_jobs(got, sizeof(got));
+			while(first_job)
+				delete_job(first_job);
+			if(i == NSCANNERS - 1) {
+				memcpy(want, got, glen);
+				wlen = glen;
+			}
+			else if(glen != wlen || memcmp(want, got, glen) != 0) {
+				dprintf(err, "%s scanner parses round %ld differently\n", scanners[i].name, r);
+				exit(1);
+			}
+		}
+	}
+}
+
+/* ---- driver ---- */
+
+static char *lines[] = {
+	"/bin/ls -l\n",
+	"/usr/bin/grep -n pattern a.c b.c c.c d.c | /usr/bin/sort -u > matches.txt\n",
+	"/usr/bin/wc -l < input.txt ; /bin/echo done\n",
+	"/usr/bin/sort -k2 -n data.tsv | /usr/bin/uniq -c | /usr/bin/head -n 20 &\n",
+	"/bin/cp -r src dst # copy the tree\n",
+};
+
+static double now_s() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	long iterations = argc > 1 ? atol(argv[1]) : 200000;
+	size_t nlines = sizeof(lines) / sizeof(lines[0]);
+	size_t bytes = 0, i;
+	long n;
+	double t;
+
+	for(i = 0; i < nlines; i++)
+		bytes += strlen(lines[i]);
+	bytes *= iterations;
+
+	t = now_s();
+	for(n = 0; n < iterations; n++)
+		for(i = 0; i < nlines; i++) {
+			legacy_parse(lines[i]);
+			legacy_free();
+		}
+	t = now_s() - t;
+	printf("%-10s %12.0f lines/s %8.1f MB/s\n", "reference",
+	       iterations * nlines / t, bytes / t / 1e6);
+
+	/* parse errors are expected on random input */
+	int saved_stderr = dup(STDERR_FILENO), null = open("/dev/null", O_WRONLY);
+	dup2(null, STDERR_FILENO);
+	check_scanners(20000, saved_stderr);
+	dup2(saved_stderr, STDERR_FILENO);
+	close(saved_stderr);
+	close(null);
+
+	int k;
+	for(k = NSCANNERS - 1; k >= 0; k--) {
+		if(!scanner_supported(&scanners[k]))
+			continue;
+		scanner = &scanners[k];
+		t = now_s();
+		for(n = 0; n < iterations; n++)
+			for(i = 0; i < nlines; i++) {
+				parse_cmdline(lines[i], strlen(lines[i]));
+				while(first_job)
+					delete_job(first_job);
+			}
+		t = now_s() - t;
+		char name[32];
+		snprintf(name, sizeof(name), "dsh/%s", scanner->name);
+		printf("%-10s %12.0f lines/s %8.1f MB/s\n", name, iterations * nlines / t, bytes / t / 1e6);
+	}
+	return 0;
+}
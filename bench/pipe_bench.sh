@@ -0,0 +1,34 @@
+#!/bin/sh
+# Pipeline throughput in MB/s: default vs enlarged pipe buffers, an
+# exec'd tee vs the splice-based tee builtin, and "cat f | x" with the
+# planner on vs off. Usage: bench/pipe_bench.sh [size-in-MB]
+
+DSH=${DSH:-./dsh}
+MB=${1:-512}
+DATA=$(mktemp /tmp/pipe_bench.XXXXXX)
+trap 'rm -f "$DATA" "$DATA.out"' EXIT
+
+head -c $((MB << 20)) /dev/zero > "$DATA"
+
+# run NAME COMMAND: time one dsh -c run and report MB/s
+run() {
+	start=$(date +%s%N)
+	"$DSH" -c "$2" || exit 1
+	end=$(date +%s%N)
+	awk -v n="$1" -v mb="$MB" -v ns=$((end - start)) \
+		'BEGIN { printf "%-34s %9.1f MB/s\n", n, mb / (ns / 1e9) }'
+}
+
+echo "$MB MB through /bin/cat | /bin/cat > /dev/null"
+for size in 0 256k 1M; do
+	run "pipesize $size" "pipesize $size /bin/cat $DATA | /bin/cat | /bin/cat > /dev/null"
+done
+
+echo "tee to a file and a pipe"
+run "/usr/bin/tee" "/bin/cat $DATA | /usr/bin/tee $DATA.out | /bin/cat > /dev/null"
+run "tee builtin" "/bin/cat $DATA | tee $DATA.out | /bin/cat > /dev/null"
+run "tee builtin, pipesize 1M" "pipesize 1M /bin/cat $DATA | tee $DATA.out | /bin/cat > /dev/null"
+
+echo "cat file | wc -c"
+DSH_NOPLAN=1 run "planner off" "/bin/cat $DATA | /usr/bin/wc -c > /dev/null"
+run "planner on" "/bin/cat $DATA | /usr/bin/wc -c > /dev/null"
@@ -0,0 +1,84 @@
+/* Spawn latency benchmark for the dsh launch backends.
+ *
+ * Grows the resident set of this process to each size in rss_mb[] and then
+ * times fork()+execve() against posix_spawn() of the same short-lived
+ * program, the two paths spawn_job() chooses between (see launch_process()
+ * in dsh.c). Usage: spawn_bench [iterations] [program]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static int rss_mb[] = { 0, 64, 256, 1024 };
+
+static char *envp[] = { NULL };
+
+static double now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double time_fork(char **argv, int iterations) {
+	int i, status;
+	double start = now_us();
+	for(i = 0; i < iterations; i++) {
+		pid_t pid = fork();
+		if(pid == 0) {
+			setpgid(0, 0);
+			execve(argv[0], argv, envp);
+			_exit(127);
+		}
+		waitpid(pid, &status, 0);
+	}
+	return (now_us() - start) / iterations;
+}
+
+static double time_spawn(char **argv, int iterations) {
+	int i, status;
+	pid_t pid;
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+	double start = now_us();
+	for(i = 0; i < iterations; i++) {
+		if(posix_spawn(&pid, argv[0], NULL, &attr, argv, envp) != 0) {
+			perror("posix_spawn");
+			exit(1);
+		}
+		waitpid(pid, &status, 0);
+	}
+	posix_spawnattr_destroy(&attr);
+	return (now_us() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 500;
+	char *cmd[] = { argc > 2 ? argv[2] : "/bin/true", NULL };
+	char *ballast = NULL;
+	size_t i;
+
+	printf("%8s %12s %12s\n", "rss_mb", "fork_us", "spawn_us");
+	for(i = 0; i < sizeof(rss_mb) / sizeof(rss_mb[0]); i++) {
+		size_t len = (size_t)rss_mb[i] << 20;
+		free(ballast);
+		ballast = NULL;
+		if(len) {
+			if(!(ballast = malloc(len))) {
+				perror("malloc");
+				return 1;
+			}
+			memset(ballast, 1, len); /* touch every page */
+		}
+		printf("%8d %12.1f %12.1f\n", rss_mb[i],
+		       time_fork(cmd, iterations), time_spawn(cmd, iterations));
+	}
+	free(ballast);
+	return 0;
+}
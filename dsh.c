@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* posix_spawn_file_actions_*_np */
 #include <fcntl.h>
 #include <termios.h>
 #include <unistd.h> /* getpid()*/
@@ -8,11 +9,34 @@
 #include <string.h>
 #include <syslog.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <malloc.h> /* mallinfo2 */
+#include <time.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h> /* SSE2/AVX2 scanners */
+#endif
+#include <sys/resource.h> /* wait4, getrusage */
+#include <sys/time.h> /* timeradd */
+#include <stdarg.h>
+#include <dirent.h> /* getdents64 */
+#include <limits.h> /* PATH_MAX */
+#include <sys/mman.h>
+#include <sys/file.h> /* flock */
+#include <sys/uio.h> /* writev */
+#include <sys/ioctl.h> /* TIOCGWINSZ */
+#include <poll.h>
+#include <linux/fs.h> /* FICLONE */
+#include <sched.h> /* sched_setaffinity, SCHED_BATCH, SCHED_IDLE */
+#include <sys/syscall.h> /* ioprio_set, set_mempolicy */
+#include <linux/ioprio.h>
+#include <linux/mempolicy.h>
 
 #include "dsh.h"
 
-enum{ max_num_jobs = 20};
-
 int isspace(int c);
 
 /* Keep track of attributes of the shell.  */
@@ -21,31 +45,509 @@ struct termios shell_tmodes;
 int shell_terminal;
 int shell_is_interactive;
 
+/* How spawn_job() starts each process; see launch_process() */
+launch_t launch_backend = LAUNCH_SPAWN;
+
+/* Event loop: SIGCHLD is blocked and read from sigchld_fd, which is
+ * multiplexed with the terminal on event_fd (epoll). Children are started
+ * with the mask the shell had before that (shell_sigmask). */
+int sigchld_fd = -1;
+int event_fd = -1;
+sigset_t shell_sigmask;
+
+/* Output capture of background jobs; see capture_start() */
+int capture_set = -1;		/* epoll set of the open capture pipes, in event_fd */
+capture_t *captures;		/* oldest first */
+size_t capture_size;		/* ring size for new & jobs; 0 turns capture off */
+size_t capture_limit = 64 << 20; /* cap on the rings of all captures together */
+size_t capture_used;		/* bytes mapped for rings */
+int capture_open;		/* captures whose pipe is still open */
+
+/* Where commands come from: the terminal or stdin, a script file, or the
+ * string given to -c */
+input_t shell_input = { STDIN_FILENO };
+
+/* Capacity (F_SETPIPE_SZ) of the pipes between stages; 0 keeps the
+ * kernel default. A job's own pipe_size overrides it. */
+int pipe_capacity = 0;
+
+/* Rewrite redundant pipeline stages before spawning; see plan_job() */
+bool plan_pipelines = true;
+
+/* Read interactive command lines with edit_line() */
+bool edit_enabled = false;
+
+/* Exit status of the last command, as the shell would report it */
+int last_status = 0;
+
+/* State of the compound command being run; see run_node() */
+int loop_depth;			/* loops around the command running */
+int breaking;			/* loops left to leave, after break or continue */
+bool continuing;		/* then start the next round of the innermost */
+int func_depth;			/* function calls in progress */
+bool returning;			/* return was run in a function */
+volatile sig_atomic_t interrupted;	/* ^C or ^Z stopped a command */
+func_t *functions;		/* defined with name() ... */
+
+/* The environment of children when there is no memory for a real one */
+char *empty_envp[] = { NULL };
+
 void init_shell();
+void env_init();
 void spawn_job(job_t *j, bool fg);
+void finishFGJob(job_t *j);
+int delete_job(job_t *job);
+builtin_t *find_builtin(char *name);
+int run_builtin(builtin_t *b, job_t *j);
+int apply_prefixes(job_t *j);
+int mark_process_status(pid_t pid, int status, struct rusage *ru);
+int job_exit_status(job_t *j);
+int set_scanner(char *name);
+int process_exit_status(process_t *p);
+void print_job_times(job_t *j, int out);
+int write_all(int fd, const char *buf, size_t len);
+long parse_size(char *arg);
+double elapsed_since(struct timespec *a, struct timespec *b);
 job_t * find_job(pid_t pgid);
 int job_is_stopped(job_t *j);
 int job_is_completed(job_t *j);
 bool free_job(job_t *j);
+bool add_arg(process_t *p, char *word, arena_t *arena);
+char *hist_expand(char *line, size_t *len);
+ssize_t edit_line(char *prompt, char **line);
+void hist_add(const char *line, size_t len);
+void capture_drain(capture_t *c);
+void capture_drain_ready();
+bool cache_replay(job_t *j);
+void cache_store(job_t *j);
+process_t *find_last_process(job_t *j);
+bool sched_apply(sched_req_t *s, pid_t tid);
+int parse_sched(sched_req_t *s, char **argv, int argc);
+void sched_describe(sched_req_t *s, char *buf, size_t size);
+bool sched_job(job_t *j, sched_req_t *s);
+bool is_meta(char c);
+void close_heredocs(job_t *j);
+void free_node(node_t *n);
+arena_t *arena_reset(arena_t *a);
+int run_node(node_t *n);
 
 
 char prompt_pid[32];
 
-job_t* jobs[max_num_jobs] = {NULL};
+/* Per-job arena. Everything readcmdline() builds for a job -- the job_t,
+ * its process_t list, argv arrays and strings -- is bump-allocated from one
+ * arena, and free_job() hands the whole arena back at once. The first chunk
+ * is sized so that an ordinary command line needs a single malloc. */
+enum { ARENA_CHUNK = 4096 };
+
+/* Allocation counters, dumped by the memstats builtin */
+struct {
+	unsigned long arenas, arenas_live;
+	unsigned long chunks, chunks_live;
+	unsigned long allocs;
+	size_t bytes_live;
+} arena_stats;
+
+arena_chunk_t *arena_chunk(size_t size) {
+	arena_chunk_t *c = (arena_chunk_t *)malloc(sizeof(arena_chunk_t) + size);
+	if(!c)
+		return NULL;
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	arena_stats.chunks++;
+	arena_stats.chunks_live++;
+	arena_stats.bytes_live += size;
+	return c;
+}
+
+/* Returns zeroed memory; NULL when out of memory */
+void *arena_alloc(arena_t *a, size_t size) {
+	arena_chunk_t *c = a->chunk;
+	size = (size + 15) & ~(size_t)15;
+	if(c->size - c->used < size) {
+		arena_chunk_t *nc = arena_chunk(size > c->size * 2 ? size : c->size * 2);
+		if(!nc)
+			return NULL;
+		nc->next = c;
+		a->chunk = c = nc;
+	}
+	void *mem = c->data + c->used;
+	c->used += size;
+	arena_stats.allocs++;
+	memset(mem, 0, size);
+	return mem;
+}
+
+char *arena_strndup(arena_t *a, const char *str, size_t len) {
+	char *dup = (char *)arena_alloc(a, len + 1);
+	if(dup)
+		memcpy(dup, str, len);
+	return dup;
+}
+
+/* The arena header lives at the start of its own first chunk */
+arena_t *arena_new() {
+	arena_chunk_t *c = arena_chunk(ARENA_CHUNK);
+	if(!c)
+		return NULL;
+	arena_t *a = (arena_t *)c->data;
+	c->used = (sizeof(arena_t) + 15) & ~(size_t)15;
+	a->chunk = c;
+	arena_stats.arenas++;
+	arena_stats.arenas_live++;
+	return a;
+}
+
+/* Hand back everything allocated from a, keeping only its newest and
+ * largest chunk, so an arena filled to about the same size each time
+ * settles at one chunk and no malloc. The header moves into that chunk;
+ * returns its new address. */
+arena_t *arena_reset(arena_t *a) {
+	arena_chunk_t *c = a->chunk, *old, *onext;
+	for(old = c->next; old; old = onext) {
+		onext = old->next;
+		arena_stats.chunks_live--;
+		arena_stats.bytes_live -= old->size;
+		free(old);
+	}
+	a = (arena_t *)c->data;
+	a->chunk = c;
+	c->next = NULL;
+	c->used = (sizeof(arena_t) + 15) & ~(size_t)15;
+	return a;
+}
+
+void arena_release(arena_t *a) {
+	arena_chunk_t *c, *cnext;
+	if(!a)
+		return;
+	arena_stats.arenas_live--;
+	for(c = a->chunk; c; c = cnext) {
+		cnext = c->next;
+		arena_stats.chunks_live--;
+		arena_stats.bytes_live -= c->size;
+		free(c);
+	}
+}
+
+void print_memstats(int out) {
+	struct mallinfo2 mi = mallinfo2();
+	dprintf(out, "arenas: %lu live, %lu total\n", arena_stats.arenas_live, arena_stats.arenas);
+	dprintf(out, "chunks: %lu live, %lu total, %zu bytes live\n",
+		arena_stats.chunks_live, arena_stats.chunks, arena_stats.bytes_live);
+	dprintf(out, "arena allocations: %lu\n", arena_stats.allocs);
+	dprintf(out, "heap in use: %zu bytes\n", mi.uordblks);
+}
+
+/* Event log. Job lifecycle events -- parse, spawn, stop, continue, exit,
+ * done -- are formatted as one-line "seconds event key=value ..." records
+ * into log_buf and written to log_fd in batches: when the buffer fills,
+ * before the shell blocks for input and at exit. The log has its own
+ * close-on-exec descriptor, so fd 2 stays the shell's stderr and children
+ * never write into the log by accident.
+ *
+ * DSH_LOG names the file (default dsh.log; empty turns logging off) and
+ * DSH_LOG_MODE is append (default), truncate or rotate. In rotate mode a
+ * log that has grown past DSH_LOG_MAX bytes (default 1M) is renamed to
+ * file.1, shifting older ones up to file.LOG_KEEP. */
+#define LOG_BUF 65536
+#define LOG_RECORD 1024 /* longest record; longer ones are cut */
+#define LOG_KEEP 3
+
+int log_fd = -1;
+char log_buf[LOG_BUF];
+size_t log_len;
+char log_path[4096];
+bool log_rotate;
+long log_max = 1 << 20;
+off_t log_size;
+struct timespec log_epoch;
+
+/* Move log_path to log_path.1, shifting the older ones, and start anew */
+void log_rotate_now() {
+	char from[4096 + 16], to[4096 + 16];
+	int i;
+
+	close(log_fd);
+	for(i = LOG_KEEP - 1; i > 0; i--) {
+		snprintf(from, sizeof(from), "%s.%d", log_path, i);
+		snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", log_path);
+	rename(log_path, to);
+	log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	log_size = 0;
+}
+
+/* Write out the buffered records in one write(2) */
+void log_flush() {
+	if(log_fd < 0 || log_len == 0)
+		return;
+	if(write_all(log_fd, log_buf, log_len) < 0) {
+		perror("dsh: log");
+		close(log_fd);
+		log_fd = -1;
+		log_len = 0;
+		return;
+	}
+	log_size += log_len;
+	log_len = 0;
+	if(log_rotate && log_size >= log_max)
+		log_rotate_now();
+}
+
+/* Append a record for event; fmt and the arguments give its fields */
+void log_event(const char *event, const char *fmt, ...) {
+	struct timespec now;
+	va_list ap;
+	int n;
+
+	if(log_fd < 0)
+		return;
+	if(LOG_BUF - log_len < LOG_RECORD)
+		log_flush();
+
+	char *rec = log_buf + log_len;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	n = snprintf(rec, LOG_RECORD, "%.6f %s ", elapsed_since(&log_epoch, &now), event);
+	va_start(ap, fmt);
+	n += vsnprintf(rec + n, LOG_RECORD - n, fmt, ap);
+	va_end(ap);
+	if(n > LOG_RECORD - 1)
+		n = LOG_RECORD - 1;
+	rec[n++] = '\n';
+	log_len += n;
+}
+
+/* Open the log as DSH_LOG* ask; see above */
+void log_open() {
+	char *path = getenv("DSH_LOG"), *mode = getenv("DSH_LOG_MODE"), *max = getenv("DSH_LOG_MAX");
+	int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+	struct stat st;
+	time_t t = time(NULL);
+	char when[32];
+
+	if(!path)
+		path = "dsh.log";
+	if(!*path)
+		return;
+	if(mode && strcmp(mode, "truncate") == 0)
+		flags |= O_TRUNC;
+	else if(mode && strcmp(mode, "rotate") == 0)
+		log_rotate = true;
+	else if(mode && strcmp(mode, "append") != 0)
+		fprintf(stderr, "DSH_LOG_MODE: unknown mode %s\n", mode);
+	if(max && (log_max = parse_size(max)) <= 0) {
+		fprintf(stderr, "DSH_LOG_MAX: invalid size %s\n", max);
+		log_max = 1 << 20;
+	}
+
+	/* rotation renames by path, which must survive cd */
+	if(path[0] == '/' || !getcwd(log_path, sizeof(log_path) - strlen(path) - 2))
+		snprintf(log_path, sizeof(log_path), "%s", path);
+	else
+		snprintf(log_path + strlen(log_path), sizeof(log_path) - strlen(log_path), "/%s", path);
+
+	if((log_fd = open(log_path, flags, 0666)) < 0) {
+		perror(log_path);
+		return;
+	}
+	if(fstat(log_fd, &st) == 0)
+		log_size = st.st_size;
+	if(log_rotate && log_size >= log_max)
+		log_rotate_now();
+
+	clock_gettime(CLOCK_MONOTONIC, &log_epoch);
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+	log_event("start", "pid=%d time=%s", (int)getpid(), when);
+	atexit(log_flush);
+}
 
 /* Initializing the header for the job list. The active jobs are linked into a list. */
 job_t *first_job = NULL;
+job_t *last_job = NULL;
+
+/* Jobs by job id. Ids are small and stable: a job keeps its id until it is
+ * deleted, and a new job takes the lowest free id. */
+job_t **job_table = NULL;
+int job_table_size = 0;
+int job_table_free = 1; /* no id below this one is free */
+
+/* Hash indexes over the job list, chained through hash_next: pid -> process
+ * and pgid -> job. Bucket counts are powers of two and double once the
+ * table holds as many entries as buckets. */
+process_t **pid_index = NULL;
+size_t pid_index_size = 0, pid_index_count = 0;
+job_t **pgid_index = NULL;
+size_t pgid_index_size = 0, pgid_index_count = 0;
+
+/* Jobs whose processes changed state since the last do_job_notification() */
+job_t *changed_jobs = NULL;
+
+size_t hash_pid(pid_t pid, size_t size) {
+	return ((uint32_t)pid * 2654435761u) & (size - 1);
+}
+
+bool grow_pid_index() {
+	size_t size = pid_index_size ? pid_index_size * 2 : 64;
+	process_t **buckets = (process_t **)calloc(size, sizeof(process_t *));
+	if(!buckets)
+		return false;
+	size_t i;
+	for(i = 0; i < pid_index_size; i++) {
+		process_t *p, *pnext;
+		for(p = pid_index[i]; p; p = pnext) {
+			pnext = p->hash_next;
+			p->hash_next = buckets[hash_pid(p->pid, size)];
+			buckets[hash_pid(p->pid, size)] = p;
+		}
+	}
+	free(pid_index);
+	pid_index = buckets;
+	pid_index_size = size;
+	return true;
+}
+
+void index_process(process_t *p) {
+	if(pid_index_count >= pid_index_size && !grow_pid_index() && !pid_index_size)
+		return;
+	size_t h = hash_pid(p->pid, pid_index_size);
+	p->hash_next = pid_index[h];
+	pid_index[h] = p;
+	pid_index_count++;
+}
+
+void unindex_process(process_t *p) {
+	if(p->pid <= 0 || !pid_index_size)
+		return;
+	process_t **pp;
+	for(pp = &pid_index[hash_pid(p->pid, pid_index_size)]; *pp; pp = &(*pp)->hash_next)
+		if(*pp == p) {
+			*pp = p->hash_next;
+			pid_index_count--;
+			return;
+		}
+}
+
+/* Find the process with the indicated pid.  */
+process_t *find_process(pid_t pid) {
+	if(!pid_index_size)
+		return NULL;
+	process_t *p;
+	for(p = pid_index[hash_pid(pid, pid_index_size)]; p; p = p->hash_next)
+		if(p->pid == pid)
+			return p;
+	return NULL;
+}
+
+bool grow_pgid_index() {
+	size_t size = pgid_index_size ? pgid_index_size * 2 : 64;
+	job_t **buckets = (job_t **)calloc(size, sizeof(job_t *));
+	if(!buckets)
+		return false;
+	size_t i;
+	for(i = 0; i < pgid_index_size; i++) {
+		job_t *j, *jnext;
+		for(j = pgid_index[i]; j; j = jnext) {
+			jnext = j->hash_next;
+			j->hash_next = buckets[hash_pid(j->pgid, size)];
+			buckets[hash_pid(j->pgid, size)] = j;
+		}
+	}
+	free(pgid_index);
+	pgid_index = buckets;
+	pgid_index_size = size;
+	return true;
+}
+
+void index_job(job_t *j) {
+	if(pgid_index_count >= pgid_index_size && !grow_pgid_index() && !pgid_index_size)
+		return;
+	size_t h = hash_pid(j->pgid, pgid_index_size);
+	j->hash_next = pgid_index[h];
+	pgid_index[h] = j;
+	pgid_index_count++;
+}
+
+void unindex_job(job_t *j) {
+	if(j->pgid <= 0 || !pgid_index_size)
+		return;
+	job_t **jp;
+	for(jp = &pgid_index[hash_pid(j->pgid, pgid_index_size)]; *jp; jp = &(*jp)->hash_next)
+		if(*jp == j) {
+			*jp = j->hash_next;
+			pgid_index_count--;
+			return;
+		}
+}
 
 /* Find the job with the indicated pgid.  */
 job_t *find_job(pid_t pgid) {
 
+	if(!pgid_index_size)
+		return NULL;
 	job_t *j;
-	for(j = first_job; j; j = j->next)
+	for(j = pgid_index[hash_pid(pgid, pgid_index_size)]; j; j = j->hash_next)
 		if(j->pgid == pgid)
 	    		return j;
 	return NULL;
 }
 
+/* Find the job with the indicated job id.  */
+job_t *find_job_id(int id) {
+	if(id <= 0 || id >= job_table_size)
+		return NULL;
+	return job_table[id];
+}
+
+/* Give j the lowest free job id.  */
+bool register_job(job_t *j) {
+	int id = job_table_free;
+	while(id < job_table_size && job_table[id])
+		id++;
+	if(id >= job_table_size) {
+		int size = job_table_size ? job_table_size * 2 : 32;
+		job_t **table = (job_t **)realloc(job_table, size * sizeof(job_t *));
+		if(!table)
+			return false;
+		memset(table + job_table_size, 0, (size - job_table_size) * sizeof(job_t *));
+		job_table = table;
+		job_table_size = size;
+	}
+	job_table[id] = j;
+	j->id = id;
+	job_table_free = id + 1;
+	return true;
+}
+
+void unregister_job(job_t *j) {
+	if(j->id <= 0)
+		return;
+	job_table[j->id] = NULL;
+	if(j->id < job_table_free)
+		job_table_free = j->id;
+	j->id = 0;
+}
+
+/* Queue j for the next do_job_notification().  */
+void job_changed(job_t *j) {
+	if(j->changed)
+		return;
+	j->changed = true;
+	j->changed_next = changed_jobs;
+	changed_jobs = j;
+}
+
+/* Look up a job named on a builtin's command line: %n is a job id,
+ * anything else a pgid. */
+job_t *find_job_arg(char *arg) {
+	if(arg[0] == '%')
+		return find_job_id(atoi(arg + 1));
+	return find_job(atoi(arg));
+}
+
 /* Return true if all processes in the job have stopped or completed.  */
 int job_is_stopped(job_t *j) {
 
@@ -69,11 +571,7 @@ int job_is_completed(job_t *j) {
 /* Find the last job.  */
 job_t *find_last_job() {
 
-	job_t *j = first_job;
-	if(!j) return NULL;
-	while(j->next != NULL)
-		j = j->next;
-	return j;
+	return last_job;
 }
 
 /* Find the last process in the pipeline (job).  */
@@ -86,22 +584,53 @@ process_t *find_last_process(job_t *j) {
 	return p;
 }
 
-bool free_job(job_t *j) {
-	if(!j)
-		return true;
-	free(j->commandinfo);
-	free(j->ifile);
-	free(j->ofile);
+/* Close the memfds of j's here-documents */
+void close_heredocs(job_t *j) {
 	process_t *p;
-	for(p = j->first_process; p; p = p->next) {
-		int i;
-		for(i = 0; i < p->argc; i++)
-			free(p->argv[i]);
+	redir_t *r;
+	for(p = j->first_process; p; p = p->next)
+		for(r = p->redirs; r; r = r->next)
+			if(r->kind == REDIR_HEREDOC && r->from >= 0)
+				close(r->from);
+}
+
+/* Free what the nodes of a compound command hold outside its arena: the
+ * here-documents of its pipelines and the arenas they are run in */
+void free_node(node_t *n) {
+	for(; n; n = n->next) {
+		if(n->kind == NODE_JOB)
+			close_heredocs(n->job);
+		arena_release(n->scratch);
+		free_node(n->cond);
+		free_node(n->body);
+		free_node(n->orelse);
 	}
-	free(j);
+}
+
+/* Everything the job owns, j included, lives in its arena, but for the
+ * memfds of its here-documents and what its body holds. A run of a node
+ * shares the node's memfds, and its arena goes back to the node; a body
+ * that defined a function is never freed. */
+bool free_job(job_t *j) {
+	if(!j || j->kept || j->node)
+		return true;
+	close_heredocs(j);
+	free_node(j->body);
+	arena_release(j->arena);
 	return true;
 }
 
+/* Select the launch backend by name; returns -1 if the name is unknown */
+int set_launcher(char *name) {
+	if(strcmp(name, "fork") == 0)
+		launch_backend = LAUNCH_FORK;
+	else if(strcmp(name, "spawn") == 0)
+		launch_backend = LAUNCH_SPAWN;
+	else
+		return -1;
+	return 0;
+}
+
 /* Make sure the shell is running interactively as the foreground job
  * before proceeding.  
  * */
@@ -110,8 +639,27 @@ void init_shell() {
 
   	/* See if we are running interactively.  */
 	shell_terminal = STDIN_FILENO;
-	/* isatty test whether a file descriptor referes to a terminal */
-	shell_is_interactive = isatty(shell_terminal);
+	/* isatty test whether a file descriptor referes to a terminal; a
+	 * script or -c string is never interactive */
+	shell_is_interactive = shell_input.fd == STDIN_FILENO && isatty(shell_terminal);
+
+	env_init();
+
+	/* DSH_LAUNCHER=fork|spawn selects the process launch backend */
+	char *launcher = getenv("DSH_LAUNCHER");
+	if(launcher && set_launcher(launcher) < 0)
+		fprintf(stderr, "DSH_LAUNCHER: unknown backend %s\n", launcher);
+
+	/* DSH_SCAN=avx2|sse2|scalar forces a command line scanner */
+	char *scan = getenv("DSH_SCAN");
+	if(set_scanner(scan) < 0) {
+		fprintf(stderr, "DSH_SCAN: %s not available\n", scan);
+		set_scanner(NULL);
+	}
+
+	/* DSH_NOPLAN turns off pipeline rewriting */
+	if(getenv("DSH_NOPLAN"))
+		plan_pipelines = false;
 
 	if(shell_is_interactive) {
     		/* Loop until we are in the foreground.  */
@@ -139,18 +687,106 @@ void init_shell() {
 
 		/* Save default terminal attributes for shell.  */
 		tcgetattr(shell_terminal, &shell_tmodes);
+
+		/* read lines with edit_line() unless told not to */
+		char *term = getenv("TERM");
+		edit_enabled = !getenv("DSH_NOEDIT") && term && strcmp(term, "dumb") != 0
+			&& isatty(STDOUT_FILENO);
+	}
+
+	/* Child state changes arrive on a signalfd instead of a handler */
+	sigset_t sigchld;
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigchld, &shell_sigmask);
+	if((sigchld_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		perror("signalfd");
+		exit(1);
+	}
+
+	struct epoll_event ev;
+	if((event_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		exit(1);
 	}
+	ev.events = EPOLLIN;
+	ev.data.fd = sigchld_fd;
+	epoll_ctl(event_fd, EPOLL_CTL_ADD, sigchld_fd, &ev);
+	if((capture_set = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	ev.data.fd = capture_set;
+	epoll_ctl(event_fd, EPOLL_CTL_ADD, capture_set, &ev);
+	if(shell_is_interactive) {
+		ev.data.fd = shell_terminal;
+		epoll_ctl(event_fd, EPOLL_CTL_ADD, shell_terminal, &ev);
+	}
+}
+
+/* Send sig to every process of j: to its process group under job
+ * control, otherwise (children share the shell's group) one by one */
+int signal_job(job_t *j, int sig) {
+	process_t *p;
+	int rc = 0;
+	if(shell_is_interactive)
+		return kill(-j->pgid, sig);
+	for(p = j->first_process; p; p = p->next)
+		if(p->pid > 0 && !p->completed && kill(p->pid, sig) < 0)
+			rc = -1;
+	return rc;
 }
 
 /* Sends SIGCONT signal to wake up the blocked job */
 void continue_job(job_t *j) {
-	if(kill(-j->pgid, SIGCONT) < 0)
+	process_t *p;
+	for(p = j->first_process; p; p = p->next)
+		p->stopped = false;
+	j->notified = false;
+	log_event("continue", "job=%d pgid=%d", j->id, j->pgid);
+	if(signal_job(j, SIGCONT) < 0)
 		perror("kill(SIGCONT)");
 }
 
 
+/* Seconds from a to b */
+double elapsed_since(struct timespec *a, struct timespec *b) {
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+double tv_seconds(struct timeval *tv) {
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* Fold the usage of one reaped process into its job's totals */
+void add_rusage(struct rusage *total, struct rusage *ru) {
+	timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+	timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+	if(ru->ru_maxrss > total->ru_maxrss)
+		total->ru_maxrss = ru->ru_maxrss;
+	total->ru_minflt += ru->ru_minflt;
+	total->ru_majflt += ru->ru_majflt;
+	total->ru_inblock += ru->ru_inblock;
+	total->ru_oublock += ru->ru_oublock;
+	total->ru_nvcsw += ru->ru_nvcsw;
+	total->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/* The record of a finished spawned job, with its totals */
+void log_job_usage(job_t *j) {
+	struct rusage *ru = &j->rusage;
+	log_event("done", "job=%d pgid=%d status=%d real=%.6f user=%.6f sys=%.6f "
+		"maxrss=%ld vcsw=%ld ivcsw=%ld cmd=\"%s\"", j->id, j->pgid, job_exit_status(j),
+		elapsed_since(&j->start, &j->end), tv_seconds(&ru->ru_utime),
+		tv_seconds(&ru->ru_stime), ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw,
+		j->commandinfo);
+}
+
+/* Record a status change reported by wait4() for pid, with the resource
+ * usage ru it reported. Returns 0 if pid was one of ours, -1 when there
+ * was nothing (more) to report. */
 int
-     mark_process_status (pid_t pid, int status)
+     mark_process_status (pid_t pid, int status, struct rusage *ru)
      {
        job_t *j;
        process_t *p;
@@ -158,692 +794,6766 @@ int
        if (pid > 0)
          {
            /* Update the record for the process.  */
-           for (j = first_job; j; j = j->next)
-             for (p = j->first_process; p; p = p->next)
-               if (p->pid == pid)
+           if ((p = find_process (pid)))
                  {
+                   j = p->job;
                    p->status = status;
                    if (WIFSTOPPED (status))
-                     p->stopped = 1;
+                     {
+                       p->stopped = 1;
+                       log_event ("stop", "job=%d pid=%d signal=%d", j->id, (int) pid, WSTOPSIG (status));
+                     }
                    else
                      {
                        p->completed = 1;
-                       if (WIFSIGNALED (status))
-                         fprintf (stderr, "%d: Terminated by signal %d.\n",
-                                  (int) pid, WTERMSIG (p->status));
+                       p->rusage = *ru;
+                       clock_gettime (CLOCK_MONOTONIC, &p->end);
+                       add_rusage (&j->rusage, ru);
+                       /* a signal shows as status 128+n */
+                       log_event ("exit", "job=%d pid=%d status=%d", j->id, (int) pid, process_exit_status (p));
+                       if (job_is_completed (j))
+                         {
+                           j->end = p->end;
+                           log_job_usage (j);
+                           if (j->cache)
+                             cache_store (j);
+                         }
                      }
+                   job_changed (j);
                    return 0;
                   }
-           fprintf (stderr, "No child process %d.\n", pid);
-           return -1;
+           /* not one of ours (a job already dropped); keep reaping */
+           log_event ("reap", "pid=%d status=%d", (int) pid, status);
+           return 0;
          }
        else if (pid == 0 || errno == ECHILD)
          /* No processes ready to report.  */
          return -1;
        else {
          /* Other weird errors.  */
-         perror ("waitpid");
+         perror ("wait4");
          return -1;
        }
      }
 
 
-/* Spawning a process with job control. fg is true if the 
- * newly-created process is to be placed in the foreground. 
- * (This implicitly puts the calling process in the background, 
- * so watch out for tty I/O after doing this.) pgid is -1 to 
- * create a new job, in which case the returned pid is also the 
- * pgid of the new job.  Else pgid specifies an existing job's 
- * pgid: this feature is used to start the second or 
- * subsequent processes in a pipeline.
- * */
-
-
-void spawn_job(job_t *j, bool fg) {
-
+/* Reap every child that has changed state, without blocking. */
+void reap_children() {
+	struct signalfd_siginfo si;
+	struct rusage ru;
 	pid_t pid;
-	process_t *p;
-	int status;	
+	int status;
 
-	int mypipe[2];
-	
-	/* Check for input/output redirection; If present, set the IO descriptors 
-	 * to the appropriate files given by the user 
-	 */
-	// are mystdin, mystdout, mystderr initialized to 0,1,2 ??
-	int input;
-	int output;
-	// Initialize job mystdin, mystdout, mystderr
-	j->mystdin = STDIN_FILENO;
-	j->mystdout = STDOUT_FILENO;
-	j->mystderr = STDERR_FILENO;
-	
-	int save_in = dup(STDIN_FILENO);
-	int save_out = dup(STDOUT_FILENO);
-	int save_redirect_out = -1;
-
-	if(j->ifile != NULL)
-	{
-		input = open(j->ifile, O_RDONLY); 
-		dup2(input, j->mystdin);
-	}	
-	if(j->ofile != NULL){
-		output = open(j->ofile, O_TRUNC | O_CREAT | O_WRONLY, 0666);
-		save_redirect_out = dup(output);
-		dup2(output, j->mystdout);
-	}
-	
-	/* A job can contain a pipeline; Loop through process and set up pipes accordingly */
+	/* SIGCHLDs coalesce, so drain the signalfd and then wait4 until
+	 * nothing is left to report. A pid not in the job list is only
+	 * logged, so it cannot end the loop early. */
+	while(read(sigchld_fd, &si, sizeof(si)) == sizeof(si))
+		;
+	do
+		pid = wait4 (WAIT_ANY, &status, WUNTRACED|WNOHANG, &ru);
+	while (!mark_process_status (pid, status, &ru));
+}
 
-	/* For each command (process), fork to create a new process context, 
-	 * set the process group, and execute the command 
-         */ 	
+/* Report jobs that stopped or finished in the background and drop
+ * completed jobs from the list. at_prompt starts the report on a fresh
+ * line. Returns true if anything was printed. */
+bool do_job_notification(bool at_prompt) {
+	job_t *j;
+	bool printed = false;
 
-	/* The code below provides an example on how to set the process context for each command */
-	// each process has its own file table, thus when you call dup2 inside a process, you 
-	// overwrite a mapping for that process only, thus call dup2 while inside the child to redirect
-	// output for pipes and when you fork the final process, redirect to the overall output file
-	//infile = j->mystdin;
-	for(p = j->first_process; p; p = p->next) {
-		// If there is a next process, configure pipes 
-		if(p->next){
-			if(pipe(mypipe) < 0){
-				perror("pipe");
-				exit(1);
-			}
-			
-			output = mypipe[1];
-		}
-		else{
-			// There is no next process so route the output of this process to the ofile for the job
-			if(save_redirect_out > 0){
-				output = save_redirect_out;
+	while((j = changed_jobs)) {
+		changed_jobs = j->changed_next;
+		j->changed = false;
+		if(job_is_completed(j)) {
+			if(j->bg && !j->notified && shell_is_interactive) {
+				if(at_prompt && !printed)
+					fprintf(stdout, "\n");
+				fprintf(stdout, "[%d]+ %d\t\tDone\t\t %s\n", j->id, j->pgid, j->commandinfo);
+				printed = true;
 			}
-			else{
-				output = j->mystdout;
+			/* a timed job that finished in the background, or after fg */
+			if(j->timed) {
+				fflush(stdout);
+				print_job_times(j, STDERR_FILENO);
+				printed = true;
 			}
+			delete_job(j);
 		}
+		else if(job_is_stopped(j) && !j->notified) {
+			if(at_prompt && !printed)
+				fprintf(stdout, "\n");
+			fprintf(stdout, "[%d]+ %d\t\tStopped\t\t %s\n", j->id, j->pgid, j->commandinfo);
+			j->notified = true;
+			printed = true;
+		}
+	}
+	fflush(stdout);
+	return printed;
+}
 
-		switch (pid = fork()) {
-
-		   case -1: /* fork failure */
-			perror("fork");
-			exit(EXIT_FAILURE);
-
-		   case 0: /* child */
+/* Output capture. With "capture size" set, the stdout and stderr of each
+ * job started with & go into a pipe that the shell drains into a ring of
+ * the last size bytes of that job's output, instead of to the terminal.
+ * The read ends are non-blocking and sit in capture_set, which is part of
+ * event_fd, so output is drained while the shell waits for input, and
+ * wait_for_child() drains it while the shell waits for a job. Rings are
+ * anonymous mappings, touched only as far as output has filled them; the
+ * one of a finished job stays readable ("output") until room is needed
+ * under capture_limit. */
 
-		       /* establish a new process group, and put the child in
-			* foreground if requested
-			*/
-			if (j->pgid < 0) /* init sets -ve to a new process */
-				j->pgid = getpid();
-			p->pid = 0;
+/* Free the capture at *cp and unlink it */
+void capture_free(capture_t **cp) {
+	capture_t *c = *cp;
+	*cp = c->next;
+	if(c->fd >= 0) {
+		close(c->fd);
+		capture_open--;
+	}
+	munmap(c->ring, c->size);
+	capture_used -= c->size;
+	free(c->commandinfo);
+	free(c);
+}
 
-			if (!setpgid(0,j->pgid))
-				if(fg) // If success and fg is set
-				     tcsetpgrp(shell_terminal, j->pgid); // assign the terminal
+/* Start capturing j's output: returns the capture, with the write end of
+ * its pipe in *wfd, or NULL if it cannot be (j then writes to the
+ * terminal as usual) */
+capture_t *capture_start(job_t *j, int *wfd) {
+	capture_t *c, **cp;
+	struct epoll_event ev;
+	int fds[2];
 
-			/* Set the handling for job control signals back to the default. */
-			signal(SIGTTOU, SIG_DFL);
+	/* make room by dropping finished captures, oldest first */
+	for(cp = &captures; (c = *cp) && capture_used + capture_size > capture_limit; )
+		if(!c->job && c->fd < 0)
+			capture_free(cp);
+		else
+			cp = &c->next;
+	if(capture_used + capture_size > capture_limit) {
+		fprintf(stderr, "capture: limit of %zu bytes reached; job %d is not captured\n",
+			capture_limit, j->id);
+		return NULL;
+	}
 
-			// Set-up appropriate I/O
-			if(input != j->mystdin)
-			{
-				dup2(input, j->mystdin);
-				close(input);
-			}
-			if(output != j->mystdout){
-				dup2(output, j->mystdout);
-				close(output);
-			}	
+	if(!(c = (capture_t *)calloc(1, sizeof(capture_t))) || !(c->commandinfo = strdup(j->commandinfo))) {
+		free(c);
+		return NULL;
+	}
+	c->ring = mmap(NULL, capture_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(c->ring == MAP_FAILED || pipe2(fds, O_CLOEXEC) < 0) {
+		perror("capture");
+		if(c->ring != MAP_FAILED)
+			munmap(c->ring, capture_size);
+		free(c->commandinfo);
+		free(c);
+		return NULL;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	epoll_ctl(capture_set, EPOLL_CTL_ADD, fds[0], &ev);
 
-			/* execute the command through exec_ call */
-			execve(p->argv[0], p->argv, NULL);
-			exit(1);
+	c->size = capture_size;
+	c->fd = fds[0];
+	c->attach_fd = -1;
+	c->job = j;
+	c->id = j->id;
+	j->capture = c;
+	for(cp = &captures; *cp; cp = &(*cp)->next)
+		;
+	*cp = c;
+	capture_used += c->size;
+	capture_open++;
+	*wfd = fds[1];
+	return c;
+}
 
-		   default: /* parent */
-			/* establish child process group here to avoid race
-			* conditions. */
-			p->pid = pid;
-			if (j->pgid <= 0)
-				j->pgid = pid;
-			setpgid(pid, j->pgid);
-		}
+/* Move whatever c's pipe holds into its ring, copying it to c->attach_fd
+ * as well when attached; closes the pipe at end of file */
+void capture_drain(capture_t *c) {
+	ssize_t n;
+	size_t pos;
 
-		/* Reset file IOs if necessary */
-		if(input != j->mystdin){
-			close(input);
-		}
-		if(output != j->mystdout){
-			close(output);
+	while(c->fd >= 0) {
+		pos = c->total % c->size;
+		n = read(c->fd, c->ring + pos, c->size - pos);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && errno == EAGAIN)
+			return;
+		if(n <= 0) { /* closed by the job (or broken) */
+			close(c->fd);
+			c->fd = -1;
+			capture_open--;
+			return;
 		}
-		input = mypipe[0];
+		if(c->attach_fd >= 0)
+			write_all(c->attach_fd, c->ring + pos, n);
+		c->total += n;
+	}
+}
 
-		if(fg){
-			/* Wait for the job to complete */
-			waitpid(pid, &status, WUNTRACED);
-			p->status = status; 
-			if(WIFSTOPPED (status))
-			{
-				p->stopped = 1; 
-			}
-			else
-			{
-				p->completed = 1; 
-				if(WIFSIGNALED (status))
-				{
-				fprintf (stderr, "%d: Terminated by signal %d.\n",
-								  (int) pid, WTERMSIG (p->status));
-				}
-			}
-			
-			// Reset correct I/O for terminal
-			dup2(save_in, STDIN_FILENO);	
-			dup2(save_out, STDOUT_FILENO);
+/* Drain every capture with output waiting */
+void capture_drain_ready() {
+	struct epoll_event ev[16];
+	int n, i;
 
-			tcsetpgrp(shell_terminal,shell_pgid); 
-		}
-		else {
-			/* Background job */
-			dup2(save_in, STDIN_FILENO);	
-			dup2(save_out, STDOUT_FILENO);
+	do {
+		n = epoll_wait(capture_set, ev, 16, 0);
+		for(i = 0; i < n; i++)
+			capture_drain((capture_t *)ev[i].data.ptr);
+	} while(n == 16);
+}
 
-			tcsetpgrp(shell_terminal, shell_pgid);
-		}
+/* Write the ring of c to out from byte from of its output on; the bytes
+ * before c->total - c->size are gone */
+void capture_write(capture_t *c, int out, uint64_t from) {
+	size_t pos = from % c->size, n = c->total - from;
+	if(pos + n > c->size) {
+		write_all(out, c->ring + pos, c->size - pos);
+		n -= c->size - pos;
+		pos = 0;
 	}
+	write_all(out, c->ring + pos, n);
 }
 
+/* Where the last lines lines of c's kept output start */
+uint64_t capture_tail(capture_t *c, long lines) {
+	uint64_t start = c->total > c->size ? c->total - c->size : 0, from = c->total;
+	for(; from > start; from--)
+		if(c->ring[(from - 1) % c->size] == '\n' && from != c->total && --lines <= 0)
+			break;
+	return from;
+}
 
+/* The capture of a job given as %id or pgid, live or finished */
+capture_t *find_capture(char *arg) {
+	capture_t *c, *found = NULL;
+	job_t *m = find_job_arg(arg);
+	int n = atoi(arg[0] == '%' ? arg + 1 : arg);
 
-bool init_job(job_t *j) {
-	j->next = NULL;
-	if(!(j->commandinfo = (char *)malloc(sizeof(char)*MAX_LEN_CMDLINE)))
+	if(m && m->capture)
+		return m->capture;
+	for(c = captures; c; c = c->next) /* the newest with that id */
+		if(!c->job && (arg[0] == '%' ? c->id : c->pgid) == n)
+			found = c;
+	return found;
+}
+
+/* Wait for a child to change state, as wait4(who, options) would, and
+ * record it. While a capture is open its output is drained in the
+ * meantime, so a job blocked on a full capture pipe cannot stall the
+ * shell; every child is then reaped. False if there is no child. */
+bool wait_for_child(pid_t who, int options) {
+	struct pollfd fds[2] = { { sigchld_fd, POLLIN, 0 }, { capture_set, POLLIN, 0 } };
+	struct rusage ru;
+	siginfo_t info;
+	int status;
+	pid_t pid;
+
+	if(capture_open == 0) {
+		pid = wait4(who, &status, options, &ru);
+		return mark_process_status(pid, status, &ru) == 0;
+	}
+	if(waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WNOHANG | WNOWAIT) < 0)
 		return false;
-	j->first_process = NULL;
-	j->pgid = -1; 	/* -1 indicates new spawn new job*/
-	j->notified = false;
-	j->mystdin = STDIN_FILENO; 	/* 0 */
-	j->mystdout = STDOUT_FILENO;	/* 1 */ 
-	j->mystderr = STDERR_FILENO;	/* 2 */
-	j->bg = false;
-	j->ifile = NULL;
-	j->ofile = NULL;
+	if(poll(fds, 2, -1) < 0)
+		return errno == EINTR;
+	if(fds[1].revents)
+		capture_drain_ready();
+	if(fds[0].revents)
+		reap_children();
 	return true;
 }
 
-bool init_process(process_t *p) {
-	p->pid = -1; /* -1 indicates new process */
-	p->completed = false;
-	p->stopped = false;
-	p->status = -1; /* set by waitpid */
-	p->argc = 0;
-	p->next = NULL;
-
-        if(!(p->argv = (char **)calloc(MAX_ARGS,sizeof(char *))))
-                return false;
+/* Block until the terminal has input, reaping and reporting children as
+ * their state changes in the meantime. msg is the prompt to redraw after a
+ * notification. With a NULL msg, return false once there is input and
+ * true as soon as a notification was printed, for the caller to redraw. */
+bool wait_for_input(char *msg) {
+	struct epoll_event ev;
+	int n;
 
-	return true;
+	while(1) {
+		n = epoll_wait(event_fd, &ev, 1, -1);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return false;
+		}
+		if(ev.data.fd == capture_set) {
+			capture_drain_ready();
+			continue;
+		}
+		if(ev.data.fd != sigchld_fd)
+			return false;
+		reap_children();
+		if(do_job_notification(true)) {
+			if(!msg)
+				return true;
+			fprintf(stdout, "%s", msg);
+			fflush(stdout);
+		}
+	}
 }
 
-bool readprocessinfo(process_t *p, char *cmd) {
+/* Environment. Variables live in env_table, hashed by name, each as the
+ * "NAME=value" string exec wants. env_envp() hands out an envp array of
+ * the exported ones that is only rebuilt after a change, so a spawn
+ * normally neither allocates nor copies. A "NAME=value command" prefix
+ * does not touch the table: process_envp() layers it over the shared
+ * array in a copy made in the job's arena. */
+#define ENV_TABLE_SIZE 256
 
-	int cmd_pos = 0; /*iterator for command; */
-	int args_pos = 0; /* iterator for arguments*/
+env_var_t *env_table[ENV_TABLE_SIZE];
+size_t env_count;		/* variables in env_table */
+char **env_cache;		/* the exported entries, NULL-terminated */
+size_t env_cache_size;		/* slots allocated in env_cache */
+bool env_dirty = true;		/* env_cache needs rebuilding */
 
-	int argc = 0;
+/* Length of the variable name that word starts with; 0 if none */
+size_t name_length(const char *word) {
+	size_t n = 0;
+	if(!(word[0] == '_' || (word[0] >= 'A' && word[0] <= 'Z') || (word[0] >= 'a' && word[0] <= 'z')))
+		return 0;
+	while(word[n] == '_' || (word[n] >= 'A' && word[n] <= 'Z') || (word[n] >= 'a' && word[n] <= 'z')
+	      || (word[n] >= '0' && word[n] <= '9'))
+		n++;
+	return n;
+}
 
-	while (isspace(cmd[cmd_pos])){++cmd_pos;} /* ignore any spaces */
-	if(cmd[cmd_pos] == '\0')
-		return true;
+/* Length of the NAME in NAME=value, or 0 if word is not an assignment */
+size_t assignment_name(const char *word) {
+	size_t n = name_length(word);
+	return n && word[n] == '=' ? n : 0;
+}
 
-	while(cmd[cmd_pos] != '\0'){
-		if(!(p->argv[argc] = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char))))
-			return false;
-		while(cmd[cmd_pos] != '\0' && !isspace(cmd[cmd_pos])) 
-			p->argv[argc][args_pos++] = cmd[cmd_pos++];
-		p->argv[argc][args_pos] = '\0';
-		args_pos = 0;
-		++argc;
-		while (isspace(cmd[cmd_pos])){++cmd_pos;} /* ignore any spaces */
-	}
-	p->argv[argc] = NULL; /* required for exec_() calls */
-	p->argc = argc;
-	return true;
+size_t hash_env(const char *name, size_t len) {
+	uint32_t h = 2166136261u; /* FNV-1a */
+	while(len--)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h & (ENV_TABLE_SIZE - 1);
 }
 
-bool invokefree(job_t *j, char *msg){
-	fprintf(stderr, "%s\n",msg);
-	return free_job(j);
+/* The slot holding the variable called name (len bytes), or where it
+ * would be linked in */
+env_var_t **env_slot(const char *name, size_t len) {
+	env_var_t **vp;
+	for(vp = &env_table[hash_env(name, len)]; *vp; vp = &(*vp)->next)
+		if((*vp)->name_len == len && memcmp((*vp)->entry, name, len) == 0)
+			break;
+	return vp;
 }
 
-/* Prints the active jobs in the list.  */
-	void print_job() {
-		job_t *j;
+/* Value of the variable name, or NULL if it is not set */
+char *env_get(const char *name) {
+	size_t len = strlen(name);
+	env_var_t *v = *env_slot(name, len);
+	return v ? v->entry + len + 1 : NULL;
+}
+
+/* Set the variable name (len bytes) to value. exported is 1 or 0, or -1
+ * to keep the variable's current state (new ones stay unexported). The
+ * entry is rewritten in place when it has room, so a loop variable costs
+ * no allocation per iteration, and envp is rebuilt only when an exported
+ * entry moves or a variable's export changes. Returns false when out of
+ * memory. */
+bool env_assign(const char *name, size_t len, const char *value, int exported) {
+	env_var_t **vp = env_slot(name, len), *v = *vp;
+	size_t size = len + strlen(value) + 2;
+	char *entry = v && v->size >= size ? v->entry : (char *)malloc(size);
+	char *old = v ? v->entry : NULL;
+	bool was_exported = v && v->exported;
+
+	if(!entry)
+		return false;
+	if(!v) {
+		if(!(v = (env_var_t *)malloc(sizeof(env_var_t)))) {
+			free(entry);
+			return false;
+		}
+		v->next = NULL;
+		v->entry = NULL;
+		v->name_len = len;
+		v->exported = false;
+		*vp = v;
+		env_count++;
+	}
+	if(entry == v->entry) /* already starts with NAME= */
+		memmove(entry + len + 1, value, size - len - 1);
+	else {
+		/* name and value may be in the old entry */
+		memcpy(entry, name, len);
+		entry[len] = '=';
+		memcpy(entry + len + 1, value, size - len - 1);
+		free(v->entry);
+		v->entry = entry;
+		v->size = size;
+	}
+	if(exported >= 0)
+		v->exported = exported;
+	if(v->exported != was_exported || (v->exported && v->entry != old))
+		env_dirty = true;
+	return true;
+}
+
+/* Set a variable from its "NAME=value" assignment */
+bool env_set(const char *assignment, int exported) {
+	size_t len = assignment_name(assignment);
+	return env_assign(assignment, len, assignment + len + 1, exported);
+}
+
+/* Mark name exported, setting it to the empty string if it is unset */
+bool env_export(const char *name) {
+	env_var_t *v = *env_slot(name, strlen(name));
+	if(v) {
+		if(!v->exported)
+			env_dirty = true;
+		v->exported = true;
+		return true;
+	}
+	size_t len = strlen(name);
+	char entry[len + 2];
+	memcpy(entry, name, len);
+	strcpy(entry + len, "=");
+	return env_set(entry, 1);
+}
+
+void env_unset(const char *name) {
+	env_var_t **vp = env_slot(name, strlen(name)), *v = *vp;
+	if(!v)
+		return;
+	*vp = v->next;
+	if(v->exported)
+		env_dirty = true;
+	free(v->entry);
+	free(v);
+	env_count--;
+}
+
+/* Load the environment the shell was started with */
+void env_init() {
+	extern char **environ;
+	char **e;
+	for(e = environ; *e; e++)
+		if(assignment_name(*e))
+			env_set(*e, 1);
+}
+
+/* The exported variables as an envp array, rebuilt only after a change.
+ * It stays valid until the next change. */
+char **env_envp() {
+	size_t i, n = 0;
+	env_var_t *v;
+
+	if(!env_dirty)
+		return env_cache;
+	if(env_count + 1 > env_cache_size) {
+		char **cache = (char **)realloc(env_cache, (env_count + 1) * sizeof(char *));
+		if(!cache)
+			return empty_envp;
+		env_cache = cache;
+		env_cache_size = env_count + 1;
+	}
+	for(i = 0; i < ENV_TABLE_SIZE; i++)
+		for(v = env_table[i]; v; v = v->next)
+			if(v->exported)
+				env_cache[n++] = v->entry;
+	env_cache[n] = NULL;
+	env_dirty = false;
+	return env_cache;
+}
+
+/* The environment of p: the shared array, or when p has NAME=value
+ * prefixes a copy in the job's arena with those applied */
+char **process_envp(job_t *j, process_t *p) {
+	char **base = env_envp(), **envp, **assign = p->assign;
+	size_t n = 0, i, k;
+
+	if(p->nassign == 0)
+		return base;
+	while(base[n])
+		n++;
+	if(!(envp = (char **)arena_alloc(j->arena, (n + p->nassign + 1) * sizeof(char *))))
+		return base;
+	for(i = k = 0; i < n; i++) {
+		size_t len = strchr(base[i], '=') - base[i];
+		int a;
+		for(a = 0; a < p->nassign; a++)
+			if(assignment_name(assign[a]) == len && memcmp(assign[a], base[i], len) == 0)
+				break;
+		if(a == p->nassign) /* not overridden */
+			envp[k++] = base[i];
+	}
+	for(i = 0; i < (size_t)p->nassign; i++)
+		envp[k++] = assign[i];
+	envp[k] = NULL;
+	return envp;
+}
+
+/* Command lookup. A command name without a slash is searched for in the
+ * directories of PATH, and the result is kept in path_cache, a hash table
+ * from name to full path, so a repeated command costs no syscalls at all
+ * instead of one failed probe per directory before the right one.
+ *
+ * An entry remembers which PATH directory it came from. At most once a
+ * second, a lookup stats every PATH directory; when one's mtime changed
+ * (a file was added, removed or renamed there), the entries from it and
+ * from every later directory are dropped, as a new file could now shadow
+ * them. Names that are not found are not cached. */
+#define PATH_CACHE_SIZE 256
+
+path_entry_t *path_cache[PATH_CACHE_SIZE];
+char *path_value;		/* the PATH path_dirs was split from */
+path_dir_t *path_dirs;
+int path_ndirs;
+struct timespec path_checked;	/* last check of the directory mtimes */
+
+/* Counters, shown by hash -s */
+struct {
+	unsigned long lookups;	/* names looked up */
+	unsigned long hits;	/* found in the cache */
+	unsigned long probes;	/* stat() calls searching PATH */
+	unsigned long checks;	/* stat() calls checking directory mtimes */
+	unsigned long saved;	/* probes a search would have cost on hits */
+} path_stats;
+
+size_t hash_name(const char *name) {
+	uint32_t h = 2166136261u; /* FNV-1a */
+	while(*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h & (PATH_CACHE_SIZE - 1);
+}
+
+/* Drop the entries found in PATH directory from onwards */
+void path_cache_drop(int from) {
+	int i;
+	for(i = 0; i < PATH_CACHE_SIZE; i++) {
+		path_entry_t **ep = &path_cache[i], *e;
+		while((e = *ep)) {
+			if(e->dir >= from) {
+				*ep = e->next;
+				free(e);
+			}
+			else
+				ep = &e->next;
+		}
+	}
+}
+
+/* Forget name, e.g. after its cached path failed to exec */
+void path_cache_forget(const char *name) {
+	path_entry_t **ep, *e;
+	for(ep = &path_cache[hash_name(name)]; (e = *ep); ep = &e->next)
+		if(strcmp(e->name, name) == 0) {
+			*ep = e->next;
+			free(e);
+			return;
+		}
+}
+
+/* Split PATH into path_dirs again if it changed */
+void path_update_dirs() {
+	char *path = env_get("PATH"), *dir, *save;
+	int n;
+
+	if(!path)
+		path = "/usr/local/bin:/usr/bin:/bin";
+	if(path_value && strcmp(path, path_value) == 0)
+		return;
+	path_cache_drop(0);
+	free(path_value);
+	free(path_dirs);
+	path_ndirs = 0;
+	path_dirs = NULL;
+	if(!(path_value = strdup(path)))
+		return;
+
+	for(n = 1, dir = path; (dir = strchr(dir, ':')); dir++)
+		n++;
+	/* the strings live in one block after the array */
+	if(!(path_dirs = (path_dir_t *)calloc(1, n * sizeof(path_dir_t) + strlen(path) + 1)))
+		return;
+	char *copy = strcpy((char *)(path_dirs + n), path);
+	for(dir = strtok_r(copy, ":", &save); dir; dir = strtok_r(NULL, ":", &save))
+		path_dirs[path_ndirs++].dir = dir;
+	path_checked.tv_sec = 0; /* stat them on the next lookup */
+}
+
+/* At most once a second, drop what changed directories may have made stale */
+void path_check_dirs() {
+	struct timespec now;
+	struct stat st;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if(path_checked.tv_sec && elapsed_since(&path_checked, &now) < 1)
+		return;
+	path_checked = now;
+	for(i = 0; i < path_ndirs; i++) {
+		path_stats.checks++;
+		if(stat(path_dirs[i].dir, &st) < 0)
+			st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+		if(st.st_mtim.tv_sec != path_dirs[i].mtime.tv_sec
+		   || st.st_mtim.tv_nsec != path_dirs[i].mtime.tv_nsec) {
+			path_dirs[i].mtime = st.st_mtim;
+			path_cache_drop(i);
+		}
+	}
+}
+
+/* The executable that name runs: name itself if it has a slash, else the
+ * first regular executable file called name in PATH. NULL if none. */
+char *resolve_command(char *name) {
+	path_entry_t *e;
+	struct stat st;
+	int i;
+
+	if(strchr(name, '/'))
+		return name;
+	path_stats.lookups++;
+	path_update_dirs();
+	path_check_dirs();
+
+	size_t h = hash_name(name);
+	for(e = path_cache[h]; e; e = e->next)
+		if(strcmp(e->name, name) == 0) {
+			path_stats.hits++;
+			path_stats.saved += e->dir + 1;
+			e->hits++;
+			return e->path;
+		}
+
+	for(i = 0; i < path_ndirs; i++) {
+		size_t dlen = strlen(path_dirs[i].dir), nlen = strlen(name);
+		/* one block: the entry, then name, then dir/name */
+		if(!(e = (path_entry_t *)malloc(sizeof(path_entry_t) + 2 * nlen + dlen + 3)))
+			return NULL;
+		e->name = (char *)(e + 1);
+		e->path = e->name + nlen + 1;
+		memcpy(e->name, name, nlen + 1);
+		memcpy(e->path, path_dirs[i].dir, dlen);
+		e->path[dlen] = '/';
+		memcpy(e->path + dlen + 1, name, nlen + 1);
+
+		path_stats.probes++;
+		if(stat(e->path, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+			e->dir = i;
+			e->hits = 0;
+			e->next = path_cache[h];
+			path_cache[h] = e;
+			return e->path;
+		}
+		free(e);
+	}
+	return NULL;
+}
+
+/* Globbing. An argument that readjob() found to have an unquoted * ? or
+ * [ is expanded by expand_globs() just before its job runs, so that in
+ * "touch x; ls *" the ls sees x: glob_expand() puts the sorted matching
+ * paths in its place in argv (add_arg() grows it as needed), or the word
+ * itself if nothing matches. A path
+ * segment of ** matches any number of directories, without following
+ * symlinks. Names starting with . only match a pattern that starts with
+ * one, and . and .. never match.
+ *
+ * Directories are read with getdents64 into a buffer of many entries per
+ * call, and the listing is kept in dir_cache, keyed by device, inode and
+ * mtime, so expanding the same directory again costs one stat(). A listing
+ * read within a second of the directory's mtime is not trusted on the
+ * next lookup, as a change in the same clock tick would leave the mtime
+ * as it was. */
+#define DIR_CACHE_SIZE 64
+#define DIR_READ_BUF 32768
+
+dir_listing_t dir_cache[DIR_CACHE_SIZE];
+
+/* Counters, shown by memstats */
+struct {
+	unsigned long reads;	/* directories read with getdents64 */
+	unsigned long hits;	/* listings answered from dir_cache */
+} dir_stats;
+
+/* The entries of the directory at path ("" for the current one), as
+ * [d_type][name NUL] records; NULL if it cannot be read */
+dir_listing_t *read_dir(const char *path) {
+	static char buf[DIR_READ_BUF];
+	struct stat st;
+	struct timespec now;
+	dir_listing_t *d;
+	ssize_t n, off;
+	size_t used = 0, size = 0;
+	char *names = NULL;
+	int fd;
+
+	if(!*path)
+		path = ".";
+	if(stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+		return NULL;
+	d = &dir_cache[(st.st_dev * 31 + st.st_ino) % DIR_CACHE_SIZE];
+	if(d->names && !d->racy && d->dev == st.st_dev && d->ino == st.st_ino
+	   && d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		dir_stats.hits++;
+		return d;
+	}
+
+	if((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return NULL;
+	dir_stats.reads++;
+	while((n = getdents64(fd, buf, sizeof(buf))) > 0)
+		for(off = 0; off < n; ) {
+			struct dirent64 *e = (struct dirent64 *)(buf + off);
+			size_t len = strlen(e->d_name);
+			off += e->d_reclen;
+			if(e->d_name[0] == '.' && (len == 1 || (len == 2 && e->d_name[1] == '.')))
+				continue;
+			if(used + len + 2 > size) {
+				char *grown = (char *)realloc(names, size = 2 * size + len + 4096);
+				if(!grown) {
+					n = -1;
+					break;
+				}
+				names = grown;
+			}
+			names[used] = e->d_type;
+			memcpy(names + used + 1, e->d_name, len + 1);
+			used += len + 2;
+		}
+	close(fd);
+	if(n >= 0 && !names && !(names = (char *)malloc(1))) /* empty, but cached */
+		n = -1;
+	if(n < 0) {
+		free(names);
+		return NULL;
+	}
+
+	free(d->names);
+	d->names = names;
+	d->size = used;
+	d->dev = st.st_dev;
+	d->ino = st.st_ino;
+	d->mtime = st.st_mtim;
+	clock_gettime(CLOCK_REALTIME, &now);
+	d->racy = now.tv_sec <= st.st_mtim.tv_sec + 1;
+	return d;
+}
+
+/* If character c matches the pattern element at p (a character, \c, ?
+ * or a [...] set), the element after it; else NULL */
+const char *glob_step(const char *p, char c) {
+	if(*p == '?')
+		return p + 1;
+	if(*p == '[') {
+		const char *q = p + 1, *first;
+		bool negate = false, hit = false;
+		if(*q == '!' || *q == '^') {
+			negate = true;
+			q++;
+		}
+		for(first = q; *q && (*q != ']' || q == first); q++) {
+			unsigned char lo, hi;
+			if(*q == '\\' && q[1])
+				q++;
+			lo = hi = *q;
+			if(q[1] == '-' && q[2] && q[2] != ']') {
+				q += 2;
+				if(*q == '\\' && q[1])
+					q++;
+				hi = *q;
+			}
+			if(lo <= (unsigned char)c && (unsigned char)c <= hi)
+				hit = true;
+		}
+		if(*q == ']')
+			return hit != negate ? q + 1 : NULL;
+		/* without a closing ] the [ is an ordinary character */
+	}
+	if(*p == '\\' && p[1])
+		p++;
+	return *p == c ? p + 1 : NULL;
+}
+
+/* Match name against one segment of a pattern. On a mismatch only the
+ * most recent * is retried one character further along, which is enough
+ * because an earlier * could only absorb what the later one can: the
+ * time is O(pattern x name) at worst, with no backtracking. */
+bool glob_match(const char *pat, const char *name) {
+	const char *star = NULL, *retry = NULL, *next;
+
+	if(*name == '.' && *pat != '.' && !(pat[0] == '\\' && pat[1] == '.'))
+		return false;
+	while(*name) {
+		if(*pat == '*') {
+			star = ++pat;
+			retry = name;
+		}
+		else if(*pat && (next = glob_step(pat, *name))) {
+			pat = next;
+			name++;
+		}
+		else if(star) {
+			pat = star;
+			name = ++retry;
+		}
+		else
+			return false;
+	}
+	while(*pat == '*')
+		pat++;
+	return *pat == '\0';
+}
+
+/* True if the n bytes at seg contain an unescaped * ? or [ */
+bool glob_has_meta(const char *seg, size_t n) {
+	size_t i;
+	for(i = 0; i < n; i++)
+		if(seg[i] == '\\')
+			i++;
+		else if(seg[i] == '*' || seg[i] == '?' || seg[i] == '[')
+			return true;
+	return false;
+}
+
+/* Record the path path[0..len) as a match */
+bool glob_add(process_t *p, arena_t *arena, char *path, size_t len) {
+	char *match = arena_strndup(arena, path, len);
+	return match && add_arg(p, match, arena);
+}
+
+/* True if the entry at path[0..len), whose d_type is type, is a
+ * directory; symlinks are followed unless nofollow */
+bool glob_is_dir(char *path, size_t len, int type, bool nofollow) {
+	struct stat st;
+	if(type == DT_DIR)
+		return true;
+	if(type != DT_UNKNOWN && (type != DT_LNK || nofollow))
+		return false;
+	path[len] = '\0';
+	if((nofollow ? lstat(path, &st) : stat(path, &st)) < 0)
+		return false;
+	return S_ISDIR(st.st_mode);
+}
+
+/* Add the matches of rest, the pattern left after the directory
+ * path[0..len) (which ends in / unless it is empty). path has room for
+ * PATH_MAX bytes. Returns false when out of memory. */
+bool glob_walk(process_t *p, arena_t *arena, char *path, size_t len, const char *rest) {
+	const char *slash, *next;
+	char seg[PATH_MAX], *names, *e;
+	size_t seglen, i, k;
+	dir_listing_t *d;
+	bool globstar, ok = true;
+
+	while(*rest == '/') /* a//b is a/b */
+		rest++;
+	if(!*rest)
+		return glob_add(p, arena, path, len);
+	slash = strchr(rest, '/');
+	seglen = slash ? (size_t)(slash - rest) : strlen(rest);
+	next = rest + seglen;
+	if(seglen >= sizeof(seg) || len + seglen + 2 >= PATH_MAX)
+		return true;
+
+	if(!glob_has_meta(rest, seglen)) { /* a literal segment: no listing */
+		struct stat st;
+		for(i = k = 0; i < seglen; i++) {
+			if(rest[i] == '\\' && i + 1 < seglen)
+				i++;
+			path[len + k++] = rest[i];
+		}
+		if(slash) { /* a missing directory fails the next lookup */
+			path[len + k] = '/';
+			return glob_walk(p, arena, path, len + k + 1, next);
+		}
+		path[len + k] = '\0';
+		return lstat(path, &st) < 0 || glob_add(p, arena, path, len + k);
+	}
+
+	memcpy(seg, rest, seglen);
+	seg[seglen] = '\0';
+	globstar = strcmp(seg, "**") == 0;
+	if(globstar && slash && !glob_walk(p, arena, path, len, next)) /* no directories */
+		return false;
+	path[len] = '\0';
+	if(!(d = read_dir(path)) || d->size == 0)
+		return true;
+	/* walking below can evict d from the cache */
+	if(!(names = (char *)malloc(d->size)))
+		return false;
+	memcpy(names, d->names, d->size);
+
+	for(e = names; ok && e < names + d->size; e += strlen(e + 1) + 2) {
+		char *name = e + 1;
+		size_t nlen = strlen(name);
+		if(len + nlen + 2 >= PATH_MAX)
+			continue;
+		memcpy(path + len, name, nlen);
+		if(globstar) { /* every entry, then ** again below each directory */
+			if(name[0] == '.')
+				continue;
+			if(!slash)
+				ok = glob_add(p, arena, path, len + nlen);
+			if(ok && glob_is_dir(path, len + nlen, *e, true)) {
+				path[len + nlen] = '/';
+				ok = glob_walk(p, arena, path, len + nlen + 1, rest);
+			}
+		}
+		else if(glob_match(seg, name)) {
+			if(!slash)
+				ok = glob_add(p, arena, path, len + nlen);
+			else if(glob_is_dir(path, len + nlen, *e, false)) {
+				path[len + nlen] = '/';
+				ok = glob_walk(p, arena, path, len + nlen + 1, next);
+			}
+		}
+	}
+	free(names);
+	return ok;
+}
+
+int compare_arg(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Add the expansion of pattern to p's argv, or word if nothing matches */
+bool glob_expand(process_t *p, arena_t *arena, const char *pattern, char *word) {
+	char path[PATH_MAX];
+	int first = p->argc;
+	size_t len = 0;
+
+	if(*pattern == '/')
+		path[len++] = '/';
+	if(!glob_walk(p, arena, path, len, pattern))
+		return false;
+	if(p->argc == first)
+		return add_arg(p, word, arena);
+	qsort(p->argv + first, p->argc - first, sizeof(char *), compare_arg);
+	return true;
+}
+
+/* Replace the words of p->globs in argv with their matches, in place
+ * of one another; false when out of memory */
+bool expand_globs(job_t *j, process_t *p) {
+	glob_word_t *g = p->globs;
+	char **argv = p->argv;
+	int argc = p->argc, i;
+	bool ok = true;
+
+	if(!g)
+		return true;
+	p->argv_size = argc + 8;
+	if(!(p->argv = (char **)arena_alloc(j->arena, p->argv_size * sizeof(char *))))
+		return false;
+	p->argc = 0;
+	for(i = 0; ok && i < argc; i++)
+		if(g && g->index == i) {
+			ok = glob_expand(p, j->arena, g->pattern ? g->pattern : argv[i], argv[i]);
+			g = g->next;
+		}
+		else
+			ok = add_arg(p, argv[i], j->arena);
+	p->globs = NULL;
+	return ok;
+}
+
+/* The glob pattern of a word given as written, quotes and all: quoted
+ * characters that are special to the matcher get a \ */
+char *glob_pattern(const char *raw, size_t len, arena_t *arena) {
+	char *pattern = arena_alloc(arena, 2 * len + 1), *out = pattern, quote = 0;
+	const char *end = raw + len;
+
+	if(!pattern)
+		return NULL;
+	for(; raw < end; raw++) {
+		bool quoted = quote != 0;
+		if(!quote && (*raw == '\'' || *raw == '"')) {
+			quote = *raw;
+			continue;
+		}
+		if(quote && *raw == quote) {
+			quote = 0;
+			continue;
+		}
+		if(*raw == '\\' && raw + 1 < end && quote != '\''
+		   && (!quote || raw[1] == '"' || raw[1] == '\\')) {
+			raw++;
+			quoted = true;
+		}
+		if(quoted && strchr("*?[]\\", *raw))
+			*out++ = '\\';
+		*out++ = *raw;
+	}
+	*out = '\0';
+	return pattern;
+}
+
+/* Parameters. A word with a $ outside single quotes is compiled once, when
+ * its job is parsed, into word_part_t pieces: literal text with the quotes
+ * taken out, and references to $NAME, ${NAME}, $0..$9, $#, $? and $$.
+ * expand_vars() joins the pieces each time the job runs, so a loop body
+ * parsed once still sees the current values. A word is never split: what
+ * it expands to is one argument. */
+char *shell_name[] = { "dsh", NULL };
+char **pos_argv = shell_name;	/* $0, $1, ...: the shell's or the running function's */
+int pos_argc = 1;
+
+/* Length of the reference after a $ at s (braces included), 0 if none */
+size_t ref_length(const char *s, const char *end) {
+	size_t n;
+	if(s >= end)
+		return 0;
+	if(*s == '{')
+		return (n = name_length(s + 1)) && s + n + 1 < end && s[n + 1] == '}' ? n + 2 : 0;
+	if((*s >= '0' && *s <= '9') || *s == '?' || *s == '#' || *s == '$')
+		return 1;
+	n = name_length(s);
+	return n < (size_t)(end - s) ? n : end - s;
+}
+
+bool add_part(word_part_t ***tail, char *text, size_t len, bool var, arena_t *arena) {
+	word_part_t *part = (word_part_t *)arena_alloc(arena, sizeof(word_part_t));
+	if(!part)
+		return false;
+	part->text = text;
+	part->len = len;
+	part->var = var;
+	**tail = part;
+	*tail = &part->next;
+	return true;
+}
+
+/* Compile the word written at raw, quotes and all, up to end or its first
+ * unquoted space or metacharacter. NULL if it needs no expansion, and
+ * also, with *err set, when out of memory. */
+word_part_t *compile_word(const char *raw, const char *end, arena_t *arena, bool *err) {
+	word_part_t *head = NULL, **tail = &head;
+	char *lit = (char *)arena_alloc(arena, end - raw + 1), *out = lit, *start = lit, quote = 0;
+	bool expands = false;
+	size_t n;
+
+	if(!lit) {
+		*err = true;
+		return NULL;
+	}
+	for(; raw < end; raw++) {
+		if(!quote && (isspace(*raw) || is_meta(*raw) || *raw == '\0'))
+			break;
+		if(!quote && (*raw == '\'' || *raw == '"'))
+			quote = *raw;
+		else if(quote && *raw == quote)
+			quote = 0;
+		else if(*raw == '\\' && raw + 1 < end && quote != '\''
+		        && (!quote || raw[1] == '"' || raw[1] == '\\' || raw[1] == '$')) {
+			/* word_end() keeps the \ of "\$"; the expansion drops it */
+			expands |= quote && raw[1] == '$';
+			*out++ = *++raw;
+		}
+		else if(*raw == '$' && quote != '\'' && (n = ref_length(raw + 1, end))) {
+			const char *name = raw[1] == '{' ? raw + 2 : raw + 1;
+			size_t len = raw[1] == '{' ? n - 2 : n;
+			char *copy = arena_strndup(arena, name, len);
+			if((out > start && !add_part(&tail, start, out - start, false, arena))
+			   || !copy || !add_part(&tail, copy, len, true, arena)) {
+				*err = true;
+				return NULL;
+			}
+			start = out;
+			raw += n;
+			expands = true;
+		}
+		else
+			*out++ = *raw;
+	}
+	if(!expands)
+		return NULL;
+	if(out > start && !add_part(&tail, start, out - start, false, arena)) {
+		*err = true;
+		return NULL;
+	}
+	return head;
+}
+
+/* The value part references, with buf to hold a number */
+const char *var_value(word_part_t *part, char buf[24]) {
+	char *name = part->text, *value;
+	int n;
+
+	if(name[0] >= '0' && name[0] <= '9' && name[1] == '\0') {
+		n = name[0] - '0';
+		return n < pos_argc ? pos_argv[n] : "";
+	}
+	if(strcmp(name, "?") == 0)
+		n = last_status;
+	else if(strcmp(name, "#") == 0)
+		n = pos_argc - 1;
+	else if(strcmp(name, "$") == 0)
+		n = getpid();
+	else
+		return (value = env_get(name)) ? value : "";
+	snprintf(buf, 24, "%d", n);
+	return buf;
+}
+
+/* Join the pieces of a word into a string in arena */
+char *expand_word(word_part_t *parts, arena_t *arena) {
+	word_part_t *w;
+	const char *s;
+	char buf[24], *word, *out;
+	size_t len = 0, n;
+
+	for(w = parts; w; w = w->next)
+		len += w->var ? strlen(var_value(w, buf)) : w->len;
+	if(!(word = out = (char *)arena_alloc(arena, len + 1)))
+		return NULL;
+	for(w = parts; w; w = w->next) {
+		s = w->var ? var_value(w, buf) : w->text;
+		n = w->var ? strlen(s) : w->len;
+		memcpy(out, s, n);
+		out += n;
+	}
+	return word;
+}
+
+/* Expand the words of p->vars in argv, and redirected file names, for
+ * this run of the job; false when out of memory */
+bool expand_vars(job_t *j, process_t *p) {
+	var_word_t *v;
+	redir_t *r;
+	for(v = p->vars; v; v = v->next)
+		if(!(p->argv[v->index] = expand_word(v->parts, j->arena)))
+			return false;
+	for(r = p->redirs; r; r = r->next)
+		if(r->parts && !(r->file = expand_word(r->parts, j->arena)))
+			return false;
+	return true;
+}
+
+/* Redirections. The parser gives each process a list of n<file, n>file,
+ * n>>file and n>&m redirections, and the shell itself opens none of them:
+ * launch_spawn() turns the list into posix_spawn file actions and
+ * launch_fork() applies it in the child with redirect_child(). Whatever the
+ * shell opens is close-on-exec, and children also close every descriptor
+ * from child_fd_base up before their redirections, so nothing but what the
+ * shell inherited and what the command line asks for reaches a command. */
+int child_fd_base = 3;
+
+/* Highest descriptor a redirection can name */
+enum { REDIR_FD_MAX = 9999 };
+
+/* Set child_fd_base above the descriptors dsh was started with that it is
+ * meant to pass on (those not close-on-exec) */
+void note_inherited_fds() {
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *e;
+	int fd, flags;
+
+	if(!dir)
+		return;
+	while((e = readdir(dir)))
+		if((fd = atoi(e->d_name)) >= child_fd_base && fd != dirfd(dir)
+		   && (flags = fcntl(fd, F_GETFD)) >= 0 && !(flags & FD_CLOEXEC))
+			child_fd_base = fd + 1;
+	closedir(dir);
+}
+
+/* True if p redirects descriptor fd */
+bool redirects(process_t *p, int fd) {
+	redir_t *r;
+	for(r = p->redirs; r; r = r->next)
+		if(r->fd == fd)
+			return true;
+	return false;
+}
+
+/* open() flags for a file redirection */
+int redir_flags(redir_t *r) {
+	switch(r->kind) {
+	case REDIR_IN:
+	case REDIR_HEREDOC:
+		return O_RDONLY;
+	case REDIR_OUT:
+		return O_WRONLY | O_CREAT | O_TRUNC;
+	default:
+		return O_WRONLY | O_CREAT | O_APPEND;
+	}
+}
+
+/* In a forked child: close what the shell did not mean to pass on, then
+ * apply p's redirections in order. Exits on failure, as exec would. */
+void redirect_child(process_t *p) {
+	redir_t *r;
+	int fd;
+
+	close_range(child_fd_base, ~0U, 0);
+	for(r = p->redirs; r; r = r->next) {
+		if(r->kind == REDIR_DUP) {
+			if(dup2(r->from, r->fd) < 0) {
+				fprintf(stderr, "dsh: %d: %s\n", r->from, strerror(errno));
+				_exit(1);
+			}
+			continue;
+		}
+		if((fd = open(r->file, redir_flags(r), 0666)) < 0) {
+			perror(r->file);
+			_exit(1);
+		}
+		if(fd != r->fd) {
+			dup2(fd, r->fd);
+			close(fd);
+		}
+	}
+}
+
+/* posix_spawn reports a failed file action as a failed exec; find the
+ * redirection of p that cannot be done, if any, with errno telling why */
+redir_t *failed_redirect(process_t *p) {
+	redir_t *r;
+	char *slash;
+
+	for(r = p->redirs; r; r = r->next) {
+		if(r->kind == REDIR_DUP) {
+			if(r->from >= child_fd_base && !redirects(p, r->from)) {
+				errno = EBADF;
+				return r;
+			}
+		}
+		else if(r->kind == REDIR_IN) {
+			if(access(r->file, R_OK) < 0)
+				return r;
+		}
+		else if(access(r->file, W_OK) < 0) {
+			if(errno != ENOENT)
+				return r;
+			/* to be created: its directory must exist and be writable */
+			if(!(slash = strrchr(r->file, '/')))
+				continue;
+			*slash = '\0';
+			int ok = access(*r->file ? r->file : "/", W_OK | X_OK);
+			*slash = '/';
+			if(ok < 0)
+				return r;
+		}
+	}
+	return NULL;
+}
+
+/* Here-documents. n<<word and n<<<word redirect descriptor n (0 by
+ * default) from a memfd holding the text: the lines that follow the
+ * command line, up to one that is word, or word and a newline. The memfd
+ * is made while parsing, filled (by read_heredocs() for <<) and sealed;
+ * each child then opens it again through /proc/<dsh>/fd/<memfd>, which
+ * gives every reader its own offset and costs no file system I/O or
+ * helper process. free_job() closes it. The text is kept as written:
+ * unlike sh, an unquoted word does not make $ and \ in it expand. */
+
+/* Give r a new memfd; false on failure */
+bool heredoc_new(redir_t *r, arena_t *arena) {
+	char path[48];
+
+	r->kind = REDIR_HEREDOC;
+	if((r->from = memfd_create("dsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+		perror("memfd_create");
+		return false;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)getpid(), r->from);
+	if(!(r->file = arena_strndup(arena, path, strlen(path)))) {
+		close(r->from);
+		r->from = -1;
+		return false;
+	}
+	return true;
+}
+
+/* Make r's text final: nothing can write, grow or shrink it any more */
+void heredoc_seal(redir_t *r) {
+	r->delim = NULL;
+	fcntl(r->from, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+}
+
+/* Process launch backends. Both start process p of job j in the job's
+ * process group with infd/outfd as its stdin/stdout and j->mystderr as its
+ * stderr, closing closefd (the read end of the pipe feeding the next
+ * stage) in the child.
+ *
+ * LAUNCH_FORK forks and sets the child up by hand. LAUNCH_SPAWN expresses
+ * the same setup as posix_spawn attributes and file actions; glibc runs
+ * those in a clone(CLONE_VM|CLONE_VFORK) child, so the launch cost does not
+ * grow with the page tables of the shell the way fork() does.
+ * Return the pid of the child, or -1 if it could not be started.
+ */
+pid_t launch_fork(job_t *j, process_t *p, int infd, int outfd, int closefd, bool fg) {
+
+	pid_t pid;
+
+	switch (pid = fork()) {
+
+	   case -1: /* fork failure */
+		perror("fork");
+		exit(EXIT_FAILURE);
+
+	   case 0: /* child */
+
+	       /* establish a new process group, and put the child in
+		* foreground if requested
+		*/
+		if (j->pgid < 0) /* init sets -ve to a new process */
+			j->pgid = getpid();
+		p->pid = 0;
+
+		/* without job control children stay in the shell's group */
+		if (shell_is_interactive && !setpgid(0,j->pgid))
+			if(fg) // If success and fg is set
+			     tcsetpgrp(shell_terminal, j->pgid); // assign the terminal
+
+		/* Set the handling for job control signals back to the default. */
+		signal(SIGTTOU, SIG_DFL);
+		sigprocmask(SIG_SETMASK, &shell_sigmask, NULL);
+
+		/* CPUs, priorities and memory policy, which exec keeps */
+		if(j->sched && !sched_apply(j->sched, 0))
+			_exit(126);
+
+		// Set-up appropriate I/O
+		if(infd != j->mystdin)
+			dup2(infd, j->mystdin);
+		if(outfd != j->mystdout)
+			dup2(outfd, j->mystdout);
+		if(j->mystderr != STDERR_FILENO)
+			dup2(j->mystderr, STDERR_FILENO);
+		/* the pipes, and closefd with them, go with everything else
+		 * the shell has open */
+		redirect_child(p);
+
+		/* a builtin inside a pipeline runs right here in the child */
+		builtin_t *b = find_builtin(p->argv[0]);
+		if(b) {
+			int rc = b->fn(j, p, STDIN_FILENO, STDOUT_FILENO);
+			fflush(stdout);
+			_exit(rc);
+		}
+
+		/* execute the command through exec_ call */
+		execve(p->path, p->argv, process_envp(j, p));
+		_exit(1); /* do not flush the parent's stdio buffers twice */
+	}
+	return pid;
+}
+
+pid_t launch_spawn(job_t *j, process_t *p, int infd, int outfd, int closefd, bool fg) {
+
+	pid_t pid;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions;
+	sigset_t sigdefault;
+	redir_t *r;
+	int err;
+
+	if(posix_spawnattr_init(&attr) != 0)
+		return launch_fork(j, p, infd, outfd, closefd, fg);
+	if(posix_spawn_file_actions_init(&actions) != 0) {
+		posix_spawnattr_destroy(&attr);
+		return launch_fork(j, p, infd, outfd, closefd, fg);
+	}
+
+	/* setpgid(0, pgid) in the child; 0 makes the first stage the leader.
+	 * Without job control children stay in the shell's group. */
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK
+				 | (shell_is_interactive ? POSIX_SPAWN_SETPGROUP : 0));
+	posix_spawnattr_setpgroup(&attr, j->pgid < 0 ? 0 : j->pgid);
+	posix_spawnattr_setsigmask(&attr, &shell_sigmask);
+
+	/* Set the handling for job control signals back to the default. */
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGTTOU);
+	posix_spawnattr_setsigdefault(&attr, &sigdefault);
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+	/* Terminal handoff happens in the child, after setpgid, while glibc
+	 * still has all signals blocked, so SIGTTOU cannot stop it. */
+	if(fg && shell_is_interactive)
+		posix_spawn_file_actions_addtcsetpgrp_np(&actions, shell_terminal);
+#endif
+
+	// Set-up appropriate I/O; the pipes, closefd included, are close-on-exec
+	if(infd != j->mystdin)
+		posix_spawn_file_actions_adddup2(&actions, infd, j->mystdin);
+	if(outfd != j->mystdout)
+		posix_spawn_file_actions_adddup2(&actions, outfd, j->mystdout);
+	if(j->mystderr != STDERR_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, j->mystderr, STDERR_FILENO);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+	posix_spawn_file_actions_addclosefrom_np(&actions, child_fd_base);
+#else
+	/* No way to close the shell's own descriptors in the child before
+	 * glibc 2.34; the fork launcher does it with close_range(). */
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	return launch_fork(j, p, infd, outfd, closefd, fg);
+#endif
+	for(r = p->redirs; r; r = r->next)
+		if(r->kind == REDIR_DUP)
+			posix_spawn_file_actions_adddup2(&actions, r->from, r->fd);
+		else
+			posix_spawn_file_actions_addopen(&actions, r->fd, r->file, redir_flags(r), 0666);
+
+	err = posix_spawn(&pid, p->path, &actions, &attr, p->argv, process_envp(j, p));
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if(err != 0 && (r = failed_redirect(p))) {
+		if(r->kind == REDIR_DUP)
+			fprintf(stderr, "dsh: %d: %s\n", r->from, strerror(errno));
+		else
+			perror(r->file);
+		p->status = W_EXITCODE(1, 0);
+		return -1;
+	}
+	if(err != 0) {
+		fprintf(stderr, "%s: %s\n", p->argv[0], strerror(err));
+		if(err == ENOENT && p->path != p->argv[0]) /* stale cache entry */
+			path_cache_forget(p->argv[0]);
+		errno = err;
+		return -1;
+	}
+	return pid;
+}
+
+/* Start p with the selected backend. Returns -1 with errno set to ENOENT
+ * if there is no such command. */
+pid_t launch_process(job_t *j, process_t *p, int infd, int outfd, int closefd, bool fg) {
+	/* builtins have no executable to spawn */
+	if(find_builtin(p->argv[0]))
+		return launch_fork(j, p, infd, outfd, closefd, fg);
+	if(!(p->path = resolve_command(p->argv[0]))) {
+		fprintf(stderr, "dsh: %s: command not found\n", p->argv[0]);
+		errno = ENOENT;
+		return -1;
+	}
+	/* posix_spawn has no attributes for affinity, nice, I/O priority
+	 * or memory policy */
+	if(launch_backend == LAUNCH_SPAWN && !j->sched)
+		return launch_spawn(j, p, infd, outfd, closefd, fg);
+	return launch_fork(j, p, infd, outfd, closefd, fg);
+}
+
+/* True if argv[0] names cat */
+bool is_cat(char *name) {
+	char *base = strrchr(name, '/');
+	return strcmp(base ? base + 1 : name, "cat") == 0;
+}
+
+/* True if file can be opened for reading and is a regular file */
+bool is_regular_file(char *file) {
+	struct stat st;
+	int fd = open(file, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	bool regular;
+	if(fd < 0)
+		return false;
+	regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	close(fd);
+	return regular;
+}
+
+/* Pipeline planner: drop stages that only move bytes around.
+ *   cat file | x ...   becomes   x ... < file
+ *   x | cat | y        becomes   x | y
+ * A trailing "| cat" is kept, since it changes what the previous stage
+ * sees as its stdout (a pipe instead of a terminal), and so is any cat
+ * with redirections of its own. A leading cat stays unless its file opens
+ * as a regular file, so cat reports a missing one and x still runs. */
+void plan_job(job_t *j) {
+	process_t *p, **pp;
+	redir_t *r;
+
+	p = j->first_process;
+	if(p->next && !p->redirs && !redirects(p->next, STDIN_FILENO) && is_cat(p->argv[0])
+	   && p->argc == 2 && p->argv[1][0] != '-' && is_regular_file(p->argv[1])
+	   && (r = (redir_t *)arena_alloc(j->arena, sizeof(redir_t)))) {
+		r->kind = REDIR_IN;
+		r->fd = STDIN_FILENO;
+		r->file = p->argv[1];
+		r->next = p->next->redirs;
+		p->next->redirs = r;
+		j->first_process = p->next;
+	}
+	for(pp = &j->first_process; (p = *pp); ) {
+		if(p != j->first_process && p->next && is_cat(p->argv[0]) && p->argc == 1 && !p->redirs)
+			*pp = p->next;
+		else
+			pp = &p->next;
+	}
+}
+
+/* Parse a size such as 65536, 256k or 1M; -1 if malformed */
+long parse_size(char *arg) {
+	char *end;
+	long size = strtol(arg, &end, 10);
+	if(end == arg || size < 0)
+		return -1;
+	if(*end == 'k' || *end == 'K')
+		size <<= 10, ++end;
+	else if(*end == 'm' || *end == 'M')
+		size <<= 20, ++end;
+	return *end ? -1 : size;
+}
+
+/* Spawning a process with job control. fg is true if the 
+ * newly-created process is to be placed in the foreground. 
+ * (This implicitly puts the calling process in the background, 
+ * so watch out for tty I/O after doing this.) pgid is -1 to 
+ * create a new job, in which case the returned pid is also the 
+ * pgid of the new job.  Else pgid specifies an existing job's 
+ * pgid: this feature is used to start the second or 
+ * subsequent processes in a pipeline.
+ * */
+
+
+void spawn_job(job_t *j, bool fg) {
+
+	pid_t pid;
+	process_t *p;
+
+	int mypipe[2] = {-1, -1};
+	int capacity = j->pipe_size ? j->pipe_size : pipe_capacity;
+
+	/* a cached job whose output is already known does not run */
+	if(j->cache && cache_replay(j)) {
+		j->pgid = 0;
+		job_changed(j);
+		return;
+	}
+
+	if(plan_pipelines)
+		plan_job(j);
+	
+	/* Redirections are done by each child (see redirect_child()); the
+	 * shell only makes the pipes between the stages */
+	// Initialize job mystdin, mystdout, mystderr
+	j->mystdin = STDIN_FILENO;
+	j->mystdout = STDOUT_FILENO;
+	j->mystderr = STDERR_FILENO;
+
+	int input = j->mystdin;
+	int output;
+
+	/* a captured & job writes its stdout and stderr to the capture pipe */
+	int capture_out = -1;
+	if(!fg && j->bg && capture_size > 0 && capture_start(j, &capture_out))
+		j->mystderr = capture_out;
+
+	/* children write to the same descriptors; keep output in order */
+	fflush(stdout);
+
+	/* A job can contain a pipeline; Loop through process and set up pipes accordingly */
+
+	/* Every stage of the pipeline is forked before the shell waits on any of
+	 * them, so producers and consumers run concurrently and a full pipe never
+	 * stalls the job. The whole process group is then waited on in one place
+	 * (finishFGJob) once the last stage is running.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &j->start);
+	for(p = j->first_process; p; p = p->next) {
+		// If there is a next process, configure pipes 
+		if(p->next){
+			if(pipe2(mypipe, O_CLOEXEC) < 0){
+				perror("pipe");
+				exit(1);
+			}
+			if(capacity > 0 && fcntl(mypipe[1], F_SETPIPE_SZ, capacity) < 0)
+				perror("F_SETPIPE_SZ");
+			
+			output = mypipe[1];
+		}
+		else{
+			// There is no next process so its output is the job's
+			output = capture_out >= 0 ? capture_out : j->mystdout;
+			mypipe[0] = -1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &p->start);
+		pid = launch_process(j, p, input, output, mypipe[0], fg);
+		if(pid > 0) {
+			/* establish child process group here to avoid race
+			* conditions. */
+			p->pid = pid;
+			index_process(p);
+			log_event("spawn", "job=%d pid=%d argv0=%s", j->id, (int)pid, p->argv[0]);
+			if (j->pgid <= 0) {
+				j->pgid = pid;
+				index_job(j);
+			}
+			if(shell_is_interactive)
+				setpgid(pid, j->pgid);
+		}
+		else {
+			/* the stage never ran; report it as a failed exit,
+			 * unless launching it said how it failed */
+			p->completed = true;
+			if(p->status == -1)
+				p->status = W_EXITCODE(errno == ENOENT ? 127 : 1, 0);
+			p->end = p->start;
+		}
+
+		/* Reset file IOs if necessary */
+		if(input != j->mystdin){
+			close(input);
+		}
+		if(output != j->mystdout){
+			close(output);
+		}
+		input = mypipe[0];
+	}
+	j->mystderr = STDERR_FILENO; /* the capture pipe, closed above */
+
+	/* No stage could be started; keep the job from being spawned again
+	 * and let do_job_notification() clean it up */
+	if(j->pgid < 0) {
+		j->pgid = 0;
+		job_changed(j);
+	}
+
+	if(fg && j->pgid > 0){
+		/* Wait for the whole job (process group) to complete or stop */
+		if(shell_is_interactive)
+			tcsetpgrp(shell_terminal, j->pgid);
+		finishFGJob(j);
+		if(shell_is_interactive) {
+			tcsetpgrp(shell_terminal, shell_pgid);
+			tcgetattr(shell_terminal, &j->tmodes);
+			tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+		}
+	}
+}
+
+
+
+bool init_job(job_t *j, arena_t *arena) {
+	j->arena = arena;
+	j->next = NULL;
+	j->prev = NULL;
+	j->hash_next = NULL;
+	j->changed_next = NULL;
+	j->changed = false;
+	j->id = 0;
+	j->commandinfo = NULL; /* set once the parser knows its extent */
+	j->pipe_size = 0;
+	j->timed = false;
+	j->capture = NULL;
+	j->cache = NULL;
+	j->sched = NULL;
+	memset(&j->rusage, 0, sizeof(j->rusage));
+	j->first_process = NULL;
+	j->pgid = -1; 	/* -1 indicates new spawn new job*/
+	j->notified = false;
+	j->mystdin = STDIN_FILENO; 	/* 0 */
+	j->mystdout = STDOUT_FILENO;	/* 1 */ 
+	j->mystderr = STDERR_FILENO;	/* 2 */
+	j->bg = false;
+	j->body = NULL;
+	j->kept = false;
+	j->node = NULL;
+	return true;
+}
+
+bool init_process(process_t *p, arena_t *arena) {
+	p->pid = -1; /* -1 indicates new process */
+	p->completed = false;
+	p->stopped = false;
+	p->status = -1; /* set by wait4 */
+	p->argc = 0;
+	p->next = NULL;
+	p->hash_next = NULL;
+	p->job = NULL;
+	p->path = NULL; /* set by launch_process() */
+	p->assign = NULL;
+	p->nassign = 0;
+	p->globs = NULL;
+	p->vars = NULL;
+	p->redirs = NULL;
+
+        p->argv_size = 8; /* grown by add_arg() */
+        if(!(p->argv = (char **)arena_alloc(arena, p->argv_size * sizeof(char *))))
+                return false;
+
+	return true;
+}
+
+/* Append word to p's argv, keeping argv NULL-terminated for exec_() calls */
+bool add_arg(process_t *p, char *word, arena_t *arena) {
+	if(p->argc + 1 >= p->argv_size) {
+		char **argv = (char **)arena_alloc(arena, 2 * p->argv_size * sizeof(char *));
+		if(!argv)
+			return false;
+		memcpy(argv, p->argv, p->argc * sizeof(char *));
+		p->argv = argv;
+		p->argv_size *= 2;
+	}
+	p->argv[p->argc++] = word;
+	p->argv[p->argc] = NULL;
+	return true;
+}
+
+bool invokefree(job_t *j, char *msg){
+	fprintf(stderr, "%s\n",msg);
+	delete_job(j);
+	return true;
+}
+
+/* Prints the active jobs in the list.  */
+	void print_job() {
+		job_t *j;
+		process_t *p;
+		for(j = first_job; j; j = j->next) {			
+			fprintf(stdout, "job: %s\n", j->commandinfo);
+			for(p = j->first_process; p; p = p->next) {
+				fprintf(stdout,"cmd: %s\t", p->argv[0]);
+				int i;
+				for(i = 1; i < p->argc; i++) 
+					fprintf(stdout, "%s ", p->argv[i]);
+				fprintf(stdout, "\n");
+				redir_t *r;
+				for(r = p->redirs; r; r = r->next)
+					if(r->kind == REDIR_DUP)
+						fprintf(stdout, "Descriptor %d: copy of %d\n", r->fd, r->from);
+					else if(r->kind == REDIR_HEREDOC)
+						fprintf(stdout, "Descriptor %d: here-document\n", r->fd);
+					else
+						fprintf(stdout, "Descriptor %d: %s %s\n", r->fd,
+							r->kind == REDIR_IN ? "input from" : r->kind == REDIR_OUT
+							? "output to" : "appended to", r->file);
+			}
+			if(j->bg) fprintf(stdout, "Background job\n");	
+			else fprintf(stdout, "Foreground job\n");	
+		}
+	}
+
+	/* Characters that end a word inside a job */
+	bool is_meta(char c) {
+		return c == '<' || c == '>' || c == '|';
+	}
+
+	/* Command line scanners. The parser skips over ordinary bytes in bulk:
+	 * scanner->job finds the next byte that can end a pipeline (; & |
+	 * newline), start a comment (#) or quote something (' " \), and
+	 * scanner->word the next one that ends, quotes or globs a word
+	 * (whitespace, < > |, ' " \, NUL, * ? [). Both return an offset into
+	 * the len bytes at s, or len if there is none. The scalar loop looks each byte up in scan_class[].
+	 * The SSE2 and AVX2 versions classify 16 or 32 bytes per step and
+	 * finish with the scalar loop; words are short, so the word scanners
+	 * try the first 16 bytes with the table before any vector step.
+	 * set_scanner() picks the widest the CPU has, or the one DSH_SCAN
+	 * names. */
+	enum { SCAN_JOB = 1, SCAN_WORD = 2 };
+	static const unsigned char scan_class[256] = {
+		[';'] = SCAN_JOB, ['&'] = SCAN_JOB, ['#'] = SCAN_JOB,
+		['\''] = SCAN_JOB | SCAN_WORD, ['"'] = SCAN_JOB | SCAN_WORD, ['\\'] = SCAN_JOB | SCAN_WORD,
+		[' '] = SCAN_WORD, ['\t'] = SCAN_WORD, ['\n'] = SCAN_JOB | SCAN_WORD, ['\v'] = SCAN_WORD,
+		['\f'] = SCAN_WORD, ['\r'] = SCAN_WORD, ['<'] = SCAN_WORD, ['>'] = SCAN_WORD,
+		['|'] = SCAN_JOB | SCAN_WORD, ['\0'] = SCAN_WORD, ['*'] = SCAN_WORD, ['?'] = SCAN_WORD,
+		['['] = SCAN_WORD,
+	};
+
+	size_t scan_job_scalar(const char *s, size_t len) {
+		size_t i;
+		for(i = 0; i < len && !(scan_class[(unsigned char)s[i]] & SCAN_JOB); i++)
+			;
+		return i;
+	}
+
+	size_t scan_word_scalar(const char *s, size_t len) {
+		size_t i;
+		for(i = 0; i < len && !(scan_class[(unsigned char)s[i]] & SCAN_WORD); i++)
+			;
+		return i;
+	}
+
+#if defined(__x86_64__)
+	static inline __m128i job_mask_sse2(__m128i v) {
+		__m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(';'));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+		return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+	}
+
+	/* isspace() in the C locale is ' ' and '\t'..'\r' (9..13) */
+	static inline __m128i word_mask_sse2(__m128i v) {
+		__m128i t = _mm_sub_epi8(v, _mm_set1_epi8(9));
+		__m128i m = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('[')));
+		return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	}
+
+	size_t scan_job_sse2(const char *s, size_t len) {
+		size_t i;
+		for(i = 0; i + 16 <= len; i += 16) {
+			unsigned bits = _mm_movemask_epi8(job_mask_sse2(_mm_loadu_si128((const __m128i *)(s + i))));
+			if(bits)
+				return i + __builtin_ctz(bits);
+		}
+		return i + scan_job_scalar(s + i, len - i);
+	}
+
+	size_t scan_word_sse2(const char *s, size_t len) {
+		size_t i, n = len < 16 ? len : 16;
+		if((i = scan_word_scalar(s, n)) < n) /* most words end within 16 bytes */
+			return i;
+		for(; i + 16 <= len; i += 16) {
+			unsigned bits = _mm_movemask_epi8(word_mask_sse2(_mm_loadu_si128((const __m128i *)(s + i))));
+			if(bits)
+				return i + __builtin_ctz(bits);
+		}
+		return i + scan_word_scalar(s + i, len - i);
+	}
+
+	__attribute__((target("avx2")))
+	static inline __m256i job_mask_avx2(__m256i v) {
+		__m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';'));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+		return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+	}
+
+	__attribute__((target("avx2")))
+	static inline __m256i word_mask_avx2(__m256i v) {
+		__m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+		__m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t);
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')));
+		return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+	}
+
+	__attribute__((target("avx2")))
+	size_t scan_job_avx2(const char *s, size_t len) {
+		size_t i = 0;
+		if(len >= 16) { /* most words end within 16 bytes */
+			unsigned bits = _mm_movemask_epi8(job_mask_sse2(_mm_loadu_si128((const __m128i *)s)));
+			if(bits)
+				return __builtin_ctz(bits);
+			i = 16;
+		}
+		for(; i + 32 <= len; i += 32) {
+			unsigned bits = _mm256_movemask_epi8(job_mask_avx2(_mm256_loadu_si256((const __m256i *)(s + i))));
+			if(bits)
+				return i + __builtin_ctz(bits);
+		}
+		/* the SSE2 code is not VEX encoded: clear the upper halves
+		 * first, or every instruction of it pays for a transition */
+		_mm256_zeroupper();
+		return i + scan_job_sse2(s + i, len - i);
+	}
+
+	__attribute__((target("avx2")))
+	size_t scan_word_avx2(const char *s, size_t len) {
+		size_t i, n = len < 16 ? len : 16;
+		if((i = scan_word_scalar(s, n)) < n) /* as in scan_word_sse2() */
+			return i;
+		for(; i + 32 <= len; i += 32) {
+			unsigned bits = _mm256_movemask_epi8(word_mask_avx2(_mm256_loadu_si256((const __m256i *)(s + i))));
+			if(bits)
+				return i + __builtin_ctz(bits);
+		}
+		_mm256_zeroupper(); /* see scan_job_avx2() */
+		return i + scan_word_sse2(s + i, len - i);
+	}
+#endif
+
+	scanner_t scanners[] = {
+#if defined(__x86_64__)
+		{ "avx2",	scan_job_avx2,		scan_word_avx2 },
+		{ "sse2",	scan_job_sse2,		scan_word_sse2 },
+#endif
+		{ "scalar",	scan_job_scalar,	scan_word_scalar },
+	};
+	enum { NSCANNERS = sizeof(scanners) / sizeof(scanners[0]) };
+	scanner_t *scanner = &scanners[NSCANNERS - 1];
+
+	/* True if the CPU can run sc */
+	bool scanner_supported(scanner_t *sc) {
+#if defined(__x86_64__)
+		if(strcmp(sc->name, "avx2") == 0)
+			return __builtin_cpu_supports("avx2");
+#endif
+		return true;
+	}
+
+	/* Select the scanner by name, or the first one the CPU supports for
+	 * NULL; returns -1 if the name is unknown or the CPU lacks it */
+	int set_scanner(char *name) {
+		int i;
+		for(i = 0; i < NSCANNERS; i++)
+			if((!name || strcmp(name, scanners[i].name) == 0) && scanner_supported(&scanners[i])) {
+				scanner = &scanners[i];
+				return 0;
+			}
+		return -1;
+	}
+
+
+	/* Return the character that ends the word starting at s, removing
+	 * quotes in place as it goes: '...' is taken literally, "..." literally
+	 * except for \" and \\, and a backslash quotes the next character. *w
+	 * is set to the end of the unquoted word, which is at or before the
+	 * returned position. The text ends at end (a NUL). *flags gets
+	 * WORD_GLOB if the word has an unquoted * ? or [ and WORD_QUOTED if
+	 * anything in it was quoted. NULL if a quote is not closed. */
+	enum { WORD_GLOB = 1, WORD_QUOTED = 2 };
+
+	char *word_end(char *s, char *end, char **w, int *flags) {
+		char *out = s, quote;
+		while(1) {
+			/* runs of ordinary bytes move in one piece */
+			size_t n = scanner->word(s, end - s);
+			if(out != s)
+				memmove(out, s, n);
+			out += n;
+			s += n;
+			if(s >= end || *s == '\0' || isspace(*s) || is_meta(*s))
+				break;
+			if(*s == '*' || *s == '?' || *s == '[') {
+				*flags |= WORD_GLOB;
+				*out++ = *s++;
+			}
+			else if(*s == '\\' && s[1] != '\0') {
+				*flags |= WORD_QUOTED;
+				*out++ = s[1];
+				s += 2;
+			}
+			else if(*s == '\'' || *s == '"') {
+				*flags |= WORD_QUOTED;
+				quote = *s++;
+				while(*s != quote) {
+					if(*s == '\0')
+						return NULL;
+					if(quote == '"' && *s == '\\' && (s[1] == '"' || s[1] == '\\'))
+						++s;
+					*out++ = *s++;
+				}
+				++s;
+			}
+			else
+				*out++ = *s++;
+		}
+		*w = out;
+		return s;
+	}
+
+	/* NUL-terminate the word that ends at w and whose terminator is at *s,
+	 * stepping *s past the terminator if the NUL has to overwrite it. A
+	 * metacharacter overwritten this way is returned so the caller can still
+	 * act on it; otherwise 0. */
+	char end_word(char *w, char **s) {
+		char c = **s;
+		if(w < *s) { /* quotes were removed; there is room before *s */
+			*w = '\0';
+			return 0;
+		}
+		if(c == '\0')
+			return 0;
+		*(*s)++ = '\0';
+		return isspace(c) ? 0 : c;
+	}
+
+	/* Skip the quoted text starting at line[pos] (a quote or backslash);
+	 * returns the position of the closing character, or len if unclosed */
+	size_t skip_quoted(char *line, size_t pos, size_t len) {
+		char quote = line[pos];
+		if(quote == '\\')
+			return pos + 1 < len ? pos + 1 : len;
+		for(++pos; pos < len && line[pos] != quote; pos++)
+			if(quote == '"' && line[pos] == '\\')
+				++pos;
+		return pos < len ? pos : len;
+	}
+
+	/* Parse the rest of a redirection of descriptor fd whose < or > (op)
+	 * has been read, *s being just past it: >> appends, <&m and >&m make fd
+	 * a copy of m, << and <<< start a here-document, and otherwise a file
+	 * name follows. The redirection is added to the end of p's list.
+	 * Returns an error message, or NULL. */
+	char *read_redirect(process_t *p, char op, int fd, char **s, char *send,
+	                    char *pending, arena_t *arena) {
+		redir_t *r = (redir_t *)arena_alloc(arena, sizeof(redir_t)), **rp;
+		char *word, *w, *digits;
+		int flags = 0;
+		long from;
+
+		if(!r)
+			return "malloc: no space";
+		r->fd = fd;
+		r->kind = op == '<' ? REDIR_IN : REDIR_OUT;
+		if(op == '>' && **s == '>') {
+			r->kind = REDIR_APPEND;
+			++*s;
+		}
+		else if(op == '<' && **s == '<') {
+			r->kind = REDIR_HEREDOC;
+			if(*++*s == '<')
+				++*s;
+			else
+				r->delim = "";
+		}
+		if(**s == '&' && (r->kind == REDIR_IN || r->kind == REDIR_OUT)) {
+			from = strtol(digits = ++*s, s, 10);
+			if(*s == digits || *digits < '0' || *digits > '9' || from > REDIR_FD_MAX
+			   || (**s && !isspace(**s) && !is_meta(**s)))
+				return "redirection: bad file descriptor";
+			r->kind = REDIR_DUP;
+			r->from = from;
+		}
+		else {
+			while(isspace(**s)){++*s;}
+			word = *s;
+			if(!(*s = word_end(*s, send, &w, &flags)))
+				return "reading cmdline: unterminated quote";
+			if(*s == word)
+				return "redirection: missing file name";
+			*pending = end_word(w, s);
+			r->file = word;
+		}
+		for(rp = &p->redirs; *rp; rp = &(*rp)->next)
+			;
+		*rp = r;
+
+		/* << waits for read_heredocs(); <<< has its text already */
+		if(r->kind == REDIR_HEREDOC) {
+			r->delim = r->delim ? word : NULL;
+			if(!heredoc_new(r, arena))
+				return "here-document: cannot create";
+			if(!r->delim) {
+				*w = '\n'; /* where the word's NUL was */
+				int rc = write_all(r->from, word, w - word + 1);
+				*w = '\0';
+				if(rc < 0)
+					return "here-document: cannot write";
+				heredoc_seal(r);
+			}
+		}
+		return NULL;
+	}
+
+	/* Compile the file name of p's newest redirection if it has a $ in it.
+	 * Its text as written is at the same offset in raw_line as it is in
+	 * line, and ends before s. Returns an error message, or NULL. */
+	char *redirect_vars(process_t *p, char *line, char *raw_line, char *s, arena_t *arena) {
+		redir_t *r;
+		bool err = false;
+		for(r = p->redirs; r->next; r = r->next)
+			;
+		if(r->kind == REDIR_DUP || r->kind == REDIR_HEREDOC)
+			return NULL;
+		char *raw = raw_line + (r->file - line), *end = raw_line + (s - line);
+		if(memchr(raw, '$', end - raw))
+			r->parts = compile_word(raw, end, arena, &err);
+		return err ? "malloc: no space" : NULL;
+	}
+
+	/* Report a parse error in j, which is on no list; NULL. Like sh, the
+	 * status of a line that does not parse is 2. */
+	job_t *parse_error(job_t *j, char *msg) {
+		fprintf(stderr, "%s\n", msg);
+		last_status = 2;
+		close_heredocs(j);
+		return NULL;
+	}
+
+	/* Parse one job -- a pipeline with optional redirections -- from the
+	 * len bytes at text, which contain no ; & (but the one of n>&m) or
+	 * comment, into arena. The text is copied once into the arena and
+	 * tokenized there in place: words are NUL-terminated where they stand
+	 * and argv and redirected file names point into that copy, so there is
+	 * no per-token copy and no length limit. An argument with an unquoted *
+	 * ? or [ goes on p->globs, to be expanded when the job runs (see
+	 * expand_globs()), and one with a $ on p->vars (see expand_vars()).
+	 * Returns the job, which is on no list yet, or NULL after reporting
+	 * the error. */
+	job_t *parse_job(char *text, size_t len, arena_t *arena) {
+
+		while(len > 0 && isspace(text[len - 1]))
+			--len;
+
+		job_t *current_job = (job_t *)arena_alloc(arena, sizeof(job_t));
+		if(!current_job || !init_job(current_job, arena)) {
+			fprintf(stderr, "init_job: malloc failed\n");
+			return NULL;
+		}
+
+		char *s = arena_strndup(arena, text, len), *send = s + len, *line = s;
+		if(!s || !(current_job->commandinfo = arena_strndup(arena, text, len)))
+			return parse_error(current_job,"malloc: no space");
+
+		process_t *current_process = (process_t *)arena_alloc(arena, sizeof(process_t));
+		if(!current_process || !init_process(current_process, arena))
+			return parse_error(current_job,"init_process: failed");
+		current_process->job = current_job;
+		current_job->first_process = current_process;
+
+		char c, pending = 0;
+		char *word, *w;
+		char *err;
+		int flags;
+		bool dollars = memchr(line, '$', len) != NULL; /* else no word has one */
+		while(1) {
+			if(pending) { /* s is already past it */
+				c = pending;
+				pending = 0;
+			}
+			else {
+				while(isspace(*s)){++s;} /* ignore any spaces */
+				if((c = *s) == '\0')
+					break;
+				if(is_meta(c))
+					++s;
+			}
+
+			switch (c) {
+
+			    case '<': /* input redirection */
+			    case '>': /* output redirection */
+				if((err = read_redirect(current_process, c, c == '<' ? STDIN_FILENO : STDOUT_FILENO,
+				                        &s, send, &pending, arena))
+				   || (dollars && (err = redirect_vars(current_process, line, current_job->commandinfo, s, arena))))
+					return parse_error(current_job, err);
+				break;
+
+			   case '|': /* pipeline */
+				if(current_process->argc == 0)
+					return parse_error(current_job,"reading cmdline: missing command before |");
+				process_t *newprocess = (process_t *)arena_alloc(arena, sizeof(process_t));
+				if(!newprocess || !init_process(newprocess, arena))
+					return parse_error(current_job,"init_process: failed");
+				newprocess->job = current_job;
+				current_process->next = newprocess;
+				current_process = newprocess;
+				break;
+
+			   default: /* argument */
+				word = s;
+				flags = 0;
+				if(!(s = word_end(s, send, &w, &flags)))
+					return parse_error(current_job,"reading cmdline: unterminated quote");
+				/* the word as written, quotes and all, is in commandinfo */
+				char *raw = current_job->commandinfo + (word - line);
+				size_t rawlen = s - word;
+				pending = end_word(w, &s);
+				/* an unquoted number right before < or > is the
+				 * descriptor redirected, not an argument */
+				if((pending == '<' || pending == '>') && !flags && rawlen <= 4
+				   && strspn(word, "0123456789") == rawlen) {
+					c = pending;
+					pending = 0;
+					if((err = read_redirect(current_process, c, atoi(word), &s, send, &pending, arena))
+					   || (dollars && (err = redirect_vars(current_process, line, current_job->commandinfo, s, arena))))
+						return parse_error(current_job, err);
+					break;
+				}
+				if(!add_arg(current_process, word, arena))
+					return parse_error(current_job,"malloc: no space");
+				word_part_t *parts = NULL;
+				if(dollars && memchr(raw, '$', rawlen)) {
+					bool failed = false;
+					var_word_t *v, **vp;
+					if(!(parts = compile_word(raw, raw + rawlen, arena, &failed)) && failed)
+						return parse_error(current_job,"malloc: no space");
+					if(parts) {
+						if(!(v = (var_word_t *)arena_alloc(arena, sizeof(var_word_t))))
+							return parse_error(current_job,"malloc: no space");
+						v->index = current_process->argc - 1;
+						v->parts = parts;
+						for(vp = &current_process->vars; *vp; vp = &(*vp)->next)
+							;
+						*vp = v;
+					}
+				}
+				if(flags & WORD_GLOB) {
+					/* a word with $ references globs what it expands to */
+					glob_word_t *g = (glob_word_t *)arena_alloc(arena, sizeof(glob_word_t)), **gp;
+					if(!g || (!parts && !(g->pattern = flags & WORD_QUOTED ? glob_pattern(raw, rawlen, arena) : word)))
+						return parse_error(current_job,"malloc: no space");
+					g->index = current_process->argc - 1;
+					for(gp = &current_process->globs; *gp; gp = &(*gp)->next)
+						;
+					*gp = g;
+				}
+				break;
+			}
+		}
+		if(current_process->argc == 0)
+			return parse_error(current_job,"reading cmdline: missing command");
+		return current_job;
+	}
+
+	/* Append j to the job list */
+	void link_job(job_t *j) {
+		j->prev = last_job;
+		if(last_job)
+			last_job->next = j;
+		else
+			first_job = j;
+		last_job = j;
+	}
+
+	/* Parse one job from the len bytes at text into an arena of its own
+	 * and append it to the job list with a job id; see parse_job() */
+	bool readjob(char *text, size_t len, bool bg) {
+		arena_t *arena = arena_new();
+		job_t *j;
+
+		if(!arena)
+			return invokefree(NULL,"malloc: no space");
+		if(!(j = parse_job(text, len, arena))) {
+			arena_release(arena);
+			return false;
+		}
+		j->bg = bg;
+		link_job(j);
+		if(!register_job(j))
+			return invokefree(j,"malloc: no space");
+		log_event("parse", "job=%d bg=%d cmd=\"%s\"", j->id, bg, j->commandinfo);
+		return true;
+	}
+
+	/* End of the pipeline starting at line[pos]: the first unquoted ; &
+	 * (but the one of n>&m), &&, ||, newline or comment, or len */
+	size_t pipeline_end(char *line, size_t pos, size_t len) {
+		size_t end;
+
+		for(end = pos; ; end++) {
+			end += scanner->job(line + end, len - end);
+			if(end >= len)
+				return len;
+			if(line[end] == '\n' || (line[end] == '|' && end + 1 < len && line[end + 1] == '|'))
+				return end;
+			if(line[end] == '|' || (line[end] == '&' && end > pos
+			   && (line[end - 1] == '>' || line[end - 1] == '<')))
+				continue; /* a pipe, or n>&m */
+			if(line[end] == ';' || line[end] == '&'
+			   || (line[end] == '#' && (end == pos || isspace(line[end - 1]))))
+				return end;
+			if(line[end] != '#' && (end = skip_quoted(line, end, len)) >= len)
+				return len;
+		}
+	}
+
+	/* Compound commands. A command that starts with a reserved word (if,
+	 * while, until, for or {) or defines a function (name() ...), or a
+	 * command line that joins pipelines with && or ||, is parsed by
+	 * recursive descent into a tree of node_t. The tree belongs to a job
+	 * of its own (j->body) that takes its place on the job list and is run
+	 * by run_compound(). Each pipeline in the tree is parsed by
+	 * parse_job() once, into a template that run_template() copies into
+	 * the node's scratch arena for every run, so a loop body is never
+	 * tokenized again. Reserved words count only unquoted at the start of
+	 * a command, and newlines separate commands like ;. */
+	typedef struct {
+		char *line;		/* the text */
+		size_t pos, len;
+		arena_t *arena;		/* holds the tree */
+		job_t *owner;		/* the job the tree belongs to */
+		job_t *templates;	/* parsed so far, chained through next */
+		bool incomplete;	/* the text ended inside a compound command */
+	} parser_t;
+
+	/* Set by parse_cmdline() when the line ends inside a compound
+	 * command, for readcmdline() to read on, with the words ending the
+	 * << here-documents in it so far, in order */
+	bool parse_incomplete;
+	char **open_heredocs;
+	int nopen_heredocs, open_heredocs_size;
+
+	/* Note the here-documents of the templates from t on, oldest first */
+	void note_heredocs(job_t *t) {
 		process_t *p;
-		for(j = first_job; j; j = j->next) {			
-			fprintf(stdout, "job: %s\n", j->commandinfo);
-			for(p = j->first_process; p; p = p->next) {
-				fprintf(stdout,"cmd: %s\t", p->argv[0]);
-				int i;
-				for(i = 1; i < p->argc; i++) 
-					fprintf(stdout, "%s ", p->argv[i]);
-				fprintf(stdout, "\n");
+		redir_t *r;
+		if(!t)
+			return;
+		note_heredocs(t->next);
+		for(p = t->first_process; p; p = p->next)
+			for(r = p->redirs; r; r = r->next) {
+				if(r->kind != REDIR_HEREDOC || !r->delim)
+					continue;
+				if(nopen_heredocs == open_heredocs_size) {
+					int size = open_heredocs_size ? 2 * open_heredocs_size : 8;
+					char **grown = (char **)realloc(open_heredocs, size * sizeof(char *));
+					if(!grown)
+						return;
+					open_heredocs = grown;
+					open_heredocs_size = size;
+				}
+				if((open_heredocs[nopen_heredocs] = strdup(r->delim)))
+					nopen_heredocs++;
+			}
+	}
+
+	static const char *const reserved_words[] = {
+		"if", "then", "elif", "else", "fi", "while", "until", "for", "do", "done", "{", "}", NULL
+	};
+
+	/* True for a byte that ends a word: NUL, a space, ; & | < > ( or ) */
+	static inline bool ends_word(char c) {
+		switch(c) {
+		case '\0': case ' ': case '\t': case '\n': case '\v': case '\f': case '\r':
+		case ';': case '&': case '|': case '<': case '>': case '(': case ')':
+			return true;
+		}
+		return false;
+	}
+
+	/* Length of the word at s, up to a space, ; & | < > ( or ) */
+	size_t word_length(const char *s, size_t len) {
+		size_t n = 0;
+		while(n < len && !ends_word(s[n]))
+			n++;
+		return n;
+	}
+
+	/* True if the word at the parser's position is one of words */
+	bool at_word(parser_t *ps, const char *const *words) {
+		size_t n = word_length(ps->line + ps->pos, ps->len - ps->pos);
+		for(; *words; words++)
+			if(strlen(*words) == n && memcmp(*words, ps->line + ps->pos, n) == 0)
+				return true;
+		return false;
+	}
+
+	/* Step over word if it is the one at the parser's position */
+	bool accept(parser_t *ps, const char *word) {
+		const char *words[] = { word, NULL };
+		if(!at_word(ps, words))
+			return false;
+		ps->pos += strlen(word);
+		return true;
+	}
+
+	/* Length of the "()" after a function name at s, blanks included; 0 if none */
+	size_t function_parens(const char *s, size_t len) {
+		size_t n = strspn(s, " \t");
+		if(n >= len || s[n] != '(')
+			return 0;
+		n += 1 + strspn(s + n + 1, " \t");
+		return n < len && s[n] == ')' ? n + 1 : 0;
+	}
+
+	/* True if the command at s starts a compound command */
+	bool starts_compound(const char *s, size_t len) {
+		const char *const *w;
+		size_t n = word_length(s, len);
+		if(n == 0)
+			return false;
+		if(n <= 5) /* no reserved word is longer */
+			for(w = reserved_words; *w; w++)
+				if(**w == *s && strlen(*w) == n && memcmp(*w, s, n) == 0)
+					return true;
+		return name_length(s) == n && function_parens(s + n, len - n);
+	}
+
+	/* Skip blanks and comments; with separators, also newlines and ; */
+	void skip_blanks(parser_t *ps, bool separators) {
+		char c;
+		for(; ps->pos < ps->len; ps->pos++) {
+			c = ps->line[ps->pos];
+			if(c == '#')
+				while(ps->pos + 1 < ps->len && ps->line[ps->pos + 1] != '\n')
+					ps->pos++;
+			else if(c != ' ' && c != '\t' && (!separators || (c != '\n' && c != ';')))
+				break;
+		}
+	}
+
+	/* Report what is at the parser's position as unexpected; NULL */
+	node_t *syntax_error(parser_t *ps) {
+		char *s = ps->line + ps->pos;
+		size_t n = word_length(s, ps->len - ps->pos);
+		last_status = 2; /* as in parse_error() */
+		if(ps->pos >= ps->len)
+			fprintf(stderr, "dsh: syntax error: unexpected end of input\n");
+		else if(*s == '&' && (ps->pos + 1 >= ps->len || s[1] != '&'))
+			fprintf(stderr, "dsh: & after a compound command is not supported\n");
+		else
+			fprintf(stderr, "dsh: syntax error near \"%.*s\"\n", (int)(n ? n : *s == '\n' ? 0 : 1), s);
+		return NULL;
+	}
+
+	node_t *new_node(parser_t *ps, node_kind_t kind) {
+		node_t *n = (node_t *)arena_alloc(ps->arena, sizeof(node_t));
+		if(!n)
+			fprintf(stderr, "malloc: no space\n");
+		else
+			n->kind = kind;
+		return n;
+	}
+
+	/* Parse the pipeline in line[start..end) into a template */
+	job_t *parse_template(parser_t *ps, size_t start, size_t end) {
+		job_t *t = parse_job(ps->line + start, end - start, ps->arena);
+		if(t) {
+			t->next = ps->templates;
+			ps->templates = t;
+		}
+		return t;
+	}
+
+	node_t *parse_and_or(parser_t *ps);
+	node_t *parse_command(parser_t *ps);
+
+	/* Parse commands separated by ; & or newlines up to one of the words
+	 * ends at the start of a command, which is left to the caller. The
+	 * list must not be empty. */
+	node_t *parse_list(parser_t *ps, const char *const *ends) {
+		node_t *head = NULL, **tail = &head, *n;
+
+		while(1) {
+			skip_blanks(ps, true);
+			if(ps->pos >= ps->len) {
+				ps->incomplete = true;
+				return NULL;
+			}
+			if(at_word(ps, ends))
+				return head ? head : syntax_error(ps);
+			if(!(n = parse_and_or(ps)))
+				return NULL;
+			*tail = n;
+			tail = &n->next;
+			skip_blanks(ps, false);
+			if(ps->pos >= ps->len)
+				continue;
+			char *s = ps->line + ps->pos;
+			if(*s == '&' && n->kind == NODE_JOB)
+				n->job->bg = true;
+			else if(*s != ';' && *s != '\n')
+				return syntax_error(ps);
+			ps->pos++;
+		}
+	}
+
+	/* if and elif: cond, then body, then an elif, an else or fi */
+	node_t *parse_if(parser_t *ps) {
+		static const char *const then[] = { "then", NULL }, *const branch[] = { "elif", "else", "fi", NULL },
+			*const fi[] = { "fi", NULL };
+		node_t *n = new_node(ps, NODE_IF);
+
+		ps->pos += word_length(ps->line + ps->pos, ps->len - ps->pos);
+		if(!n || !(n->cond = parse_list(ps, then)))
+			return NULL;
+		accept(ps, "then");
+		if(!(n->body = parse_list(ps, branch)))
+			return NULL;
+		if(at_word(ps, (const char *[]){ "elif", NULL }))
+			return (n->orelse = parse_if(ps)) ? n : NULL;
+		if(accept(ps, "else") && !(n->orelse = parse_list(ps, fi)))
+			return NULL;
+		accept(ps, "fi");
+		return n;
+	}
+
+	/* while or until cond; do body; done */
+	node_t *parse_while(parser_t *ps, node_kind_t kind) {
+		static const char *const do_[] = { "do", NULL }, *const done[] = { "done", NULL };
+		node_t *n = new_node(ps, kind);
+
+		ps->pos += 5; /* while or until */
+		if(!n || !(n->cond = parse_list(ps, do_)))
+			return NULL;
+		accept(ps, "do");
+		if(!(n->body = parse_list(ps, done)))
+			return NULL;
+		accept(ps, "done");
+		return n;
+	}
+
+	/* for name [in word ...]; do body; done. The words are parsed as one
+	 * command, so they are globbed and expanded like arguments. */
+	node_t *parse_for(parser_t *ps) {
+		static const char *const done[] = { "done", NULL };
+		node_t *n = new_node(ps, NODE_FOR);
+		size_t len, end;
+
+		ps->pos += 3;
+		skip_blanks(ps, false);
+		len = word_length(ps->line + ps->pos, ps->len - ps->pos);
+		if(!n)
+			return NULL;
+		if(!len || name_length(ps->line + ps->pos) != len)
+			return syntax_error(ps);
+		if(!(n->name = arena_strndup(ps->arena, ps->line + ps->pos, len))) {
+			fprintf(stderr, "malloc: no space\n");
+			return NULL;
+		}
+		ps->pos += len;
+		skip_blanks(ps, false);
+		while(ps->pos < ps->len && ps->line[ps->pos] == '\n') {
+			ps->pos++;
+			skip_blanks(ps, false);
+		}
+		if(accept(ps, "in")) {
+			skip_blanks(ps, false);
+			end = pipeline_end(ps->line, ps->pos, ps->len);
+			if(end > ps->pos)
+				n->job = parse_template(ps, ps->pos, end);
+			else if((n->job = (job_t *)arena_alloc(ps->arena, sizeof(job_t)))) {
+				/* for name in; ...: no words */
+				init_job(n->job, ps->arena);
+				if((n->job->first_process = (process_t *)arena_alloc(ps->arena, sizeof(process_t))))
+					init_process(n->job->first_process, ps->arena);
+			}
+			if(!n->job || !n->job->first_process)
+				return NULL;
+			if(n->job->first_process->next || n->job->first_process->redirs) {
+				fprintf(stderr, "dsh: for: words expected after in\n");
+				return NULL;
+			}
+			ps->pos = end;
+			skip_blanks(ps, false);
+			if(ps->pos < ps->len && ps->line[ps->pos] != ';' && ps->line[ps->pos] != '\n')
+				return syntax_error(ps);
+		}
+		skip_blanks(ps, true);
+		if(ps->pos >= ps->len) {
+			ps->incomplete = true;
+			return NULL;
+		}
+		if(!accept(ps, "do"))
+			return syntax_error(ps);
+		if(!(n->body = parse_list(ps, done)))
+			return NULL;
+		accept(ps, "done");
+		return n;
+	}
+
+	/* { body; } */
+	node_t *parse_group(parser_t *ps) {
+		static const char *const close[] = { "}", NULL };
+		node_t *n = new_node(ps, NODE_GROUP);
+
+		ps->pos++;
+		if(!n || !(n->body = parse_list(ps, close)))
+			return NULL;
+		accept(ps, "}");
+		return n;
+	}
+
+	/* name() body, where body is a compound command */
+	node_t *parse_function(parser_t *ps, size_t len) {
+		node_t *n = new_node(ps, NODE_FUNC);
+
+		if(!n)
+			return NULL;
+		if(!(n->name = arena_strndup(ps->arena, ps->line + ps->pos, len))) {
+			fprintf(stderr, "malloc: no space\n");
+			return NULL;
+		}
+		n->job = ps->owner;
+		ps->pos += len + function_parens(ps->line + ps->pos + len, ps->len - ps->pos - len);
+		skip_blanks(ps, false);
+		while(ps->pos < ps->len && ps->line[ps->pos] == '\n') {
+			ps->pos++;
+			skip_blanks(ps, false);
+		}
+		if(ps->pos >= ps->len) {
+			ps->incomplete = true;
+			return NULL;
+		}
+		if(!starts_compound(ps->line + ps->pos, ps->len - ps->pos)) {
+			fprintf(stderr, "dsh: %s: the body of a function must be a compound command\n", n->name);
+			return NULL;
+		}
+		return (n->body = parse_command(ps)) ? n : NULL;
+	}
+
+	/* One pipeline or compound command */
+	node_t *parse_command(parser_t *ps) {
+		char *s;
+		size_t len, end;
+		node_t *n;
+
+		skip_blanks(ps, false);
+		if(ps->pos >= ps->len) {
+			ps->incomplete = true;
+			return NULL;
+		}
+		s = ps->line + ps->pos;
+		len = word_length(s, ps->len - ps->pos);
+		if(at_word(ps, (const char *[]){ "if", NULL }))
+			return parse_if(ps);
+		if(at_word(ps, (const char *[]){ "while", NULL }))
+			return parse_while(ps, NODE_WHILE);
+		if(at_word(ps, (const char *[]){ "until", NULL }))
+			return parse_while(ps, NODE_UNTIL);
+		if(at_word(ps, (const char *[]){ "for", NULL }))
+			return parse_for(ps);
+		if(at_word(ps, (const char *[]){ "{", NULL }))
+			return parse_group(ps);
+		if(at_word(ps, reserved_words))
+			return syntax_error(ps);
+		if(len && name_length(s) == len && function_parens(s + len, ps->len - ps->pos - len))
+			return parse_function(ps, len);
+
+		end = pipeline_end(ps->line, ps->pos, ps->len);
+		if(end == ps->pos)
+			return syntax_error(ps);
+		if(!(n = new_node(ps, NODE_JOB)) || !(n->job = parse_template(ps, ps->pos, end)))
+			return NULL;
+		ps->pos = end;
+		return n;
+	}
+
+	/* Pipelines and compound commands joined by && and || */
+	node_t *parse_and_or(parser_t *ps) {
+		node_t *left = parse_command(ps), *n;
+		char *s;
+
+		while(left) {
+			skip_blanks(ps, false);
+			s = ps->line + ps->pos;
+			if(ps->pos + 1 >= ps->len || !((s[0] == '&' && s[1] == '&') || (s[0] == '|' && s[1] == '|')))
+				return left;
+			if(!(n = new_node(ps, s[0] == '&' ? NODE_AND : NODE_OR)))
+				return NULL;
+			ps->pos += 2;
+			do /* the next command can be on the next line */
+				skip_blanks(ps, false);
+			while(ps->pos < ps->len && ps->line[ps->pos] == '\n' && ++ps->pos);
+			n->cond = left;
+			if(!(n->body = parse_command(ps)))
+				return NULL;
+			left = n;
+		}
+		return NULL;
+	}
+
+	/* Parse the compound command at line[*pos] (with the ones joined to it
+	 * by && and ||) into a job of its own, appended to the job list. *pos
+	 * is left at the separator after it. False on an error, or with
+	 * parse_incomplete set if the text ends inside it. */
+	bool readcompound(char *line, size_t *pos, size_t len) {
+		arena_t *arena = arena_new();
+		parser_t ps = { line, *pos, len, arena };
+		node_t *body = NULL;
+		job_t *j = NULL, *t;
+		size_t end;
+
+		if(!arena || !(j = (job_t *)arena_alloc(arena, sizeof(job_t))) || !init_job(j, arena)) {
+			fprintf(stderr, "malloc: no space\n");
+			arena_release(arena);
+			return false;
+		}
+		ps.owner = j;
+		if((body = parse_and_or(&ps))) {
+			skip_blanks(&ps, false);
+			if(ps.pos < len && line[ps.pos] != ';' && line[ps.pos] != '\n')
+				body = syntax_error(&ps);
+		}
+		if(!body) {
+			if((parse_incomplete = ps.incomplete))
+				note_heredocs(ps.templates);
+			for(t = ps.templates; t; t = t->next)
+				close_heredocs(t);
+			arena_release(arena);
+			return false;
+		}
+		for(end = ps.pos; end > *pos && isspace(line[end - 1]); end--)
+			;
+		if(!(j->commandinfo = arena_strndup(arena, line + *pos, end - *pos))) {
+			fprintf(stderr, "malloc: no space\n");
+			free_node(body);
+			arena_release(arena);
+			return false;
+		}
+		j->body = body;
+		link_job(j);
+		log_event("parse", "compound cmd=\"%s\"", j->commandinfo);
+		*pos = ps.pos;
+		return true;
+	}
+
+	/* Basic parser that fills the data structures job_t and process_t defined in
+	 * dsh.h from one command line of len bytes. The line is split into jobs
+	 * at ;, & (which also marks the job as background) and newlines and
+	 * ends at a comment; each job is then handed to readjob(), and each
+	 * compound command, with the jobs joined to it by && and ||, to
+	 * readcompound(). Subshells and case are not supported. Returns false
+	 * if the line produced no job, with parse_incomplete set if it ended
+	 * inside a compound command.
+	 *
+	 * The parser supports these symbols: <, >, >>, n< n> n>> (n a descriptor
+	 * number), n>&m, << and <<< (see read_heredocs()), |, &&, ||, &, ;, #,
+	 * quoting with '...', "..." and \, and the reserved words of
+	 * readcompound()
+	 */
+	bool parse_cmdline(char *line, size_t len) {
+
+		size_t pos = 0, end;
+		bool parsed = false;
+
+		parse_incomplete = false;
+		while(1) {
+			while(pos < len && isspace(line[pos])){++pos;} /* ignore any spaces */
+			/* cmdline is NOOP or a comment */
+			if(pos >= len || line[pos] == '#')
+				return parsed;
+
+			/* Check for invalid special symbols (characters) */
+			if(line[pos] == ';' || line[pos] == '&' || is_meta(line[pos]))
+				return parsed;
+
+			end = pipeline_end(line, pos, len);
+			if(starts_compound(line + pos, len - pos)
+			   || (end + 1 < len && line[end] == line[end + 1] && (line[end] == '&' || line[end] == '|'))) {
+				if(!readcompound(line, &pos, len))
+					return parse_incomplete ? false : parsed;
+				parsed = true;
+				end = pos;
+			}
+			else if(readjob(line + pos, end - pos, end < len && line[end] == '&'))
+				parsed = true;
+			if(end >= len || line[end] == '#')
+				return parsed;
+			pos = end + 1;
+		}
+	}
+
+	/* Buffered line reader. Input is read in INPUT_CHUNK blocks and lines
+	 * are handed out as pointers into the buffer, which grows to hold a line
+	 * of any length. A line stays valid until the next read_line() call. */
+	enum { INPUT_CHUNK = 64 * 1024 };
+
+	/* True if a whole line is already buffered */
+	bool input_has_line(input_t *in) {
+		return (in->eof && in->start < in->end)
+			|| memchr(in->buf + in->start, '\n', in->end - in->start) != NULL;
+	}
+
+	/* True once the input is exhausted */
+	bool input_done(input_t *in) {
+		return in->eof && in->start == in->end;
+	}
+
+	/* Store the next line, '\n' included, in *line and return its length;
+	 * -1 at end of input */
+	ssize_t read_line(input_t *in, char **line) {
+		char *nl;
+		ssize_t len, n;
+
+		while(1) {
+			if(in->start < in->end
+			   && (nl = memchr(in->buf + in->start, '\n', in->end - in->start))) {
+				*line = in->buf + in->start;
+				len = nl + 1 - *line;
+				in->start += len;
+				return len;
+			}
+			if(in->eof) { /* last line without a newline */
+				if(in->start == in->end)
+					return -1;
+				*line = in->buf + in->start;
+				len = in->end - in->start;
+				in->start = in->end;
+				return len;
+			}
+
+			/* keep the partial line and make room for another block */
+			if(in->start > 0) {
+				memmove(in->buf, in->buf + in->start, in->end - in->start);
+				in->end -= in->start;
+				in->start = 0;
+			}
+			if(in->cap - in->end < INPUT_CHUNK) {
+				size_t cap = in->cap ? in->cap * 2 : INPUT_CHUNK;
+				char *buf = (char *)realloc(in->buf, cap);
+				if(!buf) {
+					fprintf(stderr, "read_line: no space\n");
+					in->eof = true;
+					continue;
+				}
+				in->buf = buf;
+				in->cap = cap;
+			}
+
+			n = read(in->fd, in->buf + in->end, in->cap - in->end);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n < 0)
+				perror("read");
+			if(n <= 0)
+				in->eof = true;
+			else
+				in->end += n;
+		}
+	}
+
+	/* Prompt with msg (when interactive) and read one line into *line;
+	 * returns its length, or -1 at end of input */
+	ssize_t next_line(char *msg, char **line) {
+		if(edit_enabled)
+			return edit_line(msg, line);
+		if(shell_is_interactive) {
+			fprintf(stdout, "%s", msg);
+			fflush(stdout);
+			if(!input_has_line(&shell_input))
+				wait_for_input(msg);
+		}
+		return read_line(&shell_input, line);
+	}
+
+	/* Bodies of here-documents read ahead, while the lines of a compound
+	 * command were joined; see readcmdline() */
+	input_t heredoc_stash = { -1, .eof = true };
+
+	void stash_line(const char *line, size_t len) {
+		input_t *s = &heredoc_stash;
+		if(s->start == s->end)
+			s->start = s->end = 0;
+		if(s->end + len > s->cap) {
+			size_t cap = s->cap ? s->cap : INPUT_CHUNK;
+			while(cap < s->end + len)
+				cap *= 2;
+			char *buf = (char *)realloc(s->buf, cap);
+			if(!buf) {
+				fprintf(stderr, "here-document: no space\n");
+				return;
+			}
+			s->buf = buf;
+			s->cap = cap;
+		}
+		memcpy(s->buf + s->end, line, len);
+		s->end += len;
+	}
+
+	/* The next line of a here-document body */
+	ssize_t heredoc_line(char **line) {
+		if(heredoc_stash.start < heredoc_stash.end)
+			return read_line(&heredoc_stash, line);
+		return next_line("> ", line);
+	}
+
+	/* Read the body of the << here-document r from the lines after the
+	 * command line. Each line goes into the memfd as it is read, through
+	 * a buffer of fixed size, so a body of any length is never held
+	 * whole. */
+	void read_heredoc(redir_t *r) {
+		static char buf[INPUT_CHUNK];
+		char *line;
+		ssize_t len;
+		size_t n = 0, dlen = strlen(r->delim);
+
+		while(1) {
+			if((len = heredoc_line(&line)) < 0) {
+				fprintf(stderr, "dsh: here-document ended by end of input (wanted \"%s\")\n",
+					r->delim);
+				break;
+			}
+			if(len - (line[len - 1] == '\n') == dlen && memcmp(line, r->delim, dlen) == 0)
+				break;
+			if(n + len > sizeof(buf)) {
+				write_all(r->from, buf, n);
+				n = 0;
+			}
+			if(len > sizeof(buf))
+				write_all(r->from, line, len);
+			else {
+				memcpy(buf + n, line, len);
+				n += len;
+			}
+		}
+		write_all(r->from, buf, n);
+		heredoc_seal(r);
+	}
+
+	void read_job_heredocs(job_t *j) {
+		process_t *p;
+		redir_t *r;
+		for(p = j->first_process; p; p = p->next)
+			for(r = p->redirs; r; r = r->next)
+				if(r->kind == REDIR_HEREDOC && r->delim)
+					read_heredoc(r);
+	}
+
+	/* The pipelines of a compound command, in the order they were written */
+	void read_node_heredocs(node_t *n) {
+		for(; n; n = n->next) {
+			if(n->kind == NODE_JOB)
+				read_job_heredocs(n->job);
+			read_node_heredocs(n->cond);
+			read_node_heredocs(n->body);
+			read_node_heredocs(n->orelse);
+		}
+	}
+
+	/* Read the bodies of the << here-documents of the jobs from j on, in
+	 * order */
+	void read_heredocs(job_t *j) {
+		for(; j; j = j->next)
+			if(j->body)
+				read_node_heredocs(j->body);
+			else
+				read_job_heredocs(j);
+	}
+
+	/* Lines of a compound command read so far; see readcmdline() */
+	char *cmd_text;
+	size_t cmd_text_len, cmd_text_cap;
+
+	bool cmd_text_append(const char *s, size_t len) {
+		if(cmd_text_len + len > cmd_text_cap) {
+			size_t cap = cmd_text_cap ? cmd_text_cap : 256;
+			while(cap < cmd_text_len + len)
+				cap *= 2;
+			char *text = (char *)realloc(cmd_text, cap);
+			if(!text) {
+				fprintf(stderr, "readcmdline: no space\n");
+				return false;
+			}
+			cmd_text = text;
+			cmd_text_cap = cap;
+		}
+		memcpy(cmd_text + cmd_text_len, s, len);
+		cmd_text_len += len;
+		return true;
+	}
+
+	/* Prompt (when interactive), read one line and parse it, and then the
+	 * bodies of its here-documents. A line that ends inside a compound
+	 * command is joined with the next ones until the command is complete,
+	 * and parsed again. Returns false if there is nothing to run;
+	 * input_done() tells end of input apart. */
+	bool readcmdline(char *msg) {
+
+		char *line;
+		ssize_t len;
+		job_t *before;
+
+		/* about to block; let the log catch up */
+		log_flush();
+
+		len = next_line(msg, &line);
+		if(len < 0) {
+			shell_input.eof = true; /* for input_done() */
+			return false;
+		}
+		if(shell_is_interactive) {
+			size_t n = len;
+			char *expanded = hist_expand(line, &n);
+			if(!expanded)
+				return false;
+			if(expanded != line) /* show what runs */
+				fprintf(stdout, "%.*s", (int)n, line = expanded);
+			hist_add(line, len = n);
+		}
+		before = last_job; /* the line's jobs go after it */
+		cmd_text_len = 0;
+		heredoc_stash.start = heredoc_stash.end;
+		int bodies = 0; /* here-documents whose body is stashed */
+		while(!parse_cmdline(line, len)) {
+			if(!parse_incomplete)
+				return false;
+			while(last_job != before)
+				delete_job(last_job);
+			/* line points into the input buffer, which the next read reuses */
+			if(line != cmd_text && !cmd_text_append(line, len))
+				return false;
+			/* the bodies of the here-documents on the line come next */
+			for(; bodies < nopen_heredocs; bodies++) {
+				size_t dlen = strlen(open_heredocs[bodies]);
+				while((len = next_line("> ", &line)) >= 0) {
+					stash_line(line, len);
+					if(len - (line[len - 1] == '\n') == dlen
+					   && memcmp(line, open_heredocs[bodies], dlen) == 0)
+						break;
+				}
+			}
+			while(nopen_heredocs > 0)
+				free(open_heredocs[--nopen_heredocs]);
+			if((len = next_line("> ", &line)) < 0) {
+				fprintf(stderr, "dsh: unexpected end of input in compound command\n");
+				last_status = 2;
+				shell_input.eof = true;
+				return false;
+			}
+			if(shell_is_interactive)
+				hist_add(line, len);
+			if(!cmd_text_append(line, len))
+				return false;
+			line = cmd_text;
+			len = cmd_text_len;
+		}
+		read_heredocs(before ? before->next : first_job);
+		return true;
+	}
+
+	/* Build prompt messaage; Change this to include process ID (pid)*/
+	char* promptmsg() {
+		pid_t pid;	
+
+		pid = getpid();
+		sprintf(prompt_pid, "dsh_%d$ ", pid); 	
+		return  prompt_pid;
+	}
+
+	/* Take job off the job list and every index without freeing it */
+	void unlink_job(job_t *job) {
+		process_t *p;
+
+		if(job->prev)
+			job->prev->next = job->next;
+		else
+			first_job = job->next;
+		if(job->next)
+			job->next->prev = job->prev;
+		else
+			last_job = job->prev;
+
+		/* a job may be queued for notification when it is deleted */
+		if(job->changed) {
+			job_t **jp;
+			for(jp = &changed_jobs; *jp; jp = &(*jp)->changed_next)
+				if(*jp == job) {
+					*jp = job->changed_next;
+					break;
+				}
+		}
+
+		/* its output stays readable after the job is gone */
+		if(job->capture) {
+			capture_drain(job->capture);
+			job->capture->job = NULL;
+			job->capture->pgid = job->pgid;
+		}
+
+		for(p = job->first_process; p; p = p->next)
+			unindex_process(p);
+		unindex_job(job);
+		unregister_job(job);
+	}
+
+	int delete_job(job_t* job){
+		if(job != NULL){
+			unlink_job(job);
+			free_job(job);
+			return 0;
+		}
+
+		return -1;
+	}
+//=============================
+
+
+
+
+
+
+//=============================
+	/* Wait on the process group of j until every process in it has either
+	 * completed or stopped. This is the only place a foreground job blocks. */
+	void finishFGJob (job_t *j)
+     {
+	/* without job control the job has no process group of its own */
+	while (wait_for_child (shell_is_interactive ? -j->pgid : WAIT_ANY, WUNTRACED)
+	       && !job_is_stopped (j)
+	       && !job_is_completed (j))
+		;
+     }
+
+//=============================
+/* Builtin commands. Every builtin has the same signature: it gets the job
+ * and process it was invoked from and the descriptors standing for its
+ * stdin and stdout after the job's redirections, and returns an exit
+ * status. builtins[] is kept sorted by name for find_builtin().
+ */
+
+/* The exit status of p: its exit code, or 128+signal */
+int process_exit_status(process_t *p) {
+	if(p->status == -1)
+		return 0;
+	if(WIFEXITED(p->status))
+		return WEXITSTATUS(p->status);
+	if(WIFSIGNALED(p->status))
+		return 128 + WTERMSIG(p->status);
+	if(WIFSTOPPED(p->status))
+		return 128 + WSTOPSIG(p->status);
+	return 0;
+}
+
+/* A job's status is that of its last process */
+int job_exit_status(job_t *j) {
+	process_t *p = find_last_process(j);
+	return p ? process_exit_status(p) : 0;
+}
+
+/* One row of usage figures, as printed by time and jobs -l */
+void print_usage_row(int out, double real, struct rusage *ru, char *what) {
+	dprintf(out, "%8.3f %8.3f %8.3f %8ld %6ld/%-6ld %s\n", real,
+		tv_seconds(&ru->ru_utime), tv_seconds(&ru->ru_stime),
+		ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, what);
+}
+
+/* The report of the time prefix: a row per stage of a pipeline, so a slow
+ * stage stands out, then the whole job */
+void print_job_times(job_t *j, int out) {
+	process_t *p;
+	dprintf(out, "%8s %8s %8s %8s %13s %s\n", "real", "user", "sys",
+		"maxrss", "vcsw/ivcsw", "command");
+	if(j->first_process->next)
+		for(p = j->first_process; p; p = p->next)
+			print_usage_row(out, elapsed_since(&p->start, &p->end), &p->rusage, p->argv[0]);
+	print_usage_row(out, elapsed_since(&j->start, &j->end), &j->rusage, j->commandinfo);
+}
+
+/* write(2) all of buf */
+int write_all(int fd, const char *buf, size_t len) {
+	ssize_t n;
+	while(len > 0) {
+		if((n = write(fd, buf, len)) < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Small output buffer so a builtin's output goes out in one write(2) */
+typedef struct {
+	char *buf;
+	size_t len, cap;
+} outbuf_t;
+
+void out_append(outbuf_t *o, const char *str, size_t len) {
+	if(o->len + len > o->cap) {
+		size_t cap = o->cap ? o->cap : 256;
+		while(cap < o->len + len)
+			cap *= 2;
+		char *buf = (char *)realloc(o->buf, cap);
+		if(!buf)
+			return;
+		o->buf = buf;
+		o->cap = cap;
+	}
+	memcpy(o->buf + o->len, str, len);
+	o->len += len;
+}
+
+int out_flush(outbuf_t *o, int out) {
+	int rc = write_all(out, o->buf, o->len);
+	free(o->buf);
+	return rc;
+}
+
+/* Result cache. "cache [-i file]... command ... > out" memoizes a job
+ * whose stdout goes to a file. Before it runs, the job is keyed on the
+ * working directory, each process's argv, executable, redirections and
+ * environment, and the identity (device, inode, size, mtime, ctime) of
+ * every file it reads with < or names with -i; here-documents count by
+ * content, and where output goes does not count. A stdin the first process
+ * inherits counts by identity and offset if it is a file or /dev/null, not
+ * at all if it is a terminal, and a pipe makes the job uncacheable. An
+ * entry is a pair of files in the cache directory (DSH_CACHE, default
+ * $HOME/.cache/dsh) named by the key's hash: hash.key holds the key
+ * itself, compared in full on a lookup, and hash.out the output. On a
+ * hit the output is cloned (FICLONE) or copied (copy_file_range) into out
+ * and nothing runs; a job that exits 0 everywhere is stored the same way
+ * when it is reaped. stderr is not kept. Entries are touched on every hit,
+ * and once the directory holds more than DSH_CACHE_MAX (default 256M) the
+ * least recently used ones are removed. */
+char cache_dir[PATH_MAX / 2];	/* empty until cache_open() */
+off_t cache_max = 256 << 20;
+
+struct {
+	unsigned long hits, misses, stores, evictions, uncacheable;
+	unsigned long long replayed, stored;	/* bytes */
+} cache_stats;
+
+/* Find or make the cache directory; false if there is none */
+bool cache_open() {
+	char *dir = getenv("DSH_CACHE"), *home, *max;
+
+	if(cache_dir[0])
+		return true;
+	if(dir && *dir)
+		snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+	else if((home = getenv("HOME"))) {
+		snprintf(cache_dir, sizeof(cache_dir), "%s/.cache", home);
+		mkdir(cache_dir, 0755);
+		snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/dsh", home);
+	}
+	else {
+		fprintf(stderr, "cache: set DSH_CACHE or HOME\n");
+		return false;
+	}
+	if(mkdir(cache_dir, 0700) < 0 && errno != EEXIST) {
+		perror(cache_dir);
+		cache_dir[0] = '\0';
+		return false;
+	}
+	if((max = getenv("DSH_CACHE_MAX")) && (cache_max = parse_size(max)) <= 0) {
+		fprintf(stderr, "DSH_CACHE_MAX: %s: invalid size\n", max);
+		cache_max = 256 << 20;
+	}
+	return true;
+}
+
+/* Add the identity of file to the key: changes whenever it is written */
+void cache_key_file(outbuf_t *o, const char *file) {
+	struct stat st;
+	char id[160];
+	int n;
+	if(stat(file, &st) < 0)
+		n = snprintf(id, sizeof(id), "%s missing", file);
+	else
+		n = snprintf(id, sizeof(id), "%s %lu %lu %lld %ld.%09ld %ld.%09ld", file,
+			(unsigned long)st.st_dev, (unsigned long)st.st_ino, (long long)st.st_size,
+			(long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+			(long)st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+	out_append(o, id, n + 1);
+}
+
+/* Add the stdin p inherits to the key, unless a < or here-document
+ * replaces it or it is a terminal; false if it is a pipe or the like */
+bool cache_key_stdin(outbuf_t *o, process_t *p) {
+	struct stat st, null;
+	redir_t *r;
+	char id[96];
+	int fd = STDIN_FILENO, n;
+
+	for(r = p->redirs; r; r = r->next)
+		if(r->fd == STDIN_FILENO)
+			fd = r->kind == REDIR_DUP ? r->from : -1;
+	if(fd < 0)
+		return true;
+	if(fstat(fd, &st) < 0)
+		n = snprintf(id, sizeof(id), "stdin closed");
+	else if(S_ISREG(st.st_mode))
+		n = snprintf(id, sizeof(id), "stdin %lu %lu %lld %ld.%09ld %lld",
+			(unsigned long)st.st_dev, (unsigned long)st.st_ino, (long long)st.st_size,
+			(long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long)lseek(fd, 0, SEEK_CUR));
+	else if(S_ISCHR(st.st_mode) && stat("/dev/null", &null) == 0 && st.st_rdev == null.st_rdev)
+		n = snprintf(id, sizeof(id), "stdin null");
+	else if(isatty(fd)) /* typed input is the user's to keep apart */
+		return true;
+	else
+		return false;
+	out_append(o, id, n + 1);
+	return true;
+}
+
+/* Key j and work out where its output goes; false (after saying why) if
+ * it cannot be cached */
+bool cache_key(job_t *j) {
+	cache_req_t *c = j->cache;
+	outbuf_t o = { NULL, 0, 0 };
+	process_t *p, *last = find_last_process(j);
+	redir_t *r, *out = NULL;
+	char cwd[PATH_MAX], buf[4096], **e, *path;
+	uint64_t h = 14695981039346656037ull; /* FNV-1a */
+	ssize_t n;
+	size_t i;
+	int k;
+
+	for(r = last->redirs; r; r = r->next)
+		if(r->fd == STDOUT_FILENO)
+			out = r;
+	if(!out || out->kind != REDIR_OUT) {
+		fprintf(stderr, "cache: output must be redirected with > file; not cached\n");
+		return false;
+	}
+	if(!cache_key_stdin(&o, j->first_process)) {
+		fprintf(stderr, "cache: stdin is a pipe; redirect it with <; not cached\n");
+		free(o.buf);
+		return false;
+	}
+	if(!cache_open() || !getcwd(cwd, sizeof(cwd))) {
+		free(o.buf);
+		return false;
+	}
+	if(out->file[0] == '/')
+		c->out = out->file;
+	else if((c->out = (char *)arena_alloc(j->arena, strlen(cwd) + strlen(out->file) + 2)))
+		sprintf(c->out, "%s/%s", cwd, out->file);
+	else {
+		free(o.buf);
+		return false;
+	}
+
+	out_append(&o, cwd, strlen(cwd) + 1);
+	for(p = j->first_process; p; p = p->next) {
+		out_append(&o, "\n", 1);
+		for(k = 0; k < p->argc; k++)
+			out_append(&o, p->argv[k], strlen(p->argv[k]) + 1);
+		if(!find_builtin(p->argv[0]) && (path = resolve_command(p->argv[0])))
+			cache_key_file(&o, path);
+		for(r = p->redirs; r; r = r->next) {
+			n = snprintf(buf, sizeof(buf), "%d %d %d", r->kind, r->fd,
+				r->kind == REDIR_DUP ? r->from : 0);
+			out_append(&o, buf, n + 1);
+			if(r->kind == REDIR_IN)
+				cache_key_file(&o, r->file);
+			else if(r->kind == REDIR_HEREDOC) {
+				off_t off = 0;
+				while((n = pread(r->from, buf, sizeof(buf), off)) > 0) {
+					out_append(&o, buf, n);
+					off += n;
+				}
+			}
+		}
+		for(e = process_envp(j, p); *e; e++)
+			out_append(&o, *e, strlen(*e) + 1);
+	}
+	for(k = 0; k < c->ninputs; k++)
+		cache_key_file(&o, c->inputs[k]);
+
+	if(!o.buf || !(c->key = (char *)arena_alloc(j->arena, o.len))) {
+		free(o.buf);
+		return false;
+	}
+	memcpy(c->key, o.buf, c->key_len = o.len);
+	free(o.buf);
+	for(i = 0; i < c->key_len; i++)
+		h = (h ^ (unsigned char)c->key[i]) * 1099511628211ull;
+	c->hash = h;
+	return true;
+}
+
+/* Path of j's entry with suffix (".key" or ".out") in buf */
+char *cache_path(char *buf, size_t size, cache_req_t *c, const char *suffix) {
+	snprintf(buf, size, "%s/%016llx%s", cache_dir, (unsigned long long)c->hash, suffix);
+	return buf;
+}
+
+/* Copy all of in to out from where each stands: a clone if the file
+ * system shares extents, else copy_file_range. Returns bytes, or -1. */
+off_t cache_copy(int in, int out) {
+	struct stat st;
+	off_t done = 0;
+	ssize_t n;
+
+	if(fstat(in, &st) < 0)
+		return -1;
+	if(ioctl(out, FICLONE, in) == 0)
+		return st.st_size;
+	while((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+		done += n;
+	return n < 0 ? -1 : done;
+}
+
+/* On a hit, write j's stored output to its output file, mark every
+ * process done with status 0 and return true */
+bool cache_replay(job_t *j) {
+	cache_req_t *c = j->cache;
+	char path[PATH_MAX], *key;
+	struct stat st;
+	process_t *p;
+	int fd, out;
+	off_t n;
+
+	if(!cache_key(j)) {
+		cache_stats.uncacheable++;
+		j->cache = NULL;
+		return false;
+	}
+	/* the key must match in full; the hash only names the file */
+	if((fd = open(cache_path(path, sizeof(path), c, ".key"), O_RDONLY | O_CLOEXEC)) < 0) {
+		cache_stats.misses++;
+		return false;
+	}
+	key = fstat(fd, &st) == 0 && (size_t)st.st_size == c->key_len
+		? mmap(NULL, c->key_len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	bool same = key != MAP_FAILED && memcmp(key, c->key, c->key_len) == 0;
+	if(key != MAP_FAILED)
+		munmap(key, c->key_len);
+	if(!same || (fd = open(cache_path(path, sizeof(path), c, ".out"), O_RDONLY | O_CLOEXEC)) < 0) {
+		cache_stats.misses++;
+		return false;
+	}
+	if((out = open(c->out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+		perror(c->out);
+		close(fd);
+		return false;
+	}
+	n = cache_copy(fd, out);
+	futimens(fd, NULL); /* recently used */
+	close(fd);
+	close(out);
+	if(n < 0) {
+		perror("cache");
+		cache_stats.misses++;
+		return false;
+	}
+
+	cache_stats.hits++;
+	cache_stats.replayed += n;
+	log_event("cache", "job=%d hit=%016llx bytes=%lld", j->id, (unsigned long long)c->hash, (long long)n);
+	clock_gettime(CLOCK_MONOTONIC, &j->start);
+	j->end = j->start;
+	for(p = j->first_process; p; p = p->next) {
+		p->completed = true;
+		p->status = W_EXITCODE(0, 0);
+		p->start = p->end = j->start;
+	}
+	return true;
+}
+
+/* Entries of the cache directory, for eviction */
+typedef struct {
+	struct timespec used;
+	off_t size;
+	char name[24];		/* the hash, without suffix */
+} cache_entry_t;
+
+int compare_cache_entry(const void *a, const void *b) {
+	const struct timespec *x = &((const cache_entry_t *)a)->used, *y = &((const cache_entry_t *)b)->used;
+	return x->tv_sec != y->tv_sec ? (x->tv_sec < y->tv_sec ? -1 : 1)
+		: (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/* List the entries (by their .out file) and their total size in *total;
+ * NULL if there are none or no memory */
+cache_entry_t *cache_list(size_t *count, off_t *total) {
+	cache_entry_t *list = NULL, *grown;
+	size_t n = 0, cap = 0, len;
+	struct dirent *e;
+	struct stat st;
+	char path[PATH_MAX];
+	DIR *dir;
+
+	*count = 0;
+	*total = 0;
+	if(!(dir = opendir(cache_dir)))
+		return NULL;
+	while((e = readdir(dir))) {
+		len = strlen(e->d_name);
+		if(len != 20 || strcmp(e->d_name + 16, ".out") != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cache_dir, e->d_name);
+		if(stat(path, &st) < 0)
+			continue;
+		if(n == cap) {
+			cap = cap ? 2 * cap : 64;
+			if(!(grown = (cache_entry_t *)realloc(list, cap * sizeof(cache_entry_t))))
+				break;
+			list = grown;
+		}
+		list[n].used = st.st_mtim;
+		list[n].size = st.st_size;
+		memcpy(list[n].name, e->d_name, 16);
+		list[n].name[16] = '\0';
+		*total += st.st_size;
+		n++;
+	}
+	closedir(dir);
+	*count = n;
+	return list;
+}
+
+/* Remove the least recently used entries until the cache fits cache_max */
+void cache_evict() {
+	cache_entry_t *list;
+	size_t n, i;
+	off_t total;
+	char path[PATH_MAX];
+
+	if(!(list = cache_list(&n, &total)) || total <= cache_max) {
+		free(list);
+		return;
+	}
+	qsort(list, n, sizeof(cache_entry_t), compare_cache_entry);
+	for(i = 0; i < n && total > cache_max; i++) {
+		snprintf(path, sizeof(path), "%s/%s.out", cache_dir, list[i].name);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/%s.key", cache_dir, list[i].name);
+		unlink(path);
+		total -= list[i].size;
+		cache_stats.evictions++;
+	}
+	free(list);
+}
+
+/* Store the output of j, which has just finished, if every process of it
+ * exited 0. The files are written under temporary names and renamed into
+ * place, .out first, so a concurrent lookup never sees a partial entry. */
+void cache_store(job_t *j) {
+	cache_req_t *c = j->cache;
+	char tmp[PATH_MAX], path[PATH_MAX];
+	process_t *p;
+	int in, fd;
+	off_t n;
+
+	for(p = j->first_process; p; p = p->next)
+		if(process_exit_status(p) != 0)
+			return;
+	if((in = open(c->out, O_RDONLY | O_CLOEXEC)) < 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", cache_dir);
+	if((fd = mkostemp(tmp, O_CLOEXEC)) < 0) {
+		close(in);
+		return;
+	}
+	n = cache_copy(in, fd);
+	close(in);
+	close(fd);
+	if(n < 0 || rename(tmp, cache_path(path, sizeof(path), c, ".out")) < 0) {
+		unlink(tmp);
+		return;
+	}
+	snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", cache_dir);
+	if((fd = mkostemp(tmp, O_CLOEXEC)) < 0)
+		return;
+	if(write_all(fd, c->key, c->key_len) < 0 || rename(tmp, cache_path(path, sizeof(path), c, ".key")) < 0)
+		unlink(tmp);
+	close(fd);
+
+	cache_stats.stores++;
+	cache_stats.stored += n;
+	log_event("cache", "job=%d store=%016llx bytes=%lld", j->id, (unsigned long long)c->hash, (long long)n);
+	cache_evict();
+}
+
+/* cache [-c]: show the statistics and size of the result cache, or clear
+ * it. As a prefix, "cache [-i file]... command ..."; see prefix_cache(). */
+int builtin_cache(job_t *j, process_t *p, int in, int out) {
+	cache_entry_t *list;
+	size_t n, i;
+	off_t total;
+	char path[PATH_MAX];
+
+	if(p->argc > 2 || (p->argc == 2 && strcmp(p->argv[1], "-c") != 0)) {
+		fprintf(stderr, "usage: cache [-c] | cache [-i file]... command ...\n");
+		return 2;
+	}
+	if(!cache_open())
+		return 1;
+	list = cache_list(&n, &total);
+	if(p->argc == 2) {
+		for(i = 0; i < n; i++) {
+			snprintf(path, sizeof(path), "%s/%s.out", cache_dir, list[i].name);
+			unlink(path);
+			snprintf(path, sizeof(path), "%s/%s.key", cache_dir, list[i].name);
+			unlink(path);
+		}
+		free(list);
+		return 0;
+	}
+	free(list);
+	unsigned long lookups = cache_stats.hits + cache_stats.misses;
+	dprintf(out, "%s: %zu entries, %lld of %lld bytes\n", cache_dir, n, (long long)total,
+		(long long)cache_max);
+	dprintf(out, "hits %lu misses %lu (%.1f%% hit) uncacheable %lu stores %lu evictions %lu\n",
+		cache_stats.hits, cache_stats.misses, lookups ? 100.0 * cache_stats.hits / lookups : 0.0,
+		cache_stats.uncacheable, cache_stats.stores, cache_stats.evictions);
+	dprintf(out, "bytes replayed %llu stored %llu\n", cache_stats.replayed, cache_stats.stored);
+	return 0;
+}
+
+/* Command history. Interactive command lines are appended to a history
+ * file shared by every dsh of the user (DSH_HISTORY, default
+ * $HOME/.dsh_history; empty turns history off), one line per entry, and
+ * file.idx holds the end offset of each entry after an 8-byte magic, so
+ * entry n is found without reading what comes before it. Both files are
+ * mmap'ed rather than read: opening costs the same for ten entries as for
+ * a million. An append takes an exclusive flock on the index, writes the
+ * line, then its offset, so another shell never sees an offset whose text
+ * is not there yet; every lookup first picks up the entries other shells
+ * added since (hist_sync()).
+ *
+ * Search goes through a trigram index built in memory on the first
+ * search and extended as entries arrive: the rarest trigram of the query
+ * gives the candidate entries, which are then checked with memmem(). */
+#define HIST_MAGIC "DSHHIDX1"
+#define HIST_GRAMS 65536
+#define HIST_MAP_MIN (1 << 20)
+
+int hist_fd = -1, hist_idx_fd = -1;
+bool hist_tried;		/* hist_open() already ran */
+char *hist_text;		/* mapping of the history file */
+size_t hist_text_mapped, hist_text_size;
+uint64_t *hist_ends;		/* mapping of the index; entries start at [1] */
+size_t hist_ends_mapped;
+int hist_count;			/* entries, numbered from 1 */
+
+hist_gram_t *hist_grams[HIST_GRAMS];
+int hist_indexed;		/* entries already in hist_grams */
+
+/* Map len bytes of fd at *map, keeping the old mapping while it is big
+ * enough; room is reserved past the end so appends rarely remap */
+bool hist_map(int fd, void **map, size_t *mapped, size_t len) {
+	void *m;
+	size_t size;
+
+	if(len <= *mapped)
+		return true;
+	for(size = HIST_MAP_MIN; size < 2 * len; size *= 2)
+		;
+	if((m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		return false;
+	if(*map)
+		munmap(*map, *mapped);
+	*map = m;
+	*mapped = size;
+	return true;
+}
+
+/* Pick up entries appended since the last call, by this shell or another */
+bool hist_sync() {
+	struct stat st, idx;
+
+	if(hist_fd < 0 || fstat(hist_fd, &st) < 0 || fstat(hist_idx_fd, &idx) < 0)
+		return false;
+	if(!hist_map(hist_fd, (void **)&hist_text, &hist_text_mapped, st.st_size)
+	   || !hist_map(hist_idx_fd, (void **)&hist_ends, &hist_ends_mapped, idx.st_size))
+		return false;
+	hist_text_size = st.st_size;
+	hist_count = idx.st_size < 8 ? 0 : idx.st_size / 8 - 1;
+	return true;
+}
+
+/* Write the index of the history file from scratch; the index is locked */
+void hist_rebuild() {
+	uint64_t ends[512];
+	size_t off;
+	int n = 0;
+
+	if(ftruncate(hist_idx_fd, 0) < 0 || write(hist_idx_fd, HIST_MAGIC, 8) != 8 || !hist_sync())
+		return;
+	for(off = 0; off < hist_text_size; off++)
+		if(hist_text[off] == '\n') {
+			ends[n++] = off + 1;
+			if(n == sizeof(ends) / sizeof(ends[0])) {
+				write_all(hist_idx_fd, (char *)ends, n * sizeof(uint64_t));
+				n = 0;
+			}
+		}
+	write_all(hist_idx_fd, (char *)ends, n * sizeof(uint64_t));
+}
+
+/* Open the history files once; false if there is no history */
+bool hist_open() {
+	char *name = getenv("DSH_HISTORY"), *home, path[PATH_MAX];
+	struct stat st;
+
+	if(hist_tried)
+		return hist_fd >= 0;
+	hist_tried = true;
+	if(!name) {
+		if(!(home = env_get("HOME")))
+			return false;
+		snprintf(path, sizeof(path), "%s/.dsh_history", home);
+		name = path;
+	}
+	if(!*name)
+		return false;
+	char idx[strlen(name) + 5];
+	sprintf(idx, "%s.idx", name);
+	if((hist_fd = open(name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0
+	   || (hist_idx_fd = open(idx, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0) {
+		perror(hist_fd < 0 ? name : idx);
+		if(hist_fd >= 0)
+			close(hist_fd);
+		hist_fd = -1;
+		return false;
+	}
+
+	/* a missing or foreign index is rebuilt from the lines */
+	flock(hist_idx_fd, LOCK_EX);
+	if(hist_sync() && fstat(hist_idx_fd, &st) == 0
+	   && (st.st_size < 8 || memcmp(hist_ends, HIST_MAGIC, 8) != 0))
+		hist_rebuild();
+	flock(hist_idx_fd, LOCK_UN);
+	return hist_sync();
+}
+
+/* Text of entry n (from 1), without its newline; NULL if there is none */
+char *hist_entry(int n, size_t *len) {
+	uint64_t start, end;
+
+	if(n < 1 || n > hist_count)
+		return NULL;
+	start = n > 1 ? hist_ends[n - 1] : 0;
+	end = hist_ends[n];
+	if(end > hist_text_size || start >= end) /* index ahead of a truncated file */
+		return NULL;
+	*len = end - start - 1;
+	return hist_text + start;
+}
+
+/* Append line (len bytes, newline or not) as a new entry, unless it is
+ * blank or repeats the last one */
+void hist_add(const char *line, size_t len) {
+	struct iovec iov[2] = { { (void *)line, len }, { "\n", 1 } };
+	size_t last_len;
+	char *last;
+	uint64_t end;
+
+	while(len > 0 && isspace(line[len - 1]))
+		len--;
+	iov[0].iov_len = len;
+	if(len == 0 || !hist_open())
+		return;
+	flock(hist_idx_fd, LOCK_EX);
+	if(hist_sync() && (!(last = hist_entry(hist_count, &last_len))
+			   || last_len != len || memcmp(last, line, len) != 0)
+	   && writev(hist_fd, iov, 2) == (ssize_t)len + 1
+	   && (end = lseek(hist_fd, 0, SEEK_CUR)) != (uint64_t)-1)
+		write_all(hist_idx_fd, (char *)&end, sizeof(end));
+	flock(hist_idx_fd, LOCK_UN);
+}
+
+uint32_t gram_at(const char *s) {
+	return (unsigned char)s[0] << 16 | (unsigned char)s[1] << 8 | (unsigned char)s[2];
+}
+
+hist_gram_t **hist_gram_slot(uint32_t gram) {
+	hist_gram_t **gp;
+	for(gp = &hist_grams[(gram * 2654435761u) >> 16]; *gp; gp = &(*gp)->next)
+		if((*gp)->gram == gram)
+			break;
+	return gp;
+}
+
+/* Add the entries not indexed yet to hist_grams; false when out of memory */
+bool hist_index() {
+	size_t len, i;
+	char *s;
+
+	for(; hist_indexed < hist_count; hist_indexed++) {
+		int n = hist_indexed + 1;
+		if(!(s = hist_entry(n, &len)))
+			continue;
+		for(i = 0; i + 3 <= len; i++) {
+			hist_gram_t **gp = hist_gram_slot(gram_at(s + i)), *g = *gp;
+			if(!g) {
+				if(!(g = (hist_gram_t *)calloc(1, sizeof(hist_gram_t))))
+					return false;
+				g->gram = gram_at(s + i);
+				*gp = g;
+			}
+			if(g->count && g->ids[g->count - 1] == (uint32_t)n)
+				continue; /* the trigram occurs twice in this entry */
+			if(g->count == g->size) {
+				uint32_t *ids = (uint32_t *)realloc(g->ids, (g->size ? 2 * g->size : 4) * sizeof(uint32_t));
+				if(!ids)
+					return false;
+				g->ids = ids;
+				g->size = g->size ? 2 * g->size : 4;
+			}
+			g->ids[g->count++] = n;
+		}
+	}
+	return true;
+}
+
+/* The newest entry before entry number before that contains the qlen
+ * bytes at query; 0 if none */
+int hist_search(const char *query, size_t qlen, int before) {
+	hist_gram_t *rarest = NULL, *g;
+	size_t len, i;
+	char *s;
+	int n;
+
+	if(!hist_open() || !hist_sync())
+		return 0;
+	if(before > hist_count + 1)
+		before = hist_count + 1;
+	if(qlen >= 3 && hist_index()) {
+		for(i = 0; i + 3 <= qlen; i++) {
+			if(!(g = *hist_gram_slot(gram_at(query + i))))
+				return 0; /* no entry has this trigram */
+			if(!rarest || g->count < rarest->count)
+				rarest = g;
+		}
+		/* candidates newest first, from the first one before before */
+		size_t lo = 0, hi = rarest->count;
+		while(lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if(rarest->ids[mid] < (uint32_t)before)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for(i = lo; i > 0; i--)
+			if((s = hist_entry(n = rarest->ids[i - 1], &len)) && memmem(s, len, query, qlen))
+				return n;
+		return 0;
+	}
+	for(n = before - 1; n > 0; n--)
+		if((s = hist_entry(n, &len)) && memmem(s, len, query, qlen))
+			return n;
+	return 0;
+}
+
+/* Expand history references in the len bytes of line: !! (the last
+ * entry), !n (entry n), !-n (the nth last) and !text (the last entry
+ * starting with text), except in '...' or after a backslash. Returns line
+ * itself when there is none, else the expanded line in a buffer that is
+ * reused on the next call; NULL if an entry does not exist. */
+char *hist_expand(char *line, size_t *len) {
+	static outbuf_t expanded;
+	char *s = line, *end = line + *len, *entry, *ref;
+	size_t elen;
+	bool quoted = false, changed = false;
+	int n;
+
+	if(!memchr(line, '!', *len) || !hist_open() || !hist_sync())
+		return line;
+	expanded.len = 0;
+	for(; s < end; s++) {
+		if(*s == '\'')
+			quoted = !quoted;
+		if(*s == '\\' && s + 1 < end) {
+			out_append(&expanded, s++, 2);
+			continue;
+		}
+		if(*s != '!' || quoted || s + 1 >= end || isspace(s[1]) || s[1] == '=' || s[1] == '(') {
+			out_append(&expanded, s, 1);
+			continue;
+		}
+		ref = ++s;
+		if(*s == '!') {
+			n = hist_count;
+			s++;
+		}
+		else if((*s >= '0' && *s <= '9') || (*s == '-' && s + 1 < end && s[1] >= '0' && s[1] <= '9')) {
+			n = strtol(s, &s, 10);
+			if(n < 0)
+				n += hist_count + 1;
+		}
+		else {
+			while(s < end && !isspace(*s) && !strchr(";&|<>'\"", *s))
+				s++;
+			for(n = hist_count; n > 0; n--)
+				if((entry = hist_entry(n, &elen)) && elen >= (size_t)(s - ref)
+				   && memcmp(entry, ref, s - ref) == 0)
+					break;
+		}
+		if(!(entry = hist_entry(n, &elen))) {
+			fprintf(stderr, "dsh: !%.*s: event not found\n", (int)(s - ref), ref);
+			return NULL;
+		}
+		out_append(&expanded, entry, elen);
+		changed = true;
+		s--;
+	}
+	if(!changed)
+		return line;
+	if(!expanded.buf) {
+		fprintf(stderr, "dsh: no space for history expansion\n");
+		return NULL;
+	}
+	*len = expanded.len;
+	return expanded.buf;
+}
+
+/* history [n]: the last n entries (all by default), numbered for !n;
+ * history -s text: the entries containing text, newest first */
+int builtin_history(job_t *j, process_t *p, int in, int out) {
+	outbuf_t o = { 0 };
+	char num[16], *s;
+	size_t len, qlen = 0;
+	int n, first = 1, rc = 0;
+	bool search = p->argc > 1 && strcmp(p->argv[1], "-s") == 0;
+
+	if(search && p->argc != 3) {
+		fprintf(stderr, "usage: history [n] | history -s text\n");
+		return 2;
+	}
+	if(!hist_open() || !hist_sync()) {
+		fprintf(stderr, "history: no history file\n");
+		return 1;
+	}
+	if(search)
+		qlen = strlen(p->argv[2]);
+	else if(p->argc > 1 && (first = hist_count - atoi(p->argv[1]) + 1) < 1)
+		first = 1;
+	for(n = search ? hist_search(p->argv[2], qlen, hist_count + 1) : first;
+	    n > 0 && n <= hist_count;
+	    n = search ? hist_search(p->argv[2], qlen, n) : n + 1) {
+		if(!(s = hist_entry(n, &len)))
+			continue;
+		out_append(&o, num, snprintf(num, sizeof(num), "%5d  ", n));
+		out_append(&o, s, len);
+		out_append(&o, "\n", 1);
+		if(o.len >= 65536) { /* a long history goes out in pieces */
+			if((rc = write_all(out, o.buf, o.len)) < 0)
+				break;
+			o.len = 0;
+		}
+	}
+	return out_flush(&o, out) < 0 || rc < 0 ? 1 : 0;
+}
+
+int builtin_true(job_t *j, process_t *p, int in, int out) {
+	return 0;
+}
+
+int builtin_false(job_t *j, process_t *p, int in, int out) {
+	return 1;
+}
+
+/* echo [-n] [args...] */
+int builtin_echo(job_t *j, process_t *p, int in, int out) {
+	outbuf_t o = { NULL, 0, 0 };
+	bool newline = true;
+	int i = 1;
+
+	if(p->argv[1] && strcmp(p->argv[1], "-n") == 0) {
+		newline = false;
+		i = 2;
+	}
+	for(; i < p->argc; i++) {
+		out_append(&o, p->argv[i], strlen(p->argv[i]));
+		if(i + 1 < p->argc)
+			out_append(&o, " ", 1);
+	}
+	if(newline)
+		out_append(&o, "\n", 1);
+	return out_flush(&o, out) < 0 ? 1 : 0;
+}
+
+/* Append the escape sequence at *s (just past the backslash) */
+void printf_escape(outbuf_t *o, char **s) {
+	char c;
+	switch(**s) {
+	   case 'n': c = '\n'; break;
+	   case 't': c = '\t'; break;
+	   case 'r': c = '\r'; break;
+	   case 'a': c = '\a'; break;
+	   case 'b': c = '\b'; break;
+	   case 'f': c = '\f'; break;
+	   case 'v': c = '\v'; break;
+	   case '\\': c = '\\'; break;
+	   case '\0': out_append(o, "\\", 1); return;
+	   default: out_append(o, "\\", 1); c = **s; break;
+	}
+	out_append(o, &c, 1);
+	++*s;
+}
+
+/* printf format [args...]; the format is reused until the arguments run
+ * out. Supports flags, width and precision with d i o u x X c s and %% */
+int builtin_printf(job_t *j, process_t *p, int in, int out) {
+	outbuf_t o = { NULL, 0, 0 };
+	int arg = 2, rc = 0;
+
+	if(p->argc < 2) {
+		fprintf(stderr, "printf: usage: printf format [arguments]\n");
+		return 2;
+	}
+	do {
+		char *f = p->argv[1];
+		while(*f) {
+			if(*f == '\\') {
+				++f;
+				printf_escape(&o, &f);
+				continue;
+			}
+			if(*f != '%') {
+				char *lit = f;
+				while(*f && *f != '%' && *f != '\\')
+					++f;
+				out_append(&o, lit, f - lit);
+				continue;
+			}
+			if(f[1] == '%') {
+				out_append(&o, "%", 1);
+				f += 2;
+				continue;
+			}
+
+			/* copy one conversion spec and hand it to snprintf */
+			char spec[32], buf[512];
+			char *start = f++;
+			f += strspn(f, "-+ #0");
+			f += strspn(f, "0123456789");
+			if(*f == '.') {
+				++f;
+				f += strspn(f, "0123456789");
+			}
+			if(!*f || !strchr("diouxXcs", *f) || f - start + 3 > (int)sizeof(spec)) {
+				fprintf(stderr, "printf: %s: invalid format\n", start);
+				free(o.buf);
+				return 1;
+			}
+			char conv = *f++;
+			char *a = arg < p->argc ? p->argv[arg++] : NULL;
+			int n = f - start - 1;
+			memcpy(spec, start, n);
+			if(conv == 's' || conv == 'c') {
+				spec[n] = conv;
+				spec[n + 1] = '\0';
+				if(conv == 's')
+					n = snprintf(buf, sizeof(buf), spec, a ? a : "");
+				else
+					n = snprintf(buf, sizeof(buf), spec, a ? a[0] : '\0');
+			}
+			else {
+				char *end;
+				long long v = a ? strtoll(a, &end, 0) : 0;
+				if(a && *end) {
+					fprintf(stderr, "printf: %s: invalid number\n", a);
+					rc = 1;
+				}
+				spec[n] = 'l';
+				spec[n + 1] = 'l';
+				spec[n + 2] = conv;
+				spec[n + 3] = '\0';
+				n = snprintf(buf, sizeof(buf), spec, v);
+			}
+			if(n > (int)sizeof(buf) - 1)
+				n = sizeof(buf) - 1;
+			if(n > 0)
+				out_append(&o, buf, n);
+		}
+	} while(arg > 2 && arg < p->argc);
+	if(out_flush(&o, out) < 0)
+		rc = 1;
+	return rc;
+}
+
+int builtin_pwd(job_t *j, process_t *p, int in, int out) {
+	char *cwd = getcwd(NULL, 0);
+	if(!cwd) {
+		perror("pwd");
+		return 1;
+	}
+	dprintf(out, "%s\n", cwd);
+	free(cwd);
+	return 0;
+}
+
+/* Unary test operators */
+bool test_unary(char *op, char *arg, bool *valid) {
+	struct stat st;
+	*valid = true;
+	if(strcmp(op, "-n") == 0) return arg[0] != '\0';
+	if(strcmp(op, "-z") == 0) return arg[0] == '\0';
+	if(strcmp(op, "-e") == 0) return stat(arg, &st) == 0;
+	if(strcmp(op, "-f") == 0) return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+	if(strcmp(op, "-d") == 0) return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+	if(strcmp(op, "-s") == 0) return stat(arg, &st) == 0 && st.st_size > 0;
+	if(strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0)
+		return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+	if(strcmp(op, "-r") == 0) return access(arg, R_OK) == 0;
+	if(strcmp(op, "-w") == 0) return access(arg, W_OK) == 0;
+	if(strcmp(op, "-x") == 0) return access(arg, X_OK) == 0;
+	*valid = false;
+	return false;
+}
+
+/* Binary test operators */
+bool test_binary(char *a, char *op, char *b, bool *valid) {
+	*valid = true;
+	if(strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+	if(strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+
+	long long x = atoll(a), y = atoll(b);
+	if(strcmp(op, "-eq") == 0) return x == y;
+	if(strcmp(op, "-ne") == 0) return x != y;
+	if(strcmp(op, "-lt") == 0) return x < y;
+	if(strcmp(op, "-le") == 0) return x <= y;
+	if(strcmp(op, "-gt") == 0) return x > y;
+	if(strcmp(op, "-ge") == 0) return x >= y;
+	*valid = false;
+	return false;
+}
+
+/* test expr / [ expr ]: the POSIX rules for up to four arguments */
+int builtin_test(job_t *j, process_t *p, int in, int out) {
+	char **argv = p->argv + 1;
+	int argc = p->argc - 1;
+	bool negate = false, valid = true, result;
+
+	if(strcmp(p->argv[0], "[") == 0) {
+		if(argc == 0 || strcmp(argv[argc - 1], "]") != 0) {
+			fprintf(stderr, "[: missing ]\n");
+			return 2;
+		}
+		--argc;
+	}
+	if(argc >= 2 && argc <= 4 && strcmp(argv[0], "!") == 0 && argc != 3) {
+		negate = true;
+		++argv;
+		--argc;
+	}
+
+	switch(argc) {
+	   case 0: result = false; break;
+	   case 1: result = argv[0][0] != '\0'; break;
+	   case 2: result = test_unary(argv[0], argv[1], &valid); break;
+	   case 3:
+		result = test_binary(argv[0], argv[1], argv[2], &valid);
+		if(!valid && strcmp(argv[0], "!") == 0) {
+			negate = true;
+			result = test_unary(argv[1], argv[2], &valid);
+		}
+		break;
+	   default: valid = false; result = false; break;
+	}
+	if(!valid) {
+		fprintf(stderr, "test: unsupported expression\n");
+		return 2;
+	}
+	return (result != negate) ? 0 : 1;
+}
+
+/* Signal number for a name (TERM, SIGTERM) or number; -1 if unknown */
+int signal_number(char *name) {
+	int sig;
+	if(name[0] >= '0' && name[0] <= '9')
+		return atoi(name);
+	if(strncmp(name, "SIG", 3) == 0)
+		name += 3;
+	for(sig = 1; sig < NSIG; sig++) {
+		const char *abbrev = sigabbrev_np(sig);
+		if(abbrev && strcmp(abbrev, name) == 0)
+			return sig;
+	}
+	return -1;
+}
+
+/* kill [-s sig | -sig] pid|%job ... */
+int builtin_kill(job_t *j, process_t *p, int in, int out) {
+	int sig = SIGTERM, i = 1, rc = 0;
+
+	if(p->argv[1] && strcmp(p->argv[1], "-s") == 0 && p->argv[2]) {
+		sig = signal_number(p->argv[2]);
+		i = 3;
+	}
+	else if(p->argv[1] && p->argv[1][0] == '-' && p->argv[1][1]) {
+		sig = signal_number(p->argv[1] + 1);
+		i = 2;
+	}
+	if(sig < 0) {
+		fprintf(stderr, "kill: unknown signal\n");
+		return 2;
+	}
+	if(i >= p->argc) {
+		fprintf(stderr, "kill: usage: kill [-s sig | -sig] pid | %%job ...\n");
+		return 2;
+	}
+	for(; i < p->argc; i++) {
+		if(p->argv[i][0] == '%') {
+			job_t *m = find_job_arg(p->argv[i]);
+			if(!m || m->pgid <= 0) {
+				fprintf(stderr, "kill: %s: no such job\n", p->argv[i]);
+				rc = 1;
+			}
+			else if(signal_job(m, sig) < 0) {
+				perror("kill");
+				rc = 1;
+			}
+			continue;
+		}
+		if(kill(atoi(p->argv[i]), sig) < 0) {
+			perror("kill");
+			rc = 1;
+		}
+	}
+	return rc;
+}
+
+/* True while some process of the job can still change state on its own */
+bool job_is_running(job_t *j) {
+	return j->pgid > 0 && !job_is_stopped(j);
+}
+
+/* wait [pid|%job ...]: wait for the given jobs, or for every background
+ * job, to finish. The status is that of the last job waited for. */
+int builtin_wait(job_t *j, process_t *p, int in, int out) {
+	int i, rc = 0;
+
+	if(p->argc == 1) {
+		job_t *m;
+		while(1) {
+			for(m = first_job; m; m = m->next)
+				if(m != j && job_is_running(m))
+					break;
+			if(!m)
+				return 0;
+			if(!wait_for_child(WAIT_ANY, WUNTRACED))
+				return 0;
+		}
+	}
+	for(i = 1; i < p->argc; i++) {
+		job_t *m;
+		if(p->argv[i][0] == '%')
+			m = find_job_arg(p->argv[i]);
+		else {
+			process_t *wp = find_process(atoi(p->argv[i]));
+			m = wp ? wp->job : NULL;
+		}
+		if(!m || m == j) {
+			fprintf(stderr, "wait: %s: no such job\n", p->argv[i]);
+			rc = 127;
+			continue;
+		}
+		while(job_is_running(m))
+			if(!wait_for_child(WAIT_ANY, WUNTRACED))
+				break;
+		rc = job_exit_status(m);
+		m->notified = true; /* reported by its status instead */
+	}
+	return rc;
+}
+
+/* jobs [-l]: list jobs; -l adds a row per process with its pid, state
+ * and, once it has been reaped, its resource usage */
+int builtin_jobs(job_t *j, process_t *p, int in, int out) {
+	job_t *j2;
+	bool long_format = p->argc > 1 && strcmp(p->argv[1], "-l") == 0;
+	struct timespec now;
+
+	if(p->argc > 1 && !long_format) {
+		fprintf(stderr, "jobs: usage: jobs [-l]\n");
+		return 2;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for(j2 = first_job; j2; j2 = j2->next) {
+		// skip this 'jobs' command and jobs that have not been spawned yet
+		if(j2 == j || j2->pgid < 0)
+			continue;
+		dprintf(out, "[%d]+ %d\t\t", j2->id, j2->pgid);
+		// If all processes are completed
+		if(job_is_completed(j2)){
+			dprintf(out, "Done");
+			dprintf(out, "\t\t %s\n", j2->commandinfo);
+			// reported here; do_job_notification() just deletes it
+			j2->notified = true;
+		}
+		// If all processes are completed or stopped (thus if there are jobs that are stopped & not completed
+		else if(job_is_stopped(j2)){
+			dprintf(out, "Stopped");
+			dprintf(out, "\t\t %s\n", j2->commandinfo);
+		}
+		else{
+			dprintf(out, "Running");
+			dprintf(out, "\t\t %s\n", j2->commandinfo);
+		}
+		if(!long_format)
+			continue;
+
+		if(j2->sched) {
+			char settings[256];
+			sched_describe(j2->sched, settings, sizeof(settings));
+			dprintf(out, "\tsched%s\n", settings);
+		}
+		process_t *p2;
+		for(p2 = j2->first_process; p2; p2 = p2->next) {
+			dprintf(out, "\t%d\t%-8s", p2->pid,
+				p2->completed ? "Done" : p2->stopped ? "Stopped" : "Running");
+			if(p2->completed)
+				print_usage_row(out, elapsed_since(&p2->start, &p2->end), &p2->rusage, p2->argv[0]);
+			else
+				dprintf(out, "%8.3f %8s %8s %8s %13s %s\n", elapsed_since(&p2->start, &now),
+					"-", "-", "-", "-", p2->argv[0]);
+		}
+	}
+	return 0;
+}
+
+/* sched options %job|pgid ...: change the scheduling of running jobs;
+ * sched %job|pgid ...: show it. Run as a prefix otherwise; see
+ * prefix_sched(). */
+int builtin_sched(job_t *j, process_t *p, int in, int out) {
+	sched_req_t req;
+	char settings[256];
+	int i = parse_sched(&req, p->argv, p->argc), rc = 0;
+	bool adjust = i > 1; /* options were given */
+	job_t *m;
+
+	if(i < 0)
+		return 2;
+	if(i == p->argc) {
+		fprintf(stderr, "sched: usage: sched [-c cpus] [-n nice] [-i class[:level]] [-p policy]"
+			" [-m policy[:nodes]] command ... | %%job|pgid ...\n");
+		return 2;
+	}
+	if(req.mempolicy >= 0) {
+		fprintf(stderr, "sched: -m: a running job's memory policy cannot be changed\n");
+		return 1;
+	}
+	for(; i < p->argc; i++) {
+		m = find_job_arg(p->argv[i]);
+		if(!m || m == j || m->pgid <= 0 || job_is_completed(m)) {
+			fprintf(stderr, "sched: %s: no such job\n", p->argv[i]);
+			rc = 1;
+			continue;
+		}
+		if(adjust && !sched_job(m, &req)) {
+			rc = 1;
+			continue;
+		}
+		if(m->sched)
+			sched_describe(m->sched, settings, sizeof(settings));
+		else
+			settings[0] = '\0';
+		if(adjust)
+			log_event("sched", "job=%d pgid=%d settings=\"%s\"", m->id, (int)m->pgid,
+				settings + (settings[0] == ' '));
+		else
+			dprintf(out, "[%d] %d\tsched%s\n", m->id, (int)m->pgid, settings);
+	}
+	return rc;
+}
+
+int builtin_fg(job_t *j, process_t *p, int in, int out) {
+	if(p->argv[1] == NULL){
+		fprintf(stderr, "Forgot pgid for fg (job)\n");
+		return 1;
+	}
+	/* fg %n takes a job id, fg n a pgid */
+	job_t *m = find_job_arg(p->argv[1]);
+	if(!m || m == j || m->pgid <= 0){
+		fprintf(stderr, "fg: %s: no such job\n", p->argv[1]);
+		return 1;
+	}
+
+	/* a captured job shows what it wrote meanwhile, then the rest as it
+	 * comes; its output still goes through the shell */
+	capture_t *c = m->capture;
+	if(c) {
+		capture_drain(c);
+		capture_write(c, STDOUT_FILENO, c->total > c->size ? c->total - c->size : 0);
+		c->attach_fd = STDOUT_FILENO;
+	}
+
+	m->bg = false;
+	if(shell_is_interactive)
+		tcsetpgrp (shell_terminal, m->pgid);
+	continue_job(m);
+	finishFGJob(m);
+	if(c)
+		c->attach_fd = -1;
+
+	if(shell_is_interactive) {
+		tcsetpgrp (shell_terminal, shell_pgid);
+		tcgetattr (shell_terminal, &m->tmodes);
+		tcsetattr (shell_terminal, TCSADRAIN, &shell_tmodes);
+	}
+	return job_exit_status(m);
+}
+
+/* capture [size | -t size]: show the capture settings, or set the ring
+ * size for the output of jobs started with & (0 turns capture off) or,
+ * with -t, the limit on the rings of all captures together */
+int builtin_capture(job_t *j, process_t *p, int in, int out) {
+	bool total = p->argc > 2 && strcmp(p->argv[1], "-t") == 0;
+	long size;
+
+	if(p->argc < 2) {
+		dprintf(out, "capture %zu per job, %zu of %zu in use\n", capture_size, capture_used,
+			capture_limit);
+		return 0;
+	}
+	if((size = parse_size(p->argv[1 + total])) < 0 || (total && size == 0)) {
+		fprintf(stderr, "capture: %s: invalid size\n", p->argv[1 + total]);
+		return 1;
+	}
+	if(total)
+		capture_limit = size;
+	else
+		capture_size = size;
+	return 0;
+}
+
+/* output [-n lines] [-f] [job]: without a job, list the captures; with
+ * one (%id or pgid), print the output kept for it, or its last lines with
+ * -n. -f then follows it until the job closes its output (at a terminal,
+ * until Enter is pressed) */
+int builtin_output(job_t *j, process_t *p, int in, int out) {
+	capture_t *c;
+	long lines = 0;
+	bool follow = false;
+	int i;
+
+	for(i = 1; i < p->argc && p->argv[i][0] == '-'; i++) {
+		if(strcmp(p->argv[i], "-f") == 0)
+			follow = true;
+		else if(strcmp(p->argv[i], "-n") == 0 && i + 1 < p->argc && (lines = atol(p->argv[++i])) > 0)
+			continue;
+		else {
+			fprintf(stderr, "usage: output [-n lines] [-f] [job]\n");
+			return 2;
+		}
+	}
+	if(i == p->argc) {
+		reap_children(); /* a job may have ended since the last prompt */
+		for(c = captures; c; c = c->next)
+			dprintf(out, "[%d] %s %llu bytes, last %zu kept\t%s\n", c->id,
+				!c->job || job_is_completed(c->job) ? "done"
+				: job_is_stopped(c->job) ? "stopped" : "running", (unsigned long long)c->total,
+				c->total < c->size ? (size_t)c->total : c->size, c->commandinfo);
+		return 0;
+	}
+	if(!(c = find_capture(p->argv[i]))) {
+		fprintf(stderr, "output: %s: no captured output\n", p->argv[i]);
+		return 1;
+	}
+
+	capture_drain(c);
+	capture_write(c, out, lines ? capture_tail(c, lines)
+		: c->total > c->size ? c->total - c->size : 0);
+	if(!follow || c->fd < 0)
+		return 0;
+
+	/* pass output on as it arrives, keeping children reaped */
+	struct pollfd fds[3] = { { capture_set, POLLIN, 0 }, { sigchld_fd, POLLIN, 0 },
+		{ shell_is_interactive ? shell_terminal : -1, POLLIN, 0 } };
+	char line[256];
+	c->attach_fd = out;
+	while(c->fd >= 0) {
+		if(poll(fds, 3, -1) < 0 && errno != EINTR)
+			break;
+		if(fds[0].revents)
+			capture_drain_ready();
+		if(fds[1].revents)
+			reap_children();
+		if(fds[2].revents) { /* detach, dropping the line */
+			if(read(shell_terminal, line, sizeof(line)) < 0)
+				perror("read");
+			break;
+		}
+	}
+	c->attach_fd = -1;
+	return 0;
+}
+
+int builtin_bg(job_t *j, process_t *p, int in, int out) {
+	if(p->argv[1] == NULL){
+		fprintf(stderr, "Forgot pgid for bg (job)\n");
+		return 1;
+	}
+	job_t *m = find_job_arg(p->argv[1]);
+	if(!m || m == j || m->pgid <= 0){
+		fprintf(stderr, "bg: %s: no such job\n", p->argv[1]);
+		return 1;
+	}
+	m->bg = true;
+	continue_job(m);
+	return 0;
+}
+
+/* cd [dir]; without dir, $HOME */
+int builtin_cd(job_t *j, process_t *p, int in, int out) {
+	char *dir = p->argv[1] ? p->argv[1] : env_get("HOME");
+	if(!dir || chdir(dir) < 0){
+		perror("chdir error");
+		return 1;
+	}
+	return 0;
+}
+
+int builtin_launcher(job_t *j, process_t *p, int in, int out) {
+	if(p->argv[1] == NULL)
+		dprintf(out, "%s\n", launch_backend == LAUNCH_SPAWN ? "spawn" : "fork");
+	else if(set_launcher(p->argv[1]) < 0) {
+		fprintf(stderr, "launcher: unknown backend %s (fork|spawn)\n", p->argv[1]);
+		return 1;
+	}
+	return 0;
+}
+
+int builtin_memstats(job_t *j, process_t *p, int in, int out) {
+	print_memstats(out);
+	dprintf(out, "glob directory cache: %lu reads, %lu hits\n", dir_stats.reads, dir_stats.hits);
+	return 0;
+}
+
+/* One job kept in flight by builtin_parallel() */
+typedef struct {
+	job_t *job;
+	unsigned long seq;          /* 1-based position in the input */
+	struct timespec start;
+} parallel_slot_t;
+
+/* Append text, single-quoted so the parser takes it as one literal word */
+void append_quoted(outbuf_t *o, const char *text, size_t len) {
+	size_t i;
+	out_append(o, "'", 1);
+	for(i = 0; i < len; i++) {
+		if(text[i] == '\'')
+			out_append(o, "'\\''", 4);
+		else
+			out_append(o, text + i, 1);
+	}
+	out_append(o, "'", 1);
+}
+
+/* parallel [-j n] [-a file] [command ...] [::: arg ...]
+ *
+ * Runs one job per input item with at most n (default: online CPUs) in
+ * flight, starting the next as soon as one is reaped, and reports each
+ * job's exit status and wall time. Items are the words after ::: or else
+ * the lines of file (or of stdin). Without a command each item is a whole
+ * command line; otherwise it is substituted, quoted, for every {} in the
+ * command's words (or appended when there is no {}), which are taken
+ * literally. Returns 1 if any job
+ * failed.
+ */
+int builtin_parallel(job_t *j, process_t *p, int in, int out) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	int i = 1, cmd_start, cmd_end, args = -1;
+	input_t src = { in };
+	char *file = NULL;
+	unsigned long seq = 0, failed = 0, done = 0;
+	struct timespec t0, now;
+
+	for(; i < p->argc && p->argv[i][0] == '-'; i++) {
+		if(strcmp(p->argv[i], "-j") == 0 && i + 1 < p->argc)
+			n = atol(p->argv[++i]);
+		else if(strcmp(p->argv[i], "-a") == 0 && i + 1 < p->argc)
+			file = p->argv[++i];
+		else {
+			fprintf(stderr, "parallel: usage: parallel [-j n] [-a file] [command ...] [::: arg ...]\n");
+			return 2;
+		}
+	}
+	if(n < 1)
+		n = 1;
+	cmd_start = i;
+	for(cmd_end = cmd_start; cmd_end < p->argc; cmd_end++)
+		if(strcmp(p->argv[cmd_end], ":::") == 0) {
+			args = cmd_end + 1;
+			break;
+		}
+	if(args < 0 && file && (src.fd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+		perror(file);
+		return 1;
+	}
+
+	long nslots = n;
+	parallel_slot_t *slots = (parallel_slot_t *)calloc(nslots, sizeof(parallel_slot_t));
+	if(!slots) {
+		fprintf(stderr, "parallel: no space\n");
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	int running = 0;
+	bool more = true;
+	while(more || running > 0) {
+		/* top up the slots */
+		while(more && running < n) {
+			char *item;
+			ssize_t len;
+			if(args >= 0) {
+				if(args >= p->argc) {
+					more = false;
+					break;
+				}
+				item = p->argv[args++];
+				len = strlen(item);
 			}
-			if(j->bg) fprintf(stdout, "Background job\n");	
-			else fprintf(stdout, "Foreground job\n");	
-			if(j->mystdin == INPUT_FD)
-				fprintf(stdout, "Input file name: %s\n", j->ifile);
-			if(j->mystdout == OUTPUT_FD)
-				fprintf(stdout, "Output file name: %s\n", j->ofile);
+			else {
+				if((len = read_line(&src, &item)) < 0) {
+					more = false;
+					break;
+				}
+				while(len > 0 && (item[len - 1] == '\n' || item[len - 1] == '\r'))
+					--len;
+				if(len == 0)
+					continue;
+			}
+
+			/* build the command line for this item; the words have lost
+			 * their quotes already, so each is quoted again whole */
+			outbuf_t cmd = { NULL, 0, 0 };
+			bool substituted = false;
+			int k;
+			for(k = cmd_start; k < cmd_end; k++) {
+				char *word = p->argv[k], *brace;
+				if(k > cmd_start)
+					out_append(&cmd, " ", 1);
+				while((brace = strstr(word, "{}"))) {
+					if(brace > word)
+						append_quoted(&cmd, word, brace - word);
+					append_quoted(&cmd, item, len);
+					word = brace + 2;
+					substituted = true;
+				}
+				if(*word || word == p->argv[k])
+					append_quoted(&cmd, word, strlen(word));
+			}
+			if(cmd_start == cmd_end)
+				out_append(&cmd, item, len);
+			else if(!substituted) {
+				out_append(&cmd, " ", 1);
+				append_quoted(&cmd, item, len);
+			}
+
+			/* parse it into new jobs at the tail of the job list */
+			job_t *before = last_job, *nj;
+			seq++;
+			bool parsed = parse_cmdline(cmd.buf ? cmd.buf : "", cmd.len);
+			free(cmd.buf);
+			if(!parsed) {
+				dprintf(out, "[%lu] parse error\n", seq);
+				failed++;
+				continue;
+			}
+			job_t *nnext;
+			for(nj = before ? before->next : first_job; nj; nj = nnext) {
+				nnext = nj->next;
+				if(nj->body) {
+					dprintf(out, "[%lu] compound commands are not supported\n", seq);
+					failed++;
+					delete_job(nj);
+					continue;
+				}
+				int run = apply_prefixes(nj);
+				if(run <= 0) {
+					if(run < 0) {
+						dprintf(out, "[%lu] prefix error\n", seq);
+						failed++;
+					}
+					delete_job(nj);
+					continue;
+				}
+				builtin_t *b = nj->first_process->next || nj->sched ? NULL
+					: find_builtin(nj->first_process->argv[0]);
+				if(b) /* runs to completion right away */
+					run_builtin(b, nj);
+				else
+					spawn_job(nj, false);
+				for(k = 0; k < nslots && slots[k].job; k++)
+					;
+				if(k == nslots) { /* a line with ; yields several jobs */
+					parallel_slot_t *grown = (parallel_slot_t *)realloc(slots,
+						2 * nslots * sizeof(parallel_slot_t));
+					if(!grown) {
+						finishFGJob(nj);
+						continue;
+					}
+					memset(grown + nslots, 0, nslots * sizeof(parallel_slot_t));
+					slots = grown;
+					nslots *= 2;
+				}
+				slots[k].job = nj;
+				slots[k].seq = seq;
+				clock_gettime(CLOCK_MONOTONIC, &slots[k].start);
+				running++;
+			}
+		}
+
+		/* report and free every finished slot, then wait for more */
+		int k, reaped = 0;
+		for(k = 0; k < nslots; k++) {
+			job_t *sj = slots[k].job;
+			if(!sj || !job_is_completed(sj))
+				continue;
+			int status = job_exit_status(sj);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			dprintf(out, "[%lu] exit %d %.3fs %s\n", slots[k].seq, status,
+				(now.tv_sec - slots[k].start.tv_sec) + (now.tv_nsec - slots[k].start.tv_nsec) / 1e9,
+				sj->commandinfo);
+			if(status != 0)
+				failed++;
+			done++;
+			delete_job(sj);
+			slots[k].job = NULL;
+			running--;
+			reaped++;
+		}
+		if(!reaped && running > 0 && !wait_for_child(WAIT_ANY, 0) && errno == ECHILD)
+			break;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	dprintf(out, "%lu jobs, %lu failed, %.3fs\n", done, failed,
+		(now.tv_sec - t0.tv_sec) + (now.tv_nsec - t0.tv_nsec) / 1e9);
+	free(slots);
+	if(src.fd != in)
+		close(src.fd);
+	free(src.buf);
+	return failed ? 1 : 0;
+}
+
+/* pipesize [size]: show or set the capacity of the pipes between stages
+ * (0 for the kernel default). As a prefix, "pipesize size command ..."
+ * sets it for that one job; see prefix_pipesize(). */
+int builtin_pipesize(job_t *j, process_t *p, int in, int out) {
+	long size;
+	if(p->argc < 2) {
+		dprintf(out, "%d\n", pipe_capacity);
+		return 0;
+	}
+	if((size = parse_size(p->argv[1])) < 0) {
+		fprintf(stderr, "pipesize: %s: invalid size\n", p->argv[1]);
+		return 1;
+	}
+	pipe_capacity = size;
+	return 0;
+}
+
+/* splice(2) all len bytes from the pipe in to out */
+int splice_all(int in, int out, size_t len) {
+	ssize_t n;
+	while(len > 0) {
+		if((n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE)) <= 0) {
+			if(n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/* Copy in to out and every file in files[] using tee(2)/splice(2), so the
+ * data stays in the kernel. in must be a pipe; out and files may be
+ * anything splice can write to. Each block goes through a scratch pipe
+ * as large as in, so a tee of a whole block into it is never short.
+ * Returns -1 with errno EINVAL right away if splicing is not possible, so
+ * the caller can fall back to read/write. */
+int splice_copy(int in, int out, int *files, int nfiles) {
+	int scratch[2], discard = -1, size;
+	ssize_t n;
+	size_t block;
+	bool out_is_pipe, first = true;
+	struct stat st;
+	int i;
+
+	if(fstat(out, &st) < 0)
+		return -1;
+	out_is_pipe = S_ISFIFO(st.st_mode);
+	if(pipe2(scratch, O_CLOEXEC) < 0)
+		return -1;
+	if((size = fcntl(in, F_GETPIPE_SZ)) > 0)
+		fcntl(scratch[1], F_SETPIPE_SZ, size);
+	/* what the scratch pipe got, if in's size was not allowed */
+	block = (size = fcntl(scratch[1], F_GETPIPE_SZ)) > 0 ? size : 65536;
+	/* with no file, what was copied to out is spliced away */
+	if(nfiles == 0 && (discard = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+		close(scratch[0]);
+		close(scratch[1]);
+		return -1;
+	}
+
+	while(1) {
+		/* duplicate the next block of in without consuming it */
+		if(out_is_pipe)
+			n = tee(in, out, block, 0);
+		else if((n = tee(in, scratch[1], block, 0)) > 0 && splice_all(scratch[0], out, n) < 0)
+			n = -1;
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && first && errno == EINVAL)
+			break;
+		if(n <= 0)
+			break;
+		first = false;
+
+		for(i = 0; i + 1 < nfiles; i++)
+			if(tee(in, scratch[1], n, 0) != n || splice_all(scratch[0], files[i], n) < 0)
+				goto fail;
+		/* the last file, or /dev/null, consumes the block */
+		if(splice_all(in, nfiles > 0 ? files[nfiles - 1] : discard, n) < 0)
+			goto fail;
+	}
+	close(scratch[0]);
+	close(scratch[1]);
+	if(discard >= 0)
+		close(discard);
+	return n < 0 ? -1 : 0;
+fail:
+	/* data already went out; the caller must not start over */
+	if(errno == EINVAL)
+		errno = EIO;
+	close(scratch[0]);
+	close(scratch[1]);
+	if(discard >= 0)
+		close(discard);
+	return -1;
+}
+
+/* tee [-a] [file ...]: copy stdin to stdout and to each file. Runs without
+ * an exec; when stdin is a pipe the data is moved with tee(2)/splice(2)
+ * and never copied through user space. */
+int builtin_tee(job_t *j, process_t *p, int in, int out) {
+	int i = 1, nfiles = 0, rc = 0;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	struct stat st;
+
+	if(p->argv[1] && strcmp(p->argv[1], "-a") == 0) {
+		flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+		i = 2;
+	}
+	int *files = (int *)calloc(p->argc + 1, sizeof(int));
+	if(!files)
+		return 1;
+	for(; i < p->argc; i++) {
+		if((files[nfiles] = open(p->argv[i], flags, 0666)) < 0) {
+			perror(p->argv[i]);
+			rc = 1;
+			continue;
+		}
+		nfiles++;
+	}
+
+	/* splice(2) refuses O_APPEND files */
+	if(!(flags & O_APPEND) && fstat(in, &st) == 0 && S_ISFIFO(st.st_mode)) {
+		if(splice_copy(in, out, files, nfiles) == 0)
+			goto done;
+		if(errno != EINVAL) {
+			perror("tee");
+			rc = 1;
+			goto done;
+		}
+	}
+
+	/* not spliceable: plain read/write */
+	char buf[65536];
+	ssize_t n;
+	while((n = read(in, buf, sizeof(buf))) != 0) {
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("tee");
+			rc = 1;
+			break;
+		}
+		if(write_all(out, buf, n) < 0)
+			rc = 1;
+		for(i = 0; i < nfiles; i++)
+			if(write_all(files[i], buf, n) < 0)
+				rc = 1;
+	}
+done:
+	for(i = 0; i < nfiles; i++)
+		close(files[i]);
+	free(files);
+	return rc;
+}
+
+/* export [NAME[=value] ...]: pass variables on to children; with no
+ * arguments, list the exported ones */
+int builtin_export(job_t *j, process_t *p, int in, int out) {
+	int i, rc = 0;
+	char **e;
+
+	if(p->argc == 1) {
+		outbuf_t buf = { NULL, 0, 0 };
+		for(e = env_envp(); *e; e++) {
+			out_append(&buf, "export ", 7);
+			out_append(&buf, *e, strlen(*e));
+			out_append(&buf, "\n", 1);
+		}
+		return out_flush(&buf, out) < 0 ? 1 : 0;
+	}
+	for(i = 1; i < p->argc; i++) {
+		bool ok;
+		if(assignment_name(p->argv[i]))
+			ok = env_set(p->argv[i], 1);
+		else if(!name_length(p->argv[i]) || p->argv[i][name_length(p->argv[i])] != '\0') {
+			fprintf(stderr, "export: %s: not a valid name\n", p->argv[i]);
+			rc = 1;
+			continue;
+		}
+		else
+			ok = env_export(p->argv[i]);
+		if(!ok) {
+			fprintf(stderr, "export: no space\n");
+			rc = 1;
+		}
+	}
+	return rc;
+}
+
+/* unset NAME ... */
+int builtin_unset(job_t *j, process_t *p, int in, int out) {
+	int i;
+	for(i = 1; i < p->argc; i++)
+		env_unset(p->argv[i]);
+	return 0;
+}
+
+/* env: print the environment children get */
+int builtin_env(job_t *j, process_t *p, int in, int out) {
+	outbuf_t buf = { NULL, 0, 0 };
+	char **e;
+	for(e = process_envp(j, p); *e; e++) {
+		out_append(&buf, *e, strlen(*e));
+		out_append(&buf, "\n", 1);
+	}
+	return out_flush(&buf, out) < 0 ? 1 : 0;
+}
+
+/* hash: list the cached command paths with their hits; hash -r empties
+ * the cache, hash -s shows its counters, and hash name ... looks the
+ * names up now so the first run of each is a hit */
+int builtin_hash(job_t *j, process_t *p, int in, int out) {
+	int i, rc = 0;
+	path_entry_t *e;
+
+	if(p->argc == 1) {
+		for(i = 0; i < PATH_CACHE_SIZE; i++)
+			for(e = path_cache[i]; e; e = e->next)
+				dprintf(out, "%6lu\t%s\n", e->hits, e->path);
+		return 0;
+	}
+	if(strcmp(p->argv[1], "-r") == 0) {
+		path_cache_drop(0);
+		return 0;
+	}
+	if(strcmp(p->argv[1], "-s") == 0) {
+		unsigned long spawns = path_stats.lookups;
+		long saved = (long)path_stats.saved - (long)path_stats.checks;
+		dprintf(out, "lookups %lu hits %lu (%.1f%%) probes %lu dir checks %lu\n",
+			spawns, path_stats.hits, spawns ? 100.0 * path_stats.hits / spawns : 0.0,
+			path_stats.probes, path_stats.checks);
+		dprintf(out, "syscalls saved %ld (%.2f per lookup)\n", saved,
+			spawns ? (double)saved / spawns : 0.0);
+		return 0;
+	}
+	for(i = 1; i < p->argc; i++)
+		if(!find_builtin(p->argv[i]) && !resolve_command(p->argv[i])) {
+			fprintf(stderr, "hash: %s: not found\n", p->argv[i]);
+			rc = 1;
+		}
+	return rc;
+}
+
+/* time: with no command, the CPU time used so far by the shell and by its
+ * reaped children. "time command ..." is the prefix; see prefix_time(). */
+int builtin_time(job_t *j, process_t *p, int in, int out) {
+	struct rusage ru[2];
+	const char *who[2] = { "shell", "children" };
+	int i;
+
+	getrusage(RUSAGE_SELF, &ru[0]);
+	getrusage(RUSAGE_CHILDREN, &ru[1]);
+	dprintf(out, "%-8s %8s %8s %8s %13s\n", "", "user", "sys", "maxrss", "vcsw/ivcsw");
+	for(i = 0; i < 2; i++)
+		dprintf(out, "%-8s %8.3f %8.3f %8ld %6ld/%-6ld\n", who[i],
+			tv_seconds(&ru[i].ru_utime), tv_seconds(&ru[i].ru_stime),
+			ru[i].ru_maxrss, ru[i].ru_nvcsw, ru[i].ru_nivcsw);
+	return 0;
+}
+
+/* exit [n] */
+int builtin_exit(job_t *j, process_t *p, int in, int out) {
+	char *end;
+	long status = last_status;
+	if(p->argc > 1 && ((status = strtol(p->argv[1], &end, 10)), end == p->argv[1] || *end)) {
+		fprintf(stderr, "exit: %s: numeric argument required\n", p->argv[1]);
+		return 2;
+	}
+	fflush(stdout);
+	exit(status & 0xff);
+}
+
+/* break [n] and continue [n]: leave the n innermost loops, and with
+ * continue start the next round of the one outside them; see loop_done() */
+int builtin_break(job_t *j, process_t *p, int in, int out) {
+	int n = p->argc > 1 ? atoi(p->argv[1]) : 1;
+	if(n < 1) {
+		fprintf(stderr, "%s: %s: loop count out of range\n", p->argv[0], p->argv[1]);
+		return 1;
+	}
+	if(loop_depth == 0) {
+		fprintf(stderr, "%s: only meaningful in a loop\n", p->argv[0]);
+		return 1;
+	}
+	if(n > loop_depth)
+		n = loop_depth;
+	continuing = p->argv[0][0] == 'c';
+	breaking = continuing ? n - 1 : n;
+	return 0;
+}
+
+/* return [n]: leave the running function with status n (default $?) */
+int builtin_return(job_t *j, process_t *p, int in, int out) {
+	if(func_depth == 0) {
+		fprintf(stderr, "return: can only be used in a function\n");
+		return 1;
+	}
+	returning = true;
+	return p->argc > 1 ? atoi(p->argv[1]) & 0xff : last_status;
+}
+
+/* Sorted by name (strcmp order) for bsearch */
+builtin_t builtins[] = {
+	{ "[",		builtin_test },
+	{ "bg",		builtin_bg },
+	{ "break",	builtin_break },
+	{ "cache",	builtin_cache },
+	{ "capture",	builtin_capture },
+	{ "cd",		builtin_cd },
+	{ "continue",	builtin_break },
+	{ "echo",	builtin_echo },
+	{ "env",	builtin_env },
+	{ "exit",	builtin_exit },
+	{ "export",	builtin_export },
+	{ "false",	builtin_false },
+	{ "fg",		builtin_fg },
+	{ "hash",	builtin_hash },
+	{ "history",	builtin_history },
+	{ "jobs",	builtin_jobs },
+	{ "kill",	builtin_kill },
+	{ "launcher",	builtin_launcher },
+	{ "memstats",	builtin_memstats },
+	{ "output",	builtin_output },
+	{ "parallel",	builtin_parallel },
+	{ "pipesize",	builtin_pipesize },
+	{ "printf",	builtin_printf },
+	{ "pwd",	builtin_pwd },
+	{ "return",	builtin_return },
+	{ "sched",	builtin_sched },
+	{ "tee",	builtin_tee },
+	{ "test",	builtin_test },
+	{ "time",	builtin_time },
+	{ "true",	builtin_true },
+	{ "unset",	builtin_unset },
+	{ "wait",	builtin_wait },
+};
+
+int compare_builtin(const void *name, const void *b) {
+	return strcmp((const char *)name, ((const builtin_t *)b)->name);
+}
+
+builtin_t *find_builtin(char *name) {
+	return (builtin_t *)bsearch(name, builtins, sizeof(builtins) / sizeof(builtins[0]),
+				    sizeof(builtin_t), compare_builtin);
+}
+
+/* Prefix builtins set options on the job they start and are stripped from
+ * its first process, e.g. "pipesize 1M cat f | wc". Each returns how many
+ * words it consumed, 0 if the words are not a prefix use (the ordinary
+ * builtin of the same name then runs), or -1 on error. */
+int prefix_pipesize(job_t *j, char **argv, int argc) {
+	long size;
+	if(argc < 3)
+		return 0;
+	if((size = parse_size(argv[1])) < 0) {
+		fprintf(stderr, "pipesize: %s: invalid size\n", argv[1]);
+		return -1;
+	}
+	j->pipe_size = size;
+	return 2;
+}
+
+/* time command ...: report the job's usage when it finishes */
+int prefix_time(job_t *j, char **argv, int argc) {
+	if(argc < 2)
+		return 0;
+	j->timed = true;
+	return 1;
+}
+
+/* cache [-i file]... command ...: take the job's output from the result
+ * cache when its inputs have not changed; see cache_replay() */
+int prefix_cache(job_t *j, char **argv, int argc) {
+	cache_req_t *c;
+	int n = 1;
+
+	if(argc < 2 || (argv[1][0] == '-' && strcmp(argv[1], "-i") != 0))
+		return 0;
+	if(!(c = (cache_req_t *)arena_alloc(j->arena, sizeof(cache_req_t)))
+	   || !(c->inputs = (char **)arena_alloc(j->arena, argc * sizeof(char *)))) {
+		fprintf(stderr, "cache: no space\n");
+		return -1;
+	}
+	while(n + 1 < argc && strcmp(argv[n], "-i") == 0) {
+		c->inputs[c->ninputs++] = argv[n + 1];
+		n += 2;
+	}
+	if(n < argc && strcmp(argv[n], "-i") == 0) {
+		fprintf(stderr, "cache: -i: file name expected\n");
+		return -1;
+	}
+	j->cache = c;
+	return n;
+}
+
+/* Scheduling. "sched [-c cpus] [-n nice] [-i class[:level]] [-p policy]
+ * [-m policy[:nodes]] command ..." runs a job pinned to a set of CPUs,
+ * at a nice value, I/O priority (ioprio_set: rt, be or idle), CPU
+ * scheduling policy (other, batch or idle) and NUMA memory policy
+ * (default, local, bind:nodes, interleave:nodes or preferred:node). Each
+ * process of the job applies them to itself between fork and exec (see
+ * launch_fork()), so nothing runs with the shell's own settings first;
+ * exec keeps all of them. "sched options %job|pgid ..." changes every
+ * thread of a running job instead, but for its memory policy, which only
+ * a process can set for itself, and "sched %job" shows a job's settings,
+ * as "jobs -l" does. */
+static const char *const sched_policies[] = { "other", NULL, NULL, "batch", NULL, "idle" };
+static const char *const ioprio_classes[] = { "none", "rt", "be", "idle" };
+
+/* Set the bits of the ids in list ("0-3,8") in mask, of max bits */
+bool parse_id_list(const char *list, unsigned long *mask, long max) {
+	const unsigned long bits = 8 * sizeof(unsigned long);
+	char *end;
+	long first, last;
+
+	do {
+		first = last = strtol(list, &end, 10);
+		if(end == list || first < 0)
+			return false;
+		if(*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if(end == list || last < first)
+				return false;
+		}
+		if(last >= max)
+			return false;
+		for(; first <= last; first++)
+			mask[first / bits] |= 1UL << (first % bits);
+		list = end + 1;
+	} while(*end == ',');
+	return *end == '\0';
+}
+
+/* Read the options of argv into s. Returns the index of the first word
+ * after them, or -1 after reporting a bad one. */
+int parse_sched(sched_req_t *s, char **argv, int argc) {
+	unsigned long cpus[CPU_SETSIZE / (8 * sizeof(unsigned long))];
+	char *arg, *end, *colon;
+	long n;
+	int i, k;
+
+	memset(s, 0, sizeof(*s));
+	s->policy = s->ioprio = s->mempolicy = -1;
+	for(i = 1; i + 1 < argc && argv[i][0] == '-' && argv[i][1] && !argv[i][2]; i += 2) {
+		arg = argv[i + 1];
+		switch(argv[i][1]) {
+		case 'c':
+			memset(cpus, 0, sizeof(cpus));
+			if(!parse_id_list(arg, cpus, sysconf(_SC_NPROCESSORS_CONF))) {
+				fprintf(stderr, "sched: -c %s: not a list of CPUs\n", arg);
+				return -1;
+			}
+			CPU_ZERO(&s->cpus);
+			for(n = 0; n < CPU_SETSIZE; n++)
+				if(cpus[n / (8 * sizeof(unsigned long))] & (1UL << (n % (8 * sizeof(unsigned long)))))
+					CPU_SET(n, &s->cpus);
+			s->has_cpus = true;
+			s->cpu_list = arg;
+			break;
+		case 'n':
+			n = strtol(arg, &end, 10);
+			if(end == arg || *end || n < -20 || n > 19) {
+				fprintf(stderr, "sched: -n %s: nice must be -20 to 19\n", arg);
+				return -1;
+			}
+			s->has_nice = true;
+			s->nice = n;
+			break;
+		case 'i':
+			if((colon = strchr(arg, ':')))
+				*colon = '\0';
+			for(k = 1; k < 4 && strcmp(arg, ioprio_classes[k]) != 0; k++)
+				;
+			n = colon ? strtol(colon + 1, &end, 10) : 4;
+			if(colon)
+				*colon = ':';
+			if(k == 4 || (colon && (end == colon + 1 || *end || k == IOPRIO_CLASS_IDLE))
+			   || n < 0 || n > 7) {
+				fprintf(stderr, "sched: -i %s: want rt[:0-7], be[:0-7] or idle\n", arg);
+				return -1;
+			}
+			s->ioprio = IOPRIO_PRIO_VALUE(k, k == IOPRIO_CLASS_IDLE ? 0 : n);
+			break;
+		case 'p':
+			for(k = 0; k < 6 && (!sched_policies[k] || strcmp(arg, sched_policies[k]) != 0); k++)
+				;
+			if(k == 6) {
+				fprintf(stderr, "sched: -p %s: want other, batch or idle\n", arg);
+				return -1;
+			}
+			s->policy = k;
+			break;
+		case 'm':
+			colon = strchr(arg, ':');
+			n = colon ? colon - arg : (long)strlen(arg);
+			if(!colon && strcmp(arg, "default") == 0)
+				s->mempolicy = MPOL_DEFAULT;
+			else if(!colon && strcmp(arg, "local") == 0)
+				s->mempolicy = MPOL_LOCAL;
+			else if(colon && n == 4 && strncmp(arg, "bind", 4) == 0)
+				s->mempolicy = MPOL_BIND;
+			else if(colon && n == 10 && strncmp(arg, "interleave", 10) == 0)
+				s->mempolicy = MPOL_INTERLEAVE;
+			else if(colon && n == 9 && strncmp(arg, "preferred", 9) == 0 && !strchr(colon, ',')
+			        && !strchr(colon, '-'))
+				s->mempolicy = MPOL_PREFERRED;
+			if(s->mempolicy < 0 || (colon && !parse_id_list(colon + 1, s->nodes, 8 * sizeof(s->nodes)))) {
+				fprintf(stderr, "sched: -m %s: want default, local, bind:nodes, interleave:nodes"
+					" or preferred:node\n", arg);
+				return -1;
+			}
+			s->mem_arg = arg;
+			break;
+		default:
+			fprintf(stderr, "sched: %s: unknown option\n", argv[i]);
+			return -1;
+		}
+	}
+	return i;
+}
+
+/* s as the options that would set it */
+void sched_describe(sched_req_t *s, char *buf, size_t size) {
+	size_t n = 0;
+	buf[0] = '\0';
+	if(s->has_cpus)
+		n += snprintf(buf + n, size - n, " -c %s", s->cpu_list);
+	if(s->has_nice && n < size)
+		n += snprintf(buf + n, size - n, " -n %d", s->nice);
+	if(s->ioprio >= 0 && n < size) {
+		int class = IOPRIO_PRIO_CLASS(s->ioprio);
+		n += snprintf(buf + n, size - n, class == IOPRIO_CLASS_IDLE ? " -i %s" : " -i %s:%d",
+			ioprio_classes[class], (int)IOPRIO_PRIO_DATA(s->ioprio));
+	}
+	if(s->policy >= 0 && n < size)
+		n += snprintf(buf + n, size - n, " -p %s", sched_policies[s->policy]);
+	if(s->mempolicy >= 0 && n < size)
+		snprintf(buf + n, size - n, " -m %s", s->mem_arg);
+}
+
+/* Apply s to thread tid, 0 for the caller; false after reporting a
+ * failure. The policy goes first, since it decides what nice means. */
+bool sched_apply(sched_req_t *s, pid_t tid) {
+	struct sched_param param = { 0 };
+	const char *what = NULL;
+
+	if(s->policy >= 0 && sched_setscheduler(tid, s->policy, &param) < 0)
+		what = "-p";
+	else if(s->has_nice && setpriority(PRIO_PROCESS, tid, s->nice) < 0)
+		what = "-n";
+	else if(s->has_cpus && sched_setaffinity(tid, sizeof(s->cpus), &s->cpus) < 0)
+		what = "-c";
+	else if(s->ioprio >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, s->ioprio) < 0)
+		what = "-i";
+	else if(s->mempolicy >= 0 && tid == 0
+	        && syscall(SYS_set_mempolicy, s->mempolicy,
+	                   s->mempolicy == MPOL_DEFAULT || s->mempolicy == MPOL_LOCAL ? NULL : s->nodes,
+	                   8 * sizeof(s->nodes)) < 0)
+		what = "-m";
+	if(!what)
+		return true;
+	fprintf(stderr, "sched: %s: %s\n", what, strerror(errno));
+	return false;
+}
+
+/* True if word names a job for the sched builtin: %job or a pgid */
+bool is_job_word(const char *word) {
+	return word[0] == '%' || strspn(word, "0123456789") == strlen(word);
+}
+
+/* sched options command ...: run the job with those settings. Without
+ * options the command runs as it is. */
+int prefix_sched(job_t *j, char **argv, int argc) {
+	sched_req_t *s;
+	int n;
+
+	if(argc < 2)
+		return 0;
+	if(argv[1][0] != '-')
+		return is_job_word(argv[1]) ? 0 : 1;
+	if(!(s = (sched_req_t *)arena_alloc(j->arena, sizeof(sched_req_t)))) {
+		fprintf(stderr, "sched: no space\n");
+		return -1;
+	}
+	if((n = parse_sched(s, argv, argc)) < 0)
+		return -1;
+	/* the builtin changes running jobs */
+	if(n == argc || is_job_word(argv[n]))
+		return 0;
+	j->sched = s;
+	return n;
+}
+
+/* Apply s to every thread of j's live processes and add it to j's
+ * settings; false if the kernel refused */
+bool sched_job(job_t *j, sched_req_t *s) {
+	sched_req_t *js = j->sched;
+	process_t *p;
+	struct dirent *e;
+	char path[32];
+	DIR *dir;
+	bool ok = true;
+
+	for(p = j->first_process; ok && p; p = p->next) {
+		if(p->pid <= 0 || p->completed)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task", (int)p->pid);
+		if(!(dir = opendir(path))) {
+			ok = sched_apply(s, p->pid);
+			continue;
+		}
+		while(ok && (e = readdir(dir)))
+			if(e->d_name[0] != '.')
+				ok = sched_apply(s, atoi(e->d_name));
+		closedir(dir);
+	}
+	if(!ok)
+		return false;
+
+	if(!js) {
+		if(!(js = (sched_req_t *)arena_alloc(j->arena, sizeof(sched_req_t))))
+			return true; /* applied, just not shown */
+		js->policy = js->ioprio = js->mempolicy = -1;
+		j->sched = js;
+	}
+	if(s->has_cpus && (js->cpu_list = arena_strndup(j->arena, s->cpu_list, strlen(s->cpu_list)))) {
+		js->has_cpus = true;
+		js->cpus = s->cpus;
+	}
+	if(s->has_nice) {
+		js->has_nice = true;
+		js->nice = s->nice;
+	}
+	if(s->policy >= 0)
+		js->policy = s->policy;
+	if(s->ioprio >= 0)
+		js->ioprio = s->ioprio;
+	return true;
+}
+
+struct {
+	const char *name;
+	int (*fn)(job_t *j, char **argv, int argc);
+} prefixes[] = {
+	{ "cache",	prefix_cache },
+	{ "pipesize",	prefix_pipesize },
+	{ "sched",	prefix_sched },
+	{ "time",	prefix_time },
+};
+
+/* Move the NAME=value words that start p's argv to p->assign; they are
+ * not globbed */
+void strip_assignments(process_t *p) {
+	glob_word_t *g;
+	int n = 0;
+	while(n < p->argc && assignment_name(p->argv[n]))
+		n++;
+	if(n == 0)
+		return;
+	while(p->globs && p->globs->index < n)
+		p->globs = p->globs->next;
+	for(g = p->globs; g; g = g->next)
+		g->index -= n;
+	p->assign = p->argv;
+	p->nassign = n;
+	p->argv += n;
+	p->argc -= n;
+	p->argv_size -= n;
+}
+
+/* Apply and strip NAME=value words and prefix builtins from j. Returns 1
+ * if there is a command left to run, 0 if the job only set variables (a
+ * lone "NAME=value ..." sets them in the shell) and -1 on error. */
+int apply_prefixes(job_t *j) {
+	process_t *p = j->first_process;
+	size_t i;
+	int n;
+
+	for(; p; p = p->next) {
+		if(!expand_vars(j, p)) {
+			fprintf(stderr, "dsh: no space to expand words\n");
+			return -1;
+		}
+		strip_assignments(p);
+		if(!expand_globs(j, p)) {
+			fprintf(stderr, "dsh: no space to expand globs\n");
+			return -1;
+		}
+		if(p->argc == 0 && (p != j->first_process || p->next)) {
+			fprintf(stderr, "dsh: missing command after %s\n", p->assign[p->nassign - 1]);
+			return -1;
+		}
+	}
+	p = j->first_process;
+	if(p->argc == 0) {
+		for(n = 0; n < p->nassign; n++)
+			if(!env_set(p->assign[n], -1)) {
+				fprintf(stderr, "dsh: no space for %s\n", p->assign[n]);
+				return -1;
+			}
+		return 0;
+	}
+
+	for(i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+		if(strcmp(p->argv[0], prefixes[i].name) != 0)
+			continue;
+		if((n = prefixes[i].fn(j, p->argv, p->argc)) < 0)
+			return -1;
+		if(n == 0)
+			return 1;
+		p->argv += n;
+		p->argc -= n;
+		p->argv_size -= n;
+		if(p->nassign == 0) /* time A=1 command */
+			strip_assignments(p);
+		if(p->argc == 0) {
+			fprintf(stderr, "dsh: %s: missing command\n", prefixes[i].name);
+			return -1;
+		}
+		i = -1; /* look for another prefix */
+	}
+	return 1;
+}
+
+/* Open p's redirections for a builtin run inside the shell. fds[0..2]
+ * start out as 0, 1 and 2 and end up as the descriptors standing in for
+ * them. Files are opened, and n>&m copied, close-on-exec, with opened[k]
+ * the descriptor for target[k] (room for one per redirection) left for
+ * the caller to close; *nopened counts them. A later m>&n finds n there,
+ * so they resolve in order as in redirect_child(). False on failure, with
+ * nothing left open. */
+bool open_redirects(process_t *p, int fds[3], int *opened, int *target, int *nopened) {
+	redir_t *r;
+	int fd, k;
+
+	*nopened = 0;
+	for(r = p->redirs; r; r = r->next) {
+		if(r->kind == REDIR_DUP) {
+			/* the latest redirection of from, or the shell's own */
+			for(k = *nopened - 1; k >= 0 && target[k] != r->from; k--)
+				;
+			fd = k >= 0 ? opened[k] : r->from < 3 ? fds[r->from] : r->from;
+			if(k < 0 && r->from >= child_fd_base) {
+				fprintf(stderr, "dsh: %d: %s\n", r->from, strerror(EBADF));
+				fd = -1;
+			}
+			else if((fd = fcntl(fd, F_DUPFD_CLOEXEC, 3)) < 0)
+				fprintf(stderr, "dsh: %d: %s\n", r->from, strerror(errno));
+		}
+		else if((fd = open(r->file, redir_flags(r) | O_CLOEXEC, 0666)) < 0)
+			perror(r->file);
+		if(fd < 0) {
+			while(*nopened > 0)
+				close(opened[--*nopened]);
+			return false;
+		}
+		opened[*nopened] = fd;
+		target[(*nopened)++] = r->fd;
+		if(r->fd < 3)
+			fds[r->fd] = fd;
+	}
+	return true;
+}
+
+/* Run a single-process builtin job inside the shell, with its process's
+ * redirections applied: stdin and stdout through the descriptors it is
+ * given, stderr by pointing descriptor 2 elsewhere for the duration of the
+ * call. Returns its status. */
+int run_builtin(builtin_t *b, job_t *j) {
+	process_t *p = j->first_process;
+	int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	int in, out, rc, n = 0, nopened, saved_err = -1;
+	struct rusage before;
+	redir_t *r;
+
+	for(r = p->redirs; r; r = r->next)
+		n++;
+	int opened[n + 1], target[n + 1];
+	if(!open_redirects(p, fds, opened, target, &nopened))
+		return 1;
+	in = fds[STDIN_FILENO];
+	out = fds[STDOUT_FILENO];
+	if(fds[STDERR_FILENO] != STDERR_FILENO) {
+		fflush(stderr);
+		saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+		dup2(fds[STDERR_FILENO], STDERR_FILENO);
+	}
+
+	fflush(stdout); /* keep ordering with the shell's own output */
+	if(j->timed) {
+		getrusage(RUSAGE_SELF, &before);
+		clock_gettime(CLOCK_MONOTONIC, &j->start);
+		p->start = j->start;
+	}
+	rc = b->fn(j, p, in, out);
+	p->completed = true;
+	p->status = W_EXITCODE(rc & 0xff, 0);
+	if(j->timed) {
+		/* the shell's own usage over the call */
+		clock_gettime(CLOCK_MONOTONIC, &j->end);
+		p->end = j->end;
+		getrusage(RUSAGE_SELF, &p->rusage);
+		timersub(&p->rusage.ru_utime, &before.ru_utime, &p->rusage.ru_utime);
+		timersub(&p->rusage.ru_stime, &before.ru_stime, &p->rusage.ru_stime);
+		p->rusage.ru_nvcsw -= before.ru_nvcsw;
+		p->rusage.ru_nivcsw -= before.ru_nivcsw;
+		j->rusage = p->rusage;
+	}
+
+	if(saved_err >= 0) {
+		fflush(stderr);
+		dup2(saved_err, STDERR_FILENO);
+		close(saved_err);
+	}
+	while(nopened > 0)
+		close(opened[--nopened]);
+	return rc;
+}
+
+/* Running compound commands. The shell walks the tree of a compound
+ * command itself (run_node()), and runs each pipeline in it from its
+ * template: run_template() copies the job into the scratch arena of the
+ * node, emptied first, so after its first round a loop needs no malloc
+ * and no parsing. The copy shares the template's strings and compiled
+ * words; a copy still running when its node is done with it (in the
+ * background, or stopped) gets a copy of those and its arena for itself
+ * (detach_job()). break, continue and return set flags that unwind the
+ * walk to the loop or function they are meant for; ^C, and a fg job
+ * killed by SIGINT or stopped, end the whole command. */
+enum { FUNC_DEPTH_MAX = 1000 };
+
+func_t *find_function(const char *name) {
+	func_t *f;
+	for(f = functions; f; f = f->next)
+		if(strcmp(f->name, name) == 0)
+			return f;
+	return NULL;
+}
+
+/* name() body: the tree defining it is kept from then on */
+bool define_function(node_t *n) {
+	func_t *f = find_function(n->name);
+	if(!f) {
+		if(!(f = (func_t *)malloc(sizeof(func_t)))) {
+			fprintf(stderr, "%s: no space\n", n->name);
+			return false;
 		}
+		f->next = functions;
+		functions = f;
 	}
+	f->name = n->name;
+	f->body = n->body;
+	n->job->kept = true;
+	return true;
+}
 
-	/* Basic parser that fills the data structures job_t and process_t defined in
-	 * dsh.h. We tried to make the parser flexible but it is not tested
-	 * with arbitrary inputs. Be prepared to hack it for the features
-	 * you may require. The more complicated cases such as parenthesis
-	 * and grouping are not supported. If the parser found some error, it
-	 * will always return NULL. 
-	 *
-	 * The parser supports these symbols: <, >, |, &, ;
-	 */
+struct sigaction saved_sigint;
+int compound_depth;		/* compound commands and calls in progress */
 
-	bool readcmdline(char *msg) {
+void note_interrupt(int sig) {
+	interrupted = true;
+}
 
-		fprintf(stdout, "%s", msg);
+/* At a terminal, a ^C while the shell itself is running (a builtin
+ * between two commands) ends the compound command instead of dsh */
+void compound_begin() {
+	struct sigaction sa;
+	if(compound_depth++ > 0 || !shell_is_interactive)
+		return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = note_interrupt;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &saved_sigint);
+}
 
-		char *cmdline = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
-		if(!cmdline)
-			return invokefree(NULL, "malloc: no space");
-		fgets(cmdline, MAX_LEN_CMDLINE, stdin);
+void compound_end() {
+	if(--compound_depth > 0)
+		return;
+	if(shell_is_interactive)
+		sigaction(SIGINT, &saved_sigint, NULL);
+	interrupted = false;
+	breaking = 0;
+	continuing = false;
+	returning = false;
+}
 
-		/* sequence is true only when the command line contains ; */
-		bool sequence = false;
-		/* seq_pos is used for storing the command line before ; */
-		int seq_pos = 0;
+/* Run f with p's words as its positional parameters */
+int call_function(func_t *f, process_t *p) {
+	char **saved_argv = pos_argv;
+	int saved_argc = pos_argc, saved_loops = loop_depth, status;
 
-		int cmdline_pos = 0; /*iterator for command line; */
+	if(func_depth >= FUNC_DEPTH_MAX) {
+		fprintf(stderr, "dsh: %s: too many nested function calls\n", f->name);
+		return 1;
+	}
+	if(p->redirs) {
+		fprintf(stderr, "dsh: %s: a function call cannot be redirected\n", f->name);
+		return 1;
+	}
+	pos_argv = p->argv;
+	pos_argc = p->argc;
+	loop_depth = 0; /* break does not leave the function */
+	func_depth++;
+	compound_begin();
+	status = run_node(f->body);
+	compound_end();
+	func_depth--;
+	returning = false;
+	loop_depth = saved_loops;
+	pos_argv = saved_argv;
+	pos_argc = saved_argc;
+	return status;
+}
 
-		while(1) {
-			job_t *current_job = find_last_job();
+/* A copy of the template t in a, to be run and thrown away. Only what a
+ * run changes is copied: the job, its processes, argv arrays, globs and
+ * redirections. */
+job_t *instantiate(job_t *t, arena_t *a) {
+	job_t *j = (job_t *)arena_alloc(a, sizeof(job_t));
+	process_t *tp, *p, **pp;
+	redir_t *tr, *r, **rp;
+	glob_word_t *tg, *g, **gp;
 
-			int cmd_pos = 0; /* iterator for a command */
-			int iofile_seek = 0; /*iofile_seek for file */
-			bool valid_input = true; /* check for valid input */
-			bool end_of_input = false; /* check for end of input */
+	if(!j || !init_job(j, a))
+		return NULL;
+	j->commandinfo = t->commandinfo;
+	j->bg = t->bg;
+	for(pp = &j->first_process, tp = t->first_process; tp; tp = tp->next) {
+		if(!(p = (process_t *)arena_alloc(a, sizeof(process_t))))
+			return NULL;
+		*p = *tp;
+		p->next = p->hash_next = NULL;
+		p->job = j;
+		p->argv_size = tp->argc + 1;
+		if(!(p->argv = (char **)arena_alloc(a, p->argv_size * sizeof(char *))))
+			return NULL;
+		memcpy(p->argv, tp->argv, p->argv_size * sizeof(char *));
+		for(gp = &p->globs, tg = tp->globs; tg; tg = tg->next, gp = &g->next) {
+			if(!(g = (glob_word_t *)arena_alloc(a, sizeof(glob_word_t))))
+				return NULL;
+			*g = *tg;
+			*gp = g;
+		}
+		for(rp = &p->redirs, tr = tp->redirs; tr; tr = tr->next, rp = &r->next) {
+			if(!(r = (redir_t *)arena_alloc(a, sizeof(redir_t))))
+				return NULL;
+			*r = *tr; /* a here-document's memfd stays the template's */
+			*rp = r;
+		}
+		*pp = p;
+		pp = &p->next;
+	}
+	return j;
+}
 
-			/* cmdline is NOOP, i.e., just return with spaces */
-			while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-			if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0' || feof(stdin))
-				return false;
+/* s copied into j's arena, or s itself when out of memory */
+char *detach_string(job_t *j, char *s) {
+	char *copy = s ? arena_strndup(j->arena, s, strlen(s)) : NULL;
+	return copy ? copy : s;
+}
 
-			/* Check for invalid special symbols (characters) */
-			if(cmdline[cmdline_pos] == ';' || cmdline[cmdline_pos] == '&'
-				|| cmdline[cmdline_pos] == '<' || cmdline[cmdline_pos] == '>' || cmdline[cmdline_pos] == '|')
-				return false;
+/* Let j, a run of a node, outlive the node's next run and the node
+ * itself: it takes its arena and copies what points into the template */
+void detach_job(job_t *j) {
+	process_t *p;
+	redir_t *r;
+	int i;
 
-			char *cmd = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
-			if(!cmd)
-				return invokefree(NULL,"malloc: no space");
+	j->commandinfo = detach_string(j, j->commandinfo);
+	for(p = j->first_process; p; p = p->next) {
+		for(i = 0; i < p->argc; i++)
+			p->argv[i] = detach_string(j, p->argv[i]);
+		for(i = 0; i < p->nassign; i++)
+			p->assign[i] = detach_string(j, p->assign[i]);
+		for(r = p->redirs; r; r = r->next) {
+			if(r->kind == REDIR_HEREDOC)
+				r->from = -1; /* the child has it open already */
+			else if(r->kind != REDIR_DUP)
+				r->file = detach_string(j, r->file);
+		}
+		p->vars = NULL;
+	}
+	if(j->cache) {
+		for(i = 0; i < j->cache->ninputs; i++)
+			j->cache->inputs[i] = detach_string(j, j->cache->inputs[i]);
+		j->cache->out = detach_string(j, j->cache->out);
+	}
+	j->node = NULL;
+}
 
-			job_t *newjob = (job_t *)malloc(sizeof(job_t));
-			if(!newjob)
-				return invokefree(NULL,"malloc: no space");
+/* Run j, which is on the job list: a call of a function or a builtin in
+ * the shell, anything else spawned (and waited for unless it is a &
+ * job). Returns its status. A job that was not spawned keeps pgid < 0,
+ * and the caller deletes it. */
+int run_job(job_t *j) {
+	process_t *p = j->first_process;
+	builtin_t *b = NULL;
+	func_t *f;
+	int run = apply_prefixes(j), status;
 
-			if(!first_job)
-				first_job = current_job = newjob;
-			else {
-				current_job->next = newjob;
-				current_job = current_job->next;
-			}
+	if(run <= 0)
+		return run < 0 ? 2 : 0;
 
-			if(!init_job(current_job))
-				return invokefree(current_job,"init_job: malloc failed");
+	/* A lone builtin runs inside the shell; builtins inside a
+	 * pipeline, or under sched, run in a forked child (see
+	 * launch_process) */
+	if(!p->next) {
+		if((f = find_function(p->argv[0])) && j->sched) {
+			fprintf(stderr, "dsh: %s: sched does not apply to a function\n", f->name);
+			return 1;
+		}
+		if(f)
+			return call_function(f, p);
+		if(!j->sched)
+			b = find_builtin(p->argv[0]);
+		if(j->cache && (f || b)) /* nothing to replay its output into */
+			fprintf(stderr, "cache: %s runs in the shell; not cached\n", p->argv[0]);
+	}
+	if(b) {
+		status = run_builtin(b, j);
+		if(j->timed)
+			print_job_times(j, STDERR_FILENO);
+		return status;
+	}
+	// If running in the background
+	if(j->bg) {
+		spawn_job(j, false);
+		return 0;
+	}
+	// If running in the foreground
+	spawn_job(j, true);
+	status = job_exit_status(j);
+	if(j->timed && job_is_completed(j)) {
+		print_job_times(j, STDERR_FILENO);
+		j->timed = false;
+	}
+	return status;
+}
 
-			process_t *current_process = find_last_process(current_job);
+/* Run the pipeline of a NODE_JOB from its template */
+int run_template(node_t *n) {
+	arena_t *a = n->scratch ? arena_reset(n->scratch) : arena_new();
+	job_t *j = NULL;
+	process_t *p;
+	int status = 1;
 
-			while(cmdline[cmdline_pos] != '\n' && cmdline[cmdline_pos] != '\0') {
+	n->scratch = NULL; /* a recursive call of a function makes its own */
+	if(!a || !(j = instantiate(n->job, a))) {
+		fprintf(stderr, "malloc: no space\n");
+		arena_release(a);
+		return 1;
+	}
+	j->node = n;
+	link_job(j);
+	if(!register_job(j))
+		fprintf(stderr, "malloc: no space\n");
+	else
+		status = run_job(j);
 
-				switch (cmdline[cmdline_pos]) {
+	if(j->pgid > 0 && !job_is_completed(j)) {
+		if(!j->bg) /* stopped */
+			interrupted = true;
+		detach_job(j);
+		return status;
+	}
+	for(p = j->first_process; p && !j->bg; p = p->next)
+		if(p->completed && p->status != -1 && WIFSIGNALED(p->status) && WTERMSIG(p->status) == SIGINT)
+			interrupted = true;
+	delete_job(j);
+	arena_release(n->scratch);
+	n->scratch = a;
+	return status;
+}
 
-				    case '<': /* input redirection */
-					current_job->ifile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
-					if(!current_job->ifile)
-						return invokefree(current_job,"malloc: no space");
-					++cmdline_pos;
-					while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-					iofile_seek = 0;
-					while(cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])){
-						if(MAX_LEN_FILENAME == iofile_seek)
-							return invokefree(current_job,"input redirection: file length exceeded");
-						current_job->ifile[iofile_seek++] = cmdline[cmdline_pos++];
-					}
-					current_job->ifile[iofile_seek] = '\0';
-					current_job->mystdin = INPUT_FD;
-					while(isspace(cmdline[cmdline_pos])) {
-						if(cmdline[cmdline_pos] == '\n')
-							break;
-						++cmdline_pos;
-					}
-					valid_input = false;
-					break;
+/* After a round of a loop: true if the loop is to end, taking its share
+ * of a break or continue */
+bool loop_done() {
+	if(breaking) {
+		breaking--;
+		return true;
+	}
+	if(continuing) {
+		continuing = false;
+		return false;
+	}
+	return returning || interrupted;
+}
 
-				    case '>': /* output redirection */
-					current_job->ofile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
-					if(!current_job->ofile)
-						return invokefree(current_job,"malloc: no space");
-					++cmdline_pos;
-					while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-					iofile_seek = 0;
-					while(cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])){
-						if(MAX_LEN_FILENAME == iofile_seek) 
-							return invokefree(current_job,"input redirection: file length exceeded");
-						current_job->ofile[iofile_seek++] = cmdline[cmdline_pos++];
-					}
-					current_job->ofile[iofile_seek] = '\0';
-					current_job->mystdout = OUTPUT_FD;
-					while(isspace(cmdline[cmdline_pos])) {
-						if(cmdline[cmdline_pos] == '\n')
-							break;
-						++cmdline_pos;
-					}
-					valid_input = false;
-					break;
+/* while and until */
+int run_loop(node_t *n) {
+	int status = 0, cond;
 
-				   case '|': /* pipeline */
-					cmd[cmd_pos] = '\0';
-					process_t *newprocess = (process_t *)malloc(sizeof(process_t));
-					if(!newprocess)
-						return invokefree(current_job,"malloc: no space");
-					if(!init_process(newprocess))
-						return invokefree(current_job,"init_process: failed");
-					if(!current_job->first_process)
-						current_process = current_job->first_process = newprocess;
-					else {
-						current_process->next = newprocess;
-						current_process = current_process->next;
-					}
-					if(!readprocessinfo(current_process, cmd))
-						return invokefree(current_job,"parse cmd: error");
-					++cmdline_pos;
-					cmd_pos = 0; /*Reinitialze for new cmd */
-					valid_input = true;	
-					break;
+	loop_depth++;
+	while(1) {
+		cond = run_node(n->cond);
+		if(breaking || continuing || returning || interrupted) {
+			if(loop_done())
+				break;
+			continue;
+		}
+		if((cond == 0) != (n->kind == NODE_WHILE))
+			break;
+		status = run_node(n->body);
+		if(loop_done())
+			break;
+	}
+	loop_depth--;
+	return status;
+}
 
-				   case '&': /* background job */
-					current_job->bg = true;
-					while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-					if(cmdline[cmdline_pos+1] != '\n' && cmdline[cmdline_pos+1] != '\0'){						
-						fprintf(stderr, "reading bg: extra input ignored");}
-					end_of_input = true;
-					break;
+/* for name in words: the words are expanded and globbed once, as the
+ * arguments of a command would be */
+int run_for(node_t *n) {
+	arena_t *a = NULL;
+	job_t *j;
+	char **words = pos_argv + 1;
+	int nwords = pos_argc - 1, i, status = 0;
+	size_t len = strlen(n->name);
 
-				   case ';': /* sequence of jobs*/
-					sequence = true;
-					strncpy(current_job->commandinfo,cmdline+seq_pos,cmdline_pos-seq_pos);
-					seq_pos = cmdline_pos + 1;
-					break;	
+	if(n->job) {
+		a = n->scratch ? arena_reset(n->scratch) : arena_new();
+		n->scratch = NULL;
+		if(!a || !(j = instantiate(n->job, a))
+		   || !expand_vars(j, j->first_process) || !expand_globs(j, j->first_process)) {
+			fprintf(stderr, "dsh: for: no space to expand words\n");
+			arena_release(a);
+			return 1;
+		}
+		words = j->first_process->argv;
+		nwords = j->first_process->argc;
+	}
+	loop_depth++;
+	for(i = 0; i < nwords; i++) {
+		if(!env_assign(n->name, len, words[i], -1)) {
+			fprintf(stderr, "dsh: no space for %s\n", n->name);
+			status = 1;
+			break;
+		}
+		status = run_node(n->body);
+		if(loop_done())
+			break;
+	}
+	loop_depth--;
+	if(a) {
+		arena_release(n->scratch);
+		n->scratch = a;
+	}
+	return status;
+}
 
-				   case '#': /* comment */
-					end_of_input = true;
-					break;
+/* Run the commands of the list n, in order, until one of them breaks,
+ * continues, returns or is interrupted. Returns the status of the last
+ * one run, which is also left in last_status. */
+int run_node(node_t *n) {
+	int status = last_status;
 
-				   default:
-					if(!valid_input)
-						return invokefree(current_job,"reading cmdline: could not fathom input");
-					if(cmd_pos == MAX_LEN_CMDLINE-1)
-						return invokefree(current_job,"reading cmdline: length exceeds the max limit");
-					cmd[cmd_pos++] = cmdline[cmdline_pos++];
-					break;
-				}
-				if(end_of_input || sequence)
-					break;
-			}
-			cmd[cmd_pos] = '\0';
-			process_t *newprocess = (process_t *)malloc(sizeof(process_t));
-			if(!newprocess)
-				return invokefree(current_job,"malloc: no space");
-			if(!init_process(newprocess))
-				return invokefree(current_job,"init_process: failed");
+	for(; n && !breaking && !continuing && !returning && !interrupted; n = n->next) {
+		switch(n->kind) {
+		case NODE_JOB:
+			status = run_template(n);
+			break;
+		case NODE_AND:
+		case NODE_OR:
+			status = run_node(n->cond);
+			if(!breaking && !continuing && !returning && !interrupted
+			   && (status == 0) == (n->kind == NODE_AND))
+				status = run_node(n->body);
+			break;
+		case NODE_IF:
+			status = run_node(n->cond);
+			if(breaking || continuing || returning || interrupted)
+				break;
+			if(status == 0)
+				status = run_node(n->body);
+			else
+				status = n->orelse ? run_node(n->orelse) : 0;
+			break;
+		case NODE_WHILE:
+		case NODE_UNTIL:
+			status = run_loop(n);
+			break;
+		case NODE_FOR:
+			status = run_for(n);
+			break;
+		case NODE_GROUP:
+			status = run_node(n->body);
+			break;
+		case NODE_FUNC:
+			status = define_function(n) ? 0 : 1;
+			break;
+		}
+		last_status = status;
+	}
+	return status;
+}
 
-			if(!current_job->first_process)
-				current_process = current_job->first_process = newprocess;
-			else {
-				current_process->next = newprocess;
-				current_process = current_process->next;
+/* Run j, a compound command, and free it */
+int run_compound(job_t *j) {
+	int status;
+
+	unlink_job(j);
+	compound_begin();
+	status = run_node(j->body);
+	compound_end();
+	free_job(j);
+	return status;
+}
+
+/* Completion. Command names complete from a trie of the builtins and the
+ * executables in PATH, built on the first Tab. Each Tab stats the PATH
+ * directories and reloads only the ones whose mtime changed, taking their
+ * old names out of the trie first, so a lookup stays a walk down a few
+ * nodes however many commands there are. Every node counts the names at
+ * or below it (below), which gives both the unique case and the longest
+ * common extension without visiting the rest of the subtree. Other words
+ * complete from the directory listing (see read_dir()). */
+typedef struct {
+	uint32_t child;		/* first child; children are sorted by c */
+	uint32_t sibling;	/* next child of the same parent */
+	uint32_t below;		/* names at or below this node */
+	uint32_t refs;		/* times the name ending here was added */
+	unsigned char c;	/* last byte of that name */
+} trie_node_t;
+
+/* A PATH directory whose executables are in the trie */
+typedef struct {
+	char *dir;
+	struct timespec mtime;	/* when loaded; 0 to load again */
+	char *names;		/* the executables, NUL-separated */
+	size_t size;		/* bytes in names */
+	bool seen;		/* still in PATH */
+} comp_dir_t;
+
+trie_node_t *comp_nodes;	/* [0] is the root */
+uint32_t comp_nnodes, comp_size;
+comp_dir_t *comp_dirs;		/* PATH directories loaded into the trie */
+int comp_ndirs;
+
+/* The child of node n for byte c, made if create; 0 if there is none */
+uint32_t trie_child(uint32_t n, unsigned char c, bool create) {
+	uint32_t *link = &comp_nodes[n].child, k;
+
+	while(*link && comp_nodes[*link].c < c) /* children are sorted */
+		link = &comp_nodes[*link].sibling;
+	if(*link && comp_nodes[*link].c == c)
+		return *link;
+	if(!create)
+		return 0;
+	if(comp_nnodes == comp_size) {
+		uint32_t size = comp_size ? 2 * comp_size : 4096;
+		trie_node_t *nodes = (trie_node_t *)realloc(comp_nodes, size * sizeof(trie_node_t));
+		if(!nodes)
+			return 0;
+		link = (uint32_t *)((char *)nodes + ((char *)link - (char *)comp_nodes));
+		comp_nodes = nodes;
+		comp_size = size;
+	}
+	k = comp_nnodes++;
+	comp_nodes[k] = (trie_node_t){ 0, *link, 0, 0, c };
+	*link = k;
+	return k;
+}
+
+/* Add (delta 1) or remove (delta -1) one occurrence of name */
+void trie_add(const char *name, int delta) {
+	uint32_t path[PATH_MAX], n = 0;
+	int depth = 0, i;
+
+	for(; *name && depth < PATH_MAX - 1; name++) {
+		path[depth++] = n;
+		if(!(n = trie_child(n, *name, delta > 0)))
+			return;
+	}
+	if(delta < 0 && comp_nodes[n].refs == 0)
+		return;
+	comp_nodes[n].refs += delta;
+	comp_nodes[n].below += delta;
+	for(i = 0; i < depth; i++)
+		comp_nodes[path[i]].below += delta;
+}
+
+/* The node for prefix; 0 (the root) for "" and when there is none */
+uint32_t trie_find(const char *prefix, size_t len) {
+	uint32_t n = 0;
+	while(len-- && (n = trie_child(n, *prefix++, false)))
+		;
+	return n;
+}
+
+/* Add or remove the names of d */
+void comp_load(comp_dir_t *d, int delta) {
+	char *name;
+	for(name = d->names; name && name < d->names + d->size; name += strlen(name) + 1)
+		trie_add(name, delta);
+}
+
+/* Read the executables of d->dir into d->names */
+void comp_scan(comp_dir_t *d) {
+	dir_listing_t *l = read_dir(d->dir);
+	struct stat st;
+	size_t used = 0;
+	char *e;
+	int dfd;
+
+	free(d->names);
+	d->names = NULL;
+	d->size = 0;
+	if(!l || (dfd = open(d->dir, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return;
+	if(!(d->names = (char *)malloc(l->size))) {
+		close(dfd);
+		return;
+	}
+	for(e = l->names; e < l->names + l->size; e += strlen(e + 1) + 2) {
+		if(*e == DT_DIR || fstatat(dfd, e + 1, &st, 0) < 0
+		   || !S_ISREG(st.st_mode) || !(st.st_mode & 0111))
+			continue;
+		strcpy(d->names + used, e + 1);
+		used += strlen(e + 1) + 1;
+	}
+	d->size = used;
+	close(dfd);
+}
+
+/* Bring the trie up to date with PATH and its directories */
+void comp_refresh() {
+	struct timespec now;
+	struct stat st;
+	int i, k;
+
+	if(!comp_nodes) {
+		if(!(comp_nodes = (trie_node_t *)calloc(4096, sizeof(trie_node_t))))
+			return;
+		comp_size = 4096;
+		comp_nnodes = 1;
+		for(i = 0; i < (int)(sizeof(builtins) / sizeof(builtins[0])); i++)
+			trie_add(builtins[i].name, 1);
+	}
+	path_update_dirs();
+	clock_gettime(CLOCK_REALTIME, &now);
+	for(k = 0; k < comp_ndirs; k++)
+		comp_dirs[k].seen = false;
+
+	for(i = 0; i < path_ndirs; i++) {
+		for(k = 0; k < comp_ndirs && strcmp(comp_dirs[k].dir, path_dirs[i].dir) != 0; k++)
+			;
+		if(k == comp_ndirs) {
+			comp_dir_t *dirs = (comp_dir_t *)realloc(comp_dirs, (k + 1) * sizeof(comp_dir_t));
+			if(!dirs || !(dirs[k].dir = strdup(path_dirs[i].dir))) {
+				comp_dirs = dirs ? dirs : comp_dirs;
+				continue;
 			}
-			if(!readprocessinfo(current_process, cmd))
-				return invokefree(current_job,"read process info: error");
-			if(!sequence) {
-				strncpy(current_job->commandinfo,cmdline+seq_pos,cmdline_pos-seq_pos);
+			comp_dirs = dirs;
+			comp_dirs[k].names = NULL;
+			comp_dirs[k].size = 0;
+			comp_dirs[k].mtime = (struct timespec){ 0, 0 };
+			comp_ndirs++;
+		}
+		comp_dir_t *d = &comp_dirs[k];
+		if(d->seen) /* listed twice in PATH */
+			continue;
+		d->seen = true;
+		if(stat(d->dir, &st) < 0)
+			st.st_mtim = (struct timespec){ 0, 0 };
+		if(st.st_mtim.tv_sec == d->mtime.tv_sec && st.st_mtim.tv_nsec == d->mtime.tv_nsec
+		   && d->mtime.tv_sec != 0)
+			continue;
+		comp_load(d, -1);
+		comp_scan(d);
+		comp_load(d, 1);
+		/* a change within the same second could keep the mtime: look again */
+		d->mtime = now.tv_sec <= st.st_mtim.tv_sec + 1 ? (struct timespec){ 0, 0 } : st.st_mtim;
+	}
+
+	for(k = 0; k < comp_ndirs; ) /* directories no longer in PATH */
+		if(!comp_dirs[k].seen) {
+			comp_load(&comp_dirs[k], -1);
+			free(comp_dirs[k].names);
+			free(comp_dirs[k].dir);
+			comp_dirs[k] = comp_dirs[--comp_ndirs];
+		}
+		else
+			k++;
+}
+
+/* Append the names at or below node n, whose path from the root is
+ * name[0..len), to o separated by NULs; at most *room of them. Sets
+ * *more if there are others. */
+void trie_list(uint32_t n, char *name, size_t len, outbuf_t *o, int *room, bool *more) {
+	uint32_t c;
+	if(comp_nodes[n].refs) {
+		if(*room == 0) {
+			*more = true;
+			return;
+		}
+		out_append(o, name, len + 1);
+		--*room;
+	}
+	for(c = comp_nodes[n].child; c && !*more && len + 1 < PATH_MAX; c = comp_nodes[c].sibling)
+		if(comp_nodes[c].below) {
+			name[len] = comp_nodes[c].c;
+			name[len + 1] = '\0';
+			trie_list(c, name, len + 1, o, room, more);
+		}
+}
+
+/* Line editor. An interactive shell on a terminal reads command lines
+ * with edit_line(), the terminal in raw mode: a copy of shell_tmodes
+ * without ICANON, ECHO, ISIG and IXON, restored before anything runs.
+ * The line scrolls sideways within one row. After each key refresh()
+ * compares what the row should show with what it shows and sends only
+ * the difference -- cursor motion, the changed tail, an erase -- in a
+ * single write(2). TERM=dumb or DSH_NOEDIT keeps the terminal's own line
+ * editing.
+ *
+ * Keys: Left/Right, Home/End, ^A ^E ^B ^F, Backspace, Delete, ^D (end
+ * of input on an empty line), ^K ^U ^W, ^L, ^C (drop the line), Up/Down
+ * and ^P ^N through the history, ^R to search it, Tab to complete. */
+typedef struct {
+	char *buf;		/* the line */
+	size_t len, cap;
+	size_t pos;		/* cursor, as a byte offset into buf */
+	size_t off;		/* first byte of buf on the row */
+	char *shown;		/* what the row shows after the prompt */
+	size_t shown_len, shown_cap;
+	size_t shown_cols;	/* columns it takes */
+	size_t shown_col;	/* column of the terminal's cursor after the prompt */
+	const char *prompt;
+	size_t prompt_cols;
+	int cols;		/* terminal width */
+	int hist;		/* history entry shown; hist_count + 1 for the new line */
+	char *saved;		/* the new line while the history is shown */
+	size_t saved_len;
+	unsigned char keys[256];	/* input read but not handled yet */
+	size_t key, nkeys;	/* next one, and how many are left */
+	outbuf_t out;		/* what refresh() writes */
+} editor_t;
+
+enum {
+	KEY_LEFT = 256, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_HOME, KEY_END, KEY_DELETE,
+	KEY_ESCAPE, KEY_NONE, KEY_EOF
+};
+
+editor_t editor;
+
+bool is_utf8_tail(char c) {
+	return (c & 0xc0) == 0x80;
+}
+
+/* Columns taken by the n bytes at s (UTF-8 sequences take one) */
+size_t edit_cols(const char *s, size_t n) {
+	size_t cols = 0;
+	while(n--)
+		cols += !is_utf8_tail(*s++);
+	return cols;
+}
+
+size_t next_char(editor_t *ed, size_t i) {
+	if(i < ed->len)
+		for(i++; i < ed->len && is_utf8_tail(ed->buf[i]); i++)
+			;
+	return i;
+}
+
+size_t prev_char(editor_t *ed, size_t i) {
+	if(i > 0)
+		for(i--; i > 0 && is_utf8_tail(ed->buf[i]); i--)
+			;
+	return i;
+}
+
+/* Move the terminal cursor from column from to column to of the row */
+void edit_move(outbuf_t *o, size_t from, size_t to) {
+	char seq[32];
+	if(to < from)
+		out_append(o, seq, snprintf(seq, sizeof(seq), "\033[%zuD", from - to));
+	else if(to > from)
+		out_append(o, seq, snprintf(seq, sizeof(seq), "\033[%zuC", to - from));
+}
+
+/* Bring the row up to date with the line; with full, redraw the prompt
+ * too, as after other output */
+void refresh(editor_t *ed, bool full) {
+	size_t width = ed->cols > (int)ed->prompt_cols + 1 ? ed->cols - ed->prompt_cols - 1 : 1;
+	size_t end, same, col, cols;
+
+	/* scroll so the cursor is on the row */
+	if(ed->pos < ed->off)
+		ed->off = ed->pos;
+	while(edit_cols(ed->buf + ed->off, ed->pos - ed->off) > width)
+		ed->off = next_char(ed, ed->off);
+	for(end = ed->off, cols = 0; end < ed->len && cols < width; cols++)
+		end = next_char(ed, end);
+
+	ed->out.len = 0;
+	if(full) {
+		out_append(&ed->out, "\r\033[K", 4);
+		out_append(&ed->out, ed->prompt, strlen(ed->prompt));
+		ed->shown_len = ed->shown_col = 0;
+		ed->shown_cols = 0;
+	}
+	/* keep what is already right, from the start of the row */
+	for(same = 0; same < ed->shown_len && same < end - ed->off
+	    && ed->shown[same] == ed->buf[ed->off + same]; same++)
+		;
+	while(same > 0 && same < end - ed->off && is_utf8_tail(ed->buf[ed->off + same]))
+		same--;
+	col = edit_cols(ed->buf + ed->off, same);
+	if(same < end - ed->off || col < ed->shown_cols || full) {
+		edit_move(&ed->out, ed->shown_col, col);
+		out_append(&ed->out, ed->buf + ed->off + same, end - ed->off - same);
+		col += edit_cols(ed->buf + ed->off + same, end - ed->off - same);
+		if(ed->shown_cols > col)
+			out_append(&ed->out, "\033[K", 3);
+	}
+	else /* the text is right; only the cursor moves */
+		col = ed->shown_col;
+	ed->shown_cols = edit_cols(ed->buf + ed->off, end - ed->off);
+	ed->shown_col = edit_cols(ed->buf + ed->off, ed->pos - ed->off);
+	edit_move(&ed->out, col, ed->shown_col);
+
+	if(end - ed->off > ed->shown_cap) {
+		char *shown = (char *)realloc(ed->shown, end - ed->off);
+		if(!shown) {
+			ed->shown_len = 0;
+			write_all(STDOUT_FILENO, ed->out.buf, ed->out.len);
+			return;
+		}
+		ed->shown = shown;
+		ed->shown_cap = end - ed->off;
+	}
+	memcpy(ed->shown, ed->buf + ed->off, end - ed->off);
+	ed->shown_len = end - ed->off;
+	write_all(STDOUT_FILENO, ed->out.buf, ed->out.len);
+}
+
+/* Replace the bytes [from, to) of the line with the n bytes at s and put
+ * the cursor after them; false when out of memory */
+bool edit_replace(editor_t *ed, size_t from, size_t to, const char *s, size_t n) {
+	if(ed->len - (to - from) + n + 2 > ed->cap) {
+		size_t cap = ed->cap ? ed->cap : 256;
+		while(cap < ed->len - (to - from) + n + 2)
+			cap *= 2;
+		char *buf = (char *)realloc(ed->buf, cap);
+		if(!buf)
+			return false;
+		ed->buf = buf;
+		ed->cap = cap;
+	}
+	memmove(ed->buf + from + n, ed->buf + to, ed->len - to);
+	memcpy(ed->buf + from, s, n);
+	ed->len = ed->len - (to - from) + n;
+	ed->pos = from + n;
+	return true;
+}
+
+/* Show history entry n, or the line being typed for hist_count + 1 */
+void edit_history(editor_t *ed, int n) {
+	size_t len;
+	char *s;
+
+	if(n < 1 || !hist_open() || !hist_sync() || n > hist_count + 1)
+		return;
+	if(ed->hist > hist_count) { /* leaving the new line: keep it */
+		free(ed->saved);
+		ed->saved_len = ed->len;
+		if((ed->saved = (char *)malloc(ed->len + 1)))
+			memcpy(ed->saved, ed->buf, ed->len);
+	}
+	if(n > hist_count) {
+		s = ed->saved;
+		len = ed->saved ? ed->saved_len : 0;
+	}
+	else if(!(s = hist_entry(n, &len)))
+		return;
+	ed->hist = n;
+	edit_replace(ed, 0, ed->len, s, len);
+}
+
+/* Next key: a byte, or one of KEY_*. Waits for input, reaping children
+ * and redrawing after their notifications in the meantime. */
+int edit_key(editor_t *ed) {
+	ssize_t n;
+	unsigned char c;
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+
+	while(ed->nkeys == 0) {
+		if(wait_for_input(NULL)) {
+			refresh(ed, true);
+			continue;
+		}
+		n = read(STDIN_FILENO, ed->keys, sizeof(ed->keys));
+		if(n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if(n <= 0)
+			return KEY_EOF;
+		ed->nkeys = n;
+		ed->key = 0;
+	}
+	c = ed->keys[ed->key++];
+	ed->nkeys--;
+	if(c != '\033')
+		return c;
+
+	/* an escape sequence arrives at once; a lone ESC is the key itself */
+	char seq[8];
+	int len = 0;
+	while(len < (int)sizeof(seq)) {
+		if(ed->nkeys == 0) {
+			if(poll(&pfd, 1, 25) <= 0 || (n = read(STDIN_FILENO, ed->keys, sizeof(ed->keys))) <= 0)
 				break;
-			}
-			sequence = false;
-			++cmdline_pos;
+			ed->nkeys = n;
+			ed->key = 0;
+		}
+		seq[len++] = ed->keys[ed->key++];
+		ed->nkeys--;
+		if(len > 1 && seq[len - 1] >= 0x40 && seq[len - 1] <= 0x7e)
+			break;
+		if(len == 1 && seq[0] != '[' && seq[0] != 'O')
+			break;
+	}
+	if(len < 2)
+		return KEY_ESCAPE;
+	switch(seq[len - 1]) {
+	case 'A': return KEY_UP;
+	case 'B': return KEY_DOWN;
+	case 'C': return KEY_RIGHT;
+	case 'D': return KEY_LEFT;
+	case 'H': return KEY_HOME;
+	case 'F': return KEY_END;
+	case '~':
+		switch(seq[1]) {
+		case '1': case '7': return KEY_HOME;
+		case '4': case '8': return KEY_END;
+		case '3': return KEY_DELETE;
 		}
-		return true;
 	}
+	return KEY_NONE;
+}
 
-	/* Build prompt messaage; Change this to include process ID (pid)*/
-	char* promptmsg() {
-		pid_t pid;	
+/* Print the NUL-separated names in o (count of them; more if that is not
+ * all) in columns below the line, then redraw it */
+void edit_list(editor_t *ed, outbuf_t *o, int count, bool more) {
+	size_t width = 0, len, percol;
+	char *name, pad[256];
+	int i, cols;
 
-		pid = getpid();
-		sprintf(prompt_pid, "dsh_%d$ ", pid); 	
-		return  prompt_pid;
+	for(name = o->buf, i = 0; i < count; i++, name += len + 1)
+		if((len = strlen(name)) > width)
+			width = len;
+	width += 2;
+	cols = width < (size_t)ed->cols ? ed->cols / width : 1;
+	memset(pad, ' ', sizeof(pad));
+	ed->out.len = 0;
+	out_append(&ed->out, "\r\n", 2);
+	for(name = o->buf, i = 0; i < count; i++, name += len + 1) {
+		len = strlen(name);
+		out_append(&ed->out, name, len);
+		if((i + 1) % cols == 0 || i + 1 == count)
+			out_append(&ed->out, "\r\n", 2);
+		else
+			for(percol = width - len; percol > 0; percol -= percol < sizeof(pad) ? percol : sizeof(pad))
+				out_append(&ed->out, pad, percol < sizeof(pad) ? percol : sizeof(pad));
 	}
+	if(more)
+		out_append(&ed->out, "...\r\n", 5);
+	write_all(STDOUT_FILENO, ed->out.buf, ed->out.len);
+	refresh(ed, true);
+}
 
-	int delete_job(job_t* job){
-		job_t* j;
+/* Complete the word before the cursor: as far as all candidates agree,
+ * adding a space (or / for a directory) when only one is left. With list
+ * and nothing to add, show the candidates. Returns true if the line
+ * changed. */
+bool complete(editor_t *ed, bool list) {
+	size_t start = ed->pos, i, plen, common = 0, nlen;
+	outbuf_t o = { 0 };
+	int count = 0, room = 200;
+	bool command, dir = false, more = false;
+	char name[PATH_MAX];
 
-		
-		if(job != NULL){	
-			if(job == first_job){
-				first_job = first_job->next;
+	while(start > 0 && !isspace(ed->buf[start - 1]) && !strchr("|;&<>", ed->buf[start - 1]))
+		start--;
+	plen = ed->pos - start;
+	for(i = start; i > 0 && isspace(ed->buf[i - 1]); i--)
+		;
+	command = (i == 0 || strchr("|;&", ed->buf[i - 1]))
+		&& !memchr(ed->buf + start, '/', plen);
+	if(plen >= PATH_MAX - 1)
+		return false;
 
-			}
-			else{
-				for(j=first_job; j ; j = j->next){
-					if(j->next == job){
-						j->next = j->next->next;
+	if(command) {
+		comp_refresh();
+		uint32_t n = plen ? trie_find(ed->buf + start, plen) : 0;
+		if(!comp_nodes || (plen && !n) || comp_nodes[n].below == 0) {
+			write_all(STDOUT_FILENO, "\a", 1);
+			return false;
+		}
+		/* follow the only way down while there is one */
+		memcpy(name, ed->buf + start, plen);
+		nlen = plen;
+		while(!comp_nodes[n].refs && nlen + 1 < PATH_MAX) {
+			uint32_t c, only = 0;
+			for(c = comp_nodes[n].child; c; c = comp_nodes[c].sibling)
+				if(comp_nodes[c].below) {
+					if(only)
 						break;
-					}
+					only = c;
 				}
+			if(c || !only)
+				break;
+			name[nlen++] = comp_nodes[only].c;
+			n = only;
+		}
+		/* one name, maybe found in several directories */
+		bool unique = comp_nodes[n].refs && comp_nodes[n].below == comp_nodes[n].refs;
+		if(nlen > plen || unique) {
+			edit_replace(ed, ed->pos, ed->pos, name + plen, nlen - plen);
+			if(unique)
+				edit_replace(ed, ed->pos, ed->pos, " ", 1);
+			refresh(ed, false);
+			return true;
+		}
+		if(!list)
+			return false;
+		name[nlen] = '\0';
+		trie_list(n, name, nlen, &o, &room, &more);
+		count = 200 - room;
+	}
+	else {
+		/* directory part as typed, and the start of the name */
+		char *word = ed->buf + start, *slash = memrchr(word, '/', plen);
+		size_t dlen = slash ? slash - word + 1 : 0, blen = plen - dlen;
+		dir_listing_t *d;
+		char *e, *first = NULL;
+		memcpy(name, word, dlen);
+		name[dlen] = '\0';
+		if(!(d = read_dir(name))) {
+			write_all(STDOUT_FILENO, "\a", 1);
+			return false;
+		}
+		for(e = d->names; e < d->names + d->size; e += strlen(e + 1) + 2) {
+			char *entry = e + 1;
+			size_t elen = strlen(entry);
+			if(elen < blen || memcmp(entry, word + dlen, blen) != 0
+			   || (entry[0] == '.' && (blen == 0 || word[dlen] != '.')))
+				continue;
+			if(!first) {
+				first = entry;
+				common = elen;
+				dir = *e == DT_DIR;
+			}
+			else {
+				for(i = blen; i < common && entry[i] == first[i]; i++)
+					;
+				common = i;
 			}
+			if(count < 200) {
+				out_append(&o, entry, elen + 1);
+				count++;
+			}
+			else
+				more = true;
+		}
+		if(!first) {
+			write_all(STDOUT_FILENO, "\a", 1);
+			return false;
+		}
+		if(count == 1 && (first[-1] == DT_LNK || first[-1] == DT_UNKNOWN)) {
+			struct stat st;
+			snprintf(name + dlen, sizeof(name) - dlen, "%s", first);
+			dir = stat(name, &st) == 0 && S_ISDIR(st.st_mode);
+		}
+		if(common > blen || count == 1) {
+			edit_replace(ed, ed->pos, ed->pos, first + blen, common - blen);
+			if(count == 1)
+				edit_replace(ed, ed->pos, ed->pos, dir ? "/" : " ", 1);
+			refresh(ed, false);
+			free(o.buf);
+			return true;
+		}
+		if(!list) {
+			free(o.buf);
+			return false;
+		}
+	}
+	edit_list(ed, &o, count, more);
+	free(o.buf);
+	return false;
+}
 
+/* Incremental search back through the history for what is typed after
+ * ^R. Another ^R finds the next older match; Enter runs the match, ^G or
+ * Escape goes back to the line as it was, and any other key edits the
+ * match. Returns that key, or KEY_NONE after ^G/Escape. */
+int edit_search(editor_t *ed) {
+	char query[256], prompt[300];
+	size_t qlen = 0, len;
+	const char *saved_prompt = ed->prompt;
+	char *line = (char *)malloc(ed->len + 1), *s;
+	size_t line_len = ed->len;
+	int match = 0, n, key;
+	bool failed = false;
 
-			free_job(job);
-			return 0;
-		}
+	if(line)
+		memcpy(line, ed->buf, ed->len);
+	while(1) {
+		snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ",
+			failed ? "failed " : "", (int)qlen, query);
+		ed->prompt = prompt;
+		ed->prompt_cols = edit_cols(prompt, strlen(prompt));
+		refresh(ed, true);
 
-		return -1;
+		key = edit_key(ed);
+		if(key == CTRL('r') || (key >= ' ' && key < 256) || key == CTRL('h')) {
+			int before = match ? match + 1 : hist_count + 1;
+			if(key == CTRL('r'))
+				before = match ? match : hist_count + 1;
+			else if(key == 0x7f || key == CTRL('h')) {
+				while(qlen > 0 && is_utf8_tail(query[--qlen]))
+					;
+				before = hist_count + 1;
+			}
+			else if(qlen < sizeof(query))
+				query[qlen++] = key;
+			if(qlen == 0) {
+				failed = false;
+				continue;
+			}
+			if((n = hist_search(query, qlen, before)) && (s = hist_entry(n, &len))) {
+				match = n;
+				failed = false;
+				edit_replace(ed, 0, ed->len, s, len);
+				ed->pos = (char *)memmem(s, len, query, qlen) - s;
+				ed->hist = n;
+			}
+			else
+				failed = true;
+			continue;
+		}
+		ed->prompt = saved_prompt;
+		ed->prompt_cols = edit_cols(saved_prompt, strlen(saved_prompt));
+		if(key == CTRL('g') || key == KEY_ESCAPE) {
+			if(line)
+				edit_replace(ed, 0, ed->len, line, line_len);
+			key = KEY_NONE;
+		}
+		free(line);
+		refresh(ed, true);
+		return key;
 	}
-//=============================
+}
 
+/* Read a line with the editor after printing prompt. Its text stays in
+ * editor.buf until the next call; *line is set to it, newline included,
+ * and its length returned. -1 at end of input. */
+ssize_t edit_line(char *prompt, char **line) {
+	editor_t *ed = &editor;
+	struct termios raw = shell_tmodes;
+	struct winsize ws;
+	int key, tabs = 0;
+	ssize_t rc = -2;
+	size_t i;
 
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+	raw.c_iflag &= ~(IXON | ICRNL | INLCR);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(shell_terminal, TCSADRAIN, &raw);
+	ed->cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col ? ws.ws_col : 80;
+	ed->prompt = prompt;
+	ed->prompt_cols = edit_cols(prompt, strlen(prompt));
+	ed->len = ed->pos = ed->off = 0;
+	ed->hist = hist_open() && hist_sync() ? hist_count + 1 : 1;
+	edit_replace(ed, 0, 0, "", 0);
+	refresh(ed, true);
 
+	while(rc == -2) {
+		key = edit_key(ed);
+		if(key == CTRL('r') && hist_open())
+			key = edit_search(ed);
+		tabs = key == '\t' ? tabs + 1 : 0;
+		switch(key) {
+		case '\r':
+		case '\n':
+			ed->pos = ed->len;
+			refresh(ed, false);
+			write_all(STDOUT_FILENO, "\r\n", 2);
+			edit_replace(ed, ed->len, ed->len, "\n", 1);
+			rc = ed->len;
+			break;
+		case KEY_EOF:
+			rc = -1;
+			break;
+		case CTRL('d'):
+			if(ed->len == 0) {
+				rc = -1;
+				break;
+			}
+			/* fall through */
+		case KEY_DELETE:
+			edit_replace(ed, ed->pos, next_char(ed, ed->pos), "", 0);
+			break;
+		case 0x7f:
+		case CTRL('h'):
+			i = prev_char(ed, ed->pos);
+			edit_replace(ed, i, ed->pos, "", 0);
+			break;
+		case KEY_LEFT:
+		case CTRL('b'):
+			ed->pos = prev_char(ed, ed->pos);
+			break;
+		case KEY_RIGHT:
+		case CTRL('f'):
+			ed->pos = next_char(ed, ed->pos);
+			break;
+		case KEY_HOME:
+		case CTRL('a'):
+			ed->pos = 0;
+			break;
+		case KEY_END:
+		case CTRL('e'):
+			ed->pos = ed->len;
+			break;
+		case CTRL('k'):
+			ed->len = ed->pos;
+			break;
+		case CTRL('u'):
+			edit_replace(ed, 0, ed->pos, "", 0);
+			break;
+		case CTRL('w'):
+			for(i = ed->pos; i > 0 && isspace(ed->buf[i - 1]); i--)
+				;
+			while(i > 0 && !isspace(ed->buf[i - 1]))
+				i--;
+			edit_replace(ed, i, ed->pos, "", 0);
+			break;
+		case KEY_UP:
+		case CTRL('p'):
+			edit_history(ed, ed->hist - 1);
+			break;
+		case KEY_DOWN:
+		case CTRL('n'):
+			edit_history(ed, ed->hist + 1);
+			break;
+		case CTRL('l'):
+			write_all(STDOUT_FILENO, "\033[H\033[2J", 7);
+			refresh(ed, true);
+			continue;
+		case CTRL('c'):
+			write_all(STDOUT_FILENO, "^C\r\n", 4);
+			ed->len = ed->pos = 0;
+			edit_replace(ed, 0, 0, "\n", 1);
+			rc = ed->len;
+			break;
+		case '\t':
+			if(complete(ed, tabs > 1))
+				tabs = 0;
+			continue;
+		default:
+			if(key >= ' ' && key < 256 && key != 0x7f) {
+				char c = key;
+				edit_replace(ed, ed->pos, ed->pos, &c, 1);
+			}
+			break;
+		}
+		if(rc == -2)
+			refresh(ed, false);
+	}
+	tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+	*line = ed->buf;
+	return rc;
+}
 
+	/* Called at end of input; the log gets the session's command rate.
+	 * Like sh, dsh exits with the status of the last command. */
+	void exit_shell(unsigned long commands, struct timespec *start) {
+		struct timespec now;
+		double elapsed;
 
+		fflush(stdout);
+		if(shell_is_interactive)
+			printf("\n");
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = elapsed_since(start, &now);
+		log_event("end", "commands=%lu elapsed=%.6f rate=%.0f",
+			commands, elapsed, elapsed > 0 ? commands / elapsed : 0.0);
+		exit(last_status);
+	}
 
-//=============================
-	void finishFGJob (job_t *j)
-     {
-       int status;
-       pid_t pid;
-     
-	do
-         pid = waitpid (WAIT_ANY, &status, WUNTRACED);
-       while (!mark_process_status (pid, status)
-              && !job_is_stopped (j)
-              && !job_is_completed (j));
-     }
+	/* dsh            interactive on a terminal, or commands from stdin
+	 * dsh script     commands from the file script
+	 * dsh -c string  commands from string
+	 */
+	int main(int argc, char *argv[]) {
+		struct timespec start;
+		unsigned long commands = 0;
+
+		note_inherited_fds();
+		if(argc > 1 && strcmp(argv[1], "-c") == 0) {
+			if(argc < 3) {
+				fprintf(stderr, "dsh: -c: option requires an argument\n");
+				exit(2);
+			}
+			shell_input.fd = -1;
+			shell_input.buf = argv[2];
+			shell_input.cap = shell_input.end = strlen(argv[2]);
+			shell_input.eof = true;
+			if(argc > 3) { /* dsh -c string name args ... */
+				pos_argv = argv + 3;
+				pos_argc = argc - 3;
+			}
+		}
+		else if(argc > 1) {
+			if((shell_input.fd = open(argv[1], O_RDONLY | O_CLOEXEC)) < 0) {
+				perror(argv[1]);
+				exit(127);
+			}
+			pos_argv = argv + 1;
+			pos_argc = argc - 1;
+		}
 
-	int main() {
-		int fd = open ("dsh.log", O_TRUNC | O_CREAT | O_WRONLY, 0666);	
-		dup2(fd, 2); 
+		log_open();
 		
 		init_shell();
+		clock_gettime(CLOCK_MONOTONIC, &start);
 
 		while(1) {
 		if(!readcmdline(promptmsg())) {
-			if (feof(stdin)) { /* End of file (ctrl-d) */
-				fflush(stdout);
-				printf("\n");
-				exit(EXIT_SUCCESS);
-                	}
+			if (input_done(&shell_input)) /* End of file (ctrl-d) */
+				exit_shell(commands, &start);
 			continue; /* NOOP; user entered return or spaces with return */
 		}
 		/* Only for debugging purposes and to show parser output */
 		//print_job();
 
-		/* Your code goes here */
 		/* You need to loop through jobs list since a command line can contain ;*/
-		
-		/* Check for built-in commands */
-		// jobs, fg, bg, cd
-		
-		job_t *j;
-		process_t *p;
-		bool isBuiltIn = false;
-		job_t *jobs_job =NULL; 
-		job_t *fg_job = NULL;
-		job_t *bg_job = NULL;
-		job_t *cd_job = NULL;
-		for(j = first_job; j; j = j->next) {
-			if(j->pgid < 0)
-			{
-				//fprintf(stdout, "job: %s\n", j->commandinfo);
-				for(p = j->first_process; p; p = p->next) {
-
-					if(strcmp(p->argv[0], "jobs") == 0)
-					{
-						isBuiltIn = true; 
-						job_t *j2;
-						job_t* jobs_to_delete[max_num_jobs] = {NULL};
-						int num = 0;
-						for(j2 = first_job; j2; j2 = j2->next) {
-							// as long as the job you are processing is NOT this current 'jobs' command
-							if(j2 != j){
-								fprintf(stdout, "[%d]+ \t\t",j2->pgid);
-								// If all processes are completed
-								if(job_is_completed(j2)){
-									fprintf(stdout, "Done");
-									fprintf(stdout, "\t\t %s\n", j2->commandinfo);
-									jobs_to_delete[num] = j2;
-								}
-								// If all processes are completed or stopped (thus if there are jobs that are stopped & not completed
-								else if(job_is_stopped(j2)){
-									fprintf(stdout, "Stopped");
-									fprintf(stdout, "\t\t %s\n", j2->commandinfo);
-								}
-								else{
-									fprintf(stdout, "Running");
-									fprintf(stdout, "\t\t %s\n", j2->commandinfo);
-								}
-							}
-							else{
-								// processing current jobs command
-								jobs_job = j;
-							}
-							num++;							
-						} 
-						// delete all the jobs that have completed
-						int i;
-						for(i=0;i<max_num_jobs;i++){
-							if(jobs_to_delete[i] != NULL){
-								delete_job(jobs_to_delete[i]);
-							}
-						}
-
-						break;
-					}
-					else if(strcmp(p->argv[0], "fg") == 0){ 
-						isBuiltIn = true; 
-						
-						fg_job = j;
-						int intpgid; 	
-						if(p->argv[1] != NULL)
-							intpgid = atoi(p->argv[1]);	
-						else{
-							fprintf(stderr, "Forgot pgid for fg (job)");
-							tcsetpgrp (shell_terminal, shell_pgid);
-							tcgetattr (shell_terminal, &j->tmodes);
-							tcsetattr (shell_terminal, TCSADRAIN, &shell_tmodes); 	
-							break;
-					 	}	
-			
-						pid_t currPgid = intpgid; 
-						
-						job_t *m; 
-						for(m = first_job; m; m = m->next)
-						{
-							if(m->pgid == currPgid)
-							{
-								tcsetpgrp (shell_terminal, m->pgid);								
-								finishFGJob(m); 
-								break; 
-							}
-			
-						} 
-
-						tcsetpgrp (shell_terminal, shell_pgid);
-						tcgetattr (shell_terminal, &j->tmodes);
-						tcsetattr (shell_terminal, TCSADRAIN, &shell_tmodes); 					
-						break;
-					}
-					else if(strcmp(p->argv[0], "bg") == 0){ 
-						isBuiltIn = true; 
-						j->bg = true;
-						bg_job = j; 						
-						break;
-					}
-					else if(strcmp(p->argv[0], "cd") == 0){
-						isBuiltIn = true; 
-						cd_job = j;
-						if(chdir(p->argv[1]) < 0){
-							perror("chdir error");
-						}
-						break;
-					} 
-				}
+		job_t *j, *jnext;
+		for(j = first_job; j; j = jnext) {
+			jnext = j->next;
+			if(j->pgid >= 0) /* spawned by an earlier command line */
+				continue;
+			commands++;
 
-				// If running in the background
-				if(!isBuiltIn)
-				{
-					if(j->bg){
-						spawn_job(j, false);
-					}
-					// If running in the foreground
-					else{
-						spawn_job(j, true);
-					}
-				}
+			if(j->body)
+				last_status = run_compound(j);
+			else {
+				last_status = run_job(j);
+				if(j->pgid < 0) /* ran in the shell */
+					delete_job(j);
 			}
 		}
 
-		//this is where you delete jobs_job
-		if(jobs_job != NULL)
-		{
-			delete_job(jobs_job);
-		}	
-		if(fg_job !=NULL)
-		{
-			delete_job(fg_job);
-		}
-		if(bg_job != NULL)
-		{
-			delete_job(bg_job);
-		}
-		if(cd_job != NULL)
-		{
-			delete_job(cd_job);
-		}
-
-		pid_t pid; 
-		int status; 
-		do 
-			pid = waitpid (WAIT_ANY, &status, WUNTRACED|WNOHANG);
-       			while (!mark_process_status (pid, status));
+		capture_drain_ready();
+		reap_children();
+		do_job_notification(false);
 	}	
 	closelog(); 
 }
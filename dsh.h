@@ -2,33 +2,187 @@
 #define __DSH_H__
 
 #include <stdio.h>
+#include <stdint.h>
 
-/* Max length of input/output file name specified during I/O redirection */
-#define MAX_LEN_FILENAME 80
+/* using bool as built-in; char is better in terms of space utilization, but
+ * code is not succint */
+typedef enum { false, true } bool;
 
-/*Max length of the command line */
-#define MAX_LEN_CMDLINE	120
+/* Backend used by spawn_job() to start each process of a job */
+typedef enum { LAUNCH_FORK, LAUNCH_SPAWN } launch_t;
 
-#define MAX_ARGS 20 /* Maximum number of arguments to any command */
+/* Command line scanners, one per instruction set; see set_scanner() */
+typedef struct scanner {
+        const char *name;
+        size_t (*job)(const char *s, size_t len);   /* next ; & # ' " or \ */
+        size_t (*word)(const char *s, size_t len);  /* next byte that ends or quotes a word */
+} scanner_t;
 
-/*file descriptors for input and output; the range of fds are from 0 to 1023;
- * 0, 1, 2 are reserved for stdin, stdout, stderr */
-#define INPUT_FD  1000
-#define OUTPUT_FD 1001
+/* Bump allocator backing a job; see arena_new() in dsh.c */
+typedef struct arena_chunk {
+        struct arena_chunk *next;   /* previously filled chunk */
+        size_t size;                /* bytes in data */
+        size_t used;                /* bytes handed out so far */
+        char data[];
+} arena_chunk_t;
 
-/* using bool as built-in; char is better in terms of space utilization, but
- * code is not succint */
-typedef enum { false, true } bool;
+typedef struct arena {
+        arena_chunk_t *chunk;       /* chunk currently being filled */
+} arena_t;
+
+/* Buffered source of command lines; see read_line() in dsh.c */
+typedef struct input {
+        int fd;                     /* descriptor read from; -1 for a string */
+        char *buf;                  /* buffered input */
+        size_t cap;                 /* bytes allocated for buf */
+        size_t start, end;          /* unread bytes are buf[start..end) */
+        bool eof;                   /* nothing more to read from fd */
+} input_t;
+
+/* Shell variable; see env_set() in dsh.c */
+typedef struct env_var {
+        struct env_var *next;       /* next variable in the same bucket */
+        char *entry;                /* "NAME=value", as exec takes it */
+        size_t name_len;            /* length of NAME */
+        bool exported;              /* passed on to children */
+        size_t size;                /* bytes allocated for entry */
+} env_var_t;
+
+/* Command lookup cache; see resolve_command() in dsh.c */
+typedef struct path_entry {
+        struct path_entry *next;    /* next entry in the same bucket */
+        char *name;                 /* command name */
+        char *path;                 /* where it was found in PATH */
+        int dir;                    /* index of that directory in PATH */
+        unsigned long hits;         /* lookups this entry answered */
+} path_entry_t;
+
+typedef struct path_dir {
+        char *dir;                  /* a directory of PATH */
+        struct timespec mtime;      /* its mtime when last checked */
+} path_dir_t;
+
+/* Entries of the history file holding a trigram; see hist_index() in dsh.c */
+typedef struct hist_gram {
+        struct hist_gram *next;     /* next trigram in the same bucket */
+        uint32_t gram;              /* three bytes, first one highest */
+        uint32_t count, size;       /* entries in ids, slots allocated */
+        uint32_t *ids;              /* entry numbers, ascending */
+} hist_gram_t;
+
+/* Directory listing kept for globbing; see read_dir() in dsh.c */
+typedef struct dir_listing {
+        dev_t dev;                  /* identity of the directory */
+        ino_t ino;
+        struct timespec mtime;      /* its mtime when it was read */
+        bool racy;                  /* read too soon after that mtime to trust */
+        char *names;                /* entries as [d_type][name NUL] records */
+        size_t size;                /* bytes in names */
+} dir_listing_t;
+
+/* An argument to glob when its job runs; see expand_globs() in dsh.c */
+typedef struct glob_word {
+        struct glob_word *next;     /* next one, in argv order */
+        int index;                  /* position in argv */
+        char *pattern;              /* the word with quoted characters escaped by \ */
+} glob_word_t;
+
+/* A word with $ references, as pieces to join when its job runs; see
+ * compile_word() in dsh.c */
+typedef struct word_part {
+        struct word_part *next;     /* next piece of the word */
+        char *text;                 /* literal text, or the name of what is referenced */
+        size_t len;                 /* literal text: its length */
+        bool var;                   /* text is a name: $NAME, ${NAME}, $1, $?, $# or $$ */
+} word_part_t;
+
+/* An argument to expand when its job runs; see expand_vars() in dsh.c */
+typedef struct var_word {
+        struct var_word *next;      /* next one, in argv order */
+        int index;                  /* position in argv */
+        word_part_t *parts;
+} var_word_t;
+
+/* One redirection of a process. A process's redirections are applied in
+ * the order given, after its pipes; see redirect_child() in dsh.c */
+typedef enum {
+        REDIR_IN,                   /* n<file */
+        REDIR_OUT,                  /* n>file */
+        REDIR_APPEND,               /* n>>file */
+        REDIR_DUP,                  /* n>&m or n<&m */
+        REDIR_HEREDOC               /* n<<word or n<<<word; see heredoc_new() */
+} redir_kind_t;
+
+typedef struct redir {
+        struct redir *next;         /* next redirection of the same process */
+        redir_kind_t kind;
+        int fd;                     /* descriptor redirected */
+        int from;                   /* REDIR_DUP: descriptor copied to fd; REDIR_HEREDOC: its memfd */
+        char *file;                 /* the others: file opened on fd */
+        char *delim;                /* REDIR_HEREDOC: line ending the body, until it is read */
+        word_part_t *parts;         /* file: how to expand it, if it has $ references */
+} redir_t;
+
+/* Output of a background job kept by the shell; see capture_start() in dsh.c */
+typedef struct capture {
+        struct capture *next;       /* next capture, newer */
+        struct job *job;            /* the job; NULL once it is deleted */
+        int id;                     /* its job id */
+        pid_t pgid;                 /* its pgid, once it is deleted */
+        char *commandinfo;          /* its command line */
+        int fd;                     /* read end of its output pipe; -1 at end of file */
+        int attach_fd;              /* where output is copied as it arrives, or -1 */
+        char *ring;                 /* the last size bytes of output */
+        size_t size;                /* bytes mapped for ring */
+        uint64_t total;             /* bytes of output so far */
+} capture_t;
+
+/* What the cache prefix keys a job on; see cache_key() in dsh.c */
+typedef struct cache_req {
+        char **inputs;              /* files named with -i */
+        int ninputs;
+        char *key;                  /* cwd, argv, executables, redirections, inputs, environment */
+        size_t key_len;
+        uint64_t hash;              /* of key; names its entry */
+        char *out;                  /* absolute path of the file stdout goes to */
+} cache_req_t;
+
+/* Scheduling settings of a job, applied to each of its processes before
+ * exec; see prefix_sched() in dsh.c */
+typedef struct sched_req {
+        bool has_cpus;
+        cpu_set_t cpus;             /* -c: CPUs it may run on */
+        char *cpu_list;             /* the same, as given */
+        bool has_nice;
+        int nice;                   /* -n: nice value */
+        int policy;                 /* -p: SCHED_OTHER, SCHED_BATCH or SCHED_IDLE; -1 if not set */
+        int ioprio;                 /* -i: class and level, as ioprio_set takes them; -1 if not set */
+        int mempolicy;              /* -m: MPOL_DEFAULT, _LOCAL, _BIND, _INTERLEAVE or _PREFERRED; -1 if not set */
+        unsigned long nodes[16];    /* its NUMA nodes */
+        char *mem_arg;              /* -m as given */
+} sched_req_t;
 
 /* A process is a single process.  */
 typedef struct process {
         struct process *next;       /* next process in pipeline */
-	int argc;		    /* useful for free(ing) argv */
-        char **argv;                /* for exec; argv[0] is the path of the executable file; argv[1..] is the list of arguments*/
+        struct process *hash_next;  /* next process in the same pid index bucket */
+        struct job *job;            /* job this process belongs to */
+	int argc;		    /* number of words in argv */
+	int argv_size;		    /* slots allocated for argv */
+        char **argv;                /* for exec; argv[0] is the command name or path; argv[1..] is the list of arguments*/
+        char *path;                 /* executable run for argv[0], found in PATH if it has no slash */
+        char **assign;              /* NAME=value words given before the command */
+        int nassign;                /* how many */
+        glob_word_t *globs;         /* arguments to glob before it runs */
+        var_word_t *vars;           /* arguments to expand before that */
+        redir_t *redirs;            /* redirections, in order */
         pid_t pid;                  /* process ID */
         bool completed;             /* true if process has completed */
         bool stopped;               /* true if process has stopped */
         int status;                 /* reported status value from job control; 0 on success and nonzero otherwise */
+        struct timespec start;      /* when the process was launched (CLOCK_MONOTONIC) */
+        struct timespec end;        /* when it was reaped */
+        struct rusage rusage;       /* resource usage reported by wait4 */
 } process_t;
 
 /* A job is a process itself or a pipeline of processes.
@@ -37,6 +191,11 @@ typedef struct process {
  */
 typedef struct job {
         struct job *next;           /* next job */
+        struct job *prev;           /* previous job */
+        struct job *hash_next;      /* next job in the same pgid index bucket */
+        struct job *changed_next;   /* next job queued for notification */
+        bool changed;               /* true while queued for notification */
+        int id;                     /* small job id; stable for the life of the job */
         char *commandinfo;          /* entire command line input given by the user; useful for logging and message display*/
         process_t *first_process;   /* list of processes in this job */
         pid_t pgid;                 /* process group ID */
@@ -44,14 +203,65 @@ typedef struct job {
         struct termios tmodes;      /* saved terminal modes */
         int mystdin, mystdout, mystderr;  /* standard i/o channels */
         bool bg;                    /* true when & is issued on the command line */
-        char *ifile;                /* stores input file name when < is issued */
-        char *ofile;                /* stores output file name when > is issued */
+        arena_t *arena;             /* owns the job and everything parsed for it */
+        int pipe_size;              /* capacity of this job's pipes; 0 for the shell's */
+        bool timed;                 /* run under the time prefix */
+        struct timespec start;      /* launch of the first process */
+        struct timespec end;        /* reap of the last process */
+        struct rusage rusage;       /* sum over its processes; ru_maxrss is the largest */
+        capture_t *capture;         /* where its output goes, if captured */
+        cache_req_t *cache;         /* run under the cache prefix */
+        sched_req_t *sched;         /* run under the sched prefix, or changed by sched since */
+        struct node *body;          /* a compound command, run by the shell; see run_node() */
+        bool kept;                  /* body defines a function, so it is never freed */
+        struct node *node;          /* node this job is a run of; it owns the job's arena */
 } job_t;
 
+/* Compound commands, parsed once into a tree; see readcompound() in dsh.c */
+typedef enum {
+        NODE_JOB,                   /* a pipeline */
+        NODE_AND,                   /* cond && body */
+        NODE_OR,                    /* cond || body */
+        NODE_IF,                    /* if cond; then body; else orelse; fi */
+        NODE_WHILE,                 /* while cond; do body; done */
+        NODE_UNTIL,                 /* until cond; do body; done */
+        NODE_FOR,                   /* for name in job; do body; done */
+        NODE_GROUP,                 /* { body; } */
+        NODE_FUNC                   /* name() body */
+} node_kind_t;
+
+typedef struct node {
+        struct node *next;          /* next command of the same list */
+        node_kind_t kind;
+        struct node *cond, *body, *orelse;
+        job_t *job;                 /* NODE_JOB: the pipeline as parsed; NODE_FOR: the words
+                                     * (NULL for the positional parameters); NODE_FUNC: the
+                                     * job holding the tree */
+        arena_t *scratch;           /* where runs of job are built, emptied for each run */
+        char *name;                 /* NODE_FOR: the variable; NODE_FUNC: the function */
+} node_t;
+
+/* A function defined by name() body; see define_function() in dsh.c */
+typedef struct func {
+        struct func *next;
+        char *name;
+        node_t *body;
+} func_t;
+
+/* A command run inside the shell; see builtins[] in dsh.c. in and out are
+ * the descriptors for its stdin and stdout; returns the exit status. */
+typedef struct builtin {
+        const char *name;
+        int (*fn)(job_t *j, process_t *p, int in, int out);
+} builtin_t;
+
+/* Debug messages are records in the event log; see log_event() */
+void log_event(const char *event, const char *fmt, ...);
+
 #ifdef NDEBUG
         #define DEBUG(M, ...)
 #else
-        #define DEBUG(M, ...) fprintf(stderr, "[DEBUG] %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+        #define DEBUG(M, ...) log_event("debug", "%s:%d: " M, __FILE__, __LINE__, ##__VA_ARGS__)
 #endif
 
 #endif /* __DSH_H__*/
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Regression checks: each runs one dsh -c command line and compares its
+# output and exit status with what sh gives. Usage: tests/run.sh
+
+DSH=${DSH:-./dsh}
+failed=0
+
+# check NAME EXPECTED-OUTPUT EXPECTED-STATUS COMMAND
+check() {
+	out=$("$DSH" -c "$4" 2>&1)
+	status=$?
+	if [ "$out" != "$2" ] || [ $status -ne $3 ]; then
+		printf 'FAIL %s\n  expected (%d): %s\n  got (%d): %s\n' "$1" $3 "$2" $status "$out"
+		failed=$((failed + 1))
+	fi
+}
+
+# parallel takes its command words literally: a quoted space or ; stays
+# inside the one argument
+check "parallel quoted ;" "0 1 2 3" 0 \
+	'parallel -j 3 sh -c "sleep 0.1; exit {}" ::: 0 1 2 3 > /dev/null; echo 0 1 2 3'
+check "parallel status" "1" 0 \
+	'parallel sh -c "exit {}" ::: 0 1 > /dev/null; echo $?'
+check "parallel quoted space" "a b;c x" 0 \
+	"parallel /bin/echo 'a b;c' {} ::: x | head -1"
+
+# a builtin in the shell resolves n>&m in order, m made by an earlier one
+check "builtin swaps fds" "x" 0 \
+	'echo x 3>&1 1>&2 2>&3'
+
+# cat of a missing file is not planned away: cat complains and wc runs
+check "cat missing | wc" "cat: nofile: No such file or directory
+0
+0" 0 \
+	'cat nofile | wc -l; echo $?'
+
+# a line that does not parse has status 2, and so does exit with a word
+check "parse error status" "reading cmdline: unterminated quote" 2 \
+	'echo "unterminated'
+check "exit non-numeric" "exit: abc: numeric argument required" 2 \
+	'exit abc'
+
+[ $failed -eq 0 ] && echo "all passed" || { echo "$failed failed"; exit 1; }